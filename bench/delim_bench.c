@@ -0,0 +1,135 @@
+/**
+ * Message delimiter scanner benchmark.
+ *
+ * Fills a buffer with \0-terminated messages of a few average lengths, like
+ * the ones boxes keep back to back, and finds every delimiter with a
+ * byte-at-a-time loop and with each kernel of utils/delim.h the CPU supports.
+ * Prints one CSV row per run:
+ *
+ *   kernel,avg_msg_len,bytes,delims,seconds,gb_per_sec
+ *
+ * usage: delim_bench [buffer_mib] [rounds]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "delim.h"
+
+#define DEFAULT_BUFFER_MIB 64
+#define DEFAULT_ROUNDS 5
+// Offsets found per call, as a box replay asks for
+#define ENDS_PER_SCAN 1024
+
+static const size_t msg_lens[] = {16, 64, 256, 1024};
+static const char *kernels[] = {"scalar", "sse2", "avx2"};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// The baseline: looks at every byte
+static size_t scan_bytes(const char *data, size_t len, size_t *ends,
+                         size_t max) {
+    size_t count = 0;
+    for (size_t i = 0; i < len && count < max; i++) {
+        if (data[i] == '\0') {
+            ends[count++] = i;
+        }
+    }
+    return count;
+}
+
+// Messages of 1 to 2 * avg_len - 1 printable bytes, each followed by a \0
+static void fill(char *data, size_t len, size_t avg_len) {
+    size_t i = 0;
+    while (i < len) {
+        size_t msg_len = 1 + (size_t)rand() % (2 * avg_len - 1);
+        for (size_t j = 0; j < msg_len && i < len; j++) {
+            data[i++] = (char)('a' + rand() % 26);
+        }
+        if (i < len) {
+            data[i++] = '\0';
+        }
+    }
+}
+
+// Finds every delimiter of the buffer, ENDS_PER_SCAN at a time
+static size_t scan_all(delim_scan_fn scan, const char *data, size_t len,
+                       size_t *ends) {
+    size_t delims = 0;
+    size_t offset = 0;
+    while (offset < len) {
+        size_t found = scan(data + offset, len - offset, ends, ENDS_PER_SCAN);
+        delims += found;
+        if (found < ENDS_PER_SCAN) {
+            break;
+        }
+        offset += ends[found - 1] + 1;
+    }
+    return delims;
+}
+
+static void bench_run(const char *name, delim_scan_fn scan, const char *data,
+                      size_t len, size_t avg_len, size_t rounds,
+                      size_t expected, size_t *ends) {
+    size_t delims = 0;
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        delims = scan_all(scan, data, len, ends);
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+    if (delims != expected) {
+        fprintf(stderr, "%s found %zu delimiters instead of %zu\n", name,
+                delims, expected);
+        exit(EXIT_FAILURE);
+    }
+    printf("%s,%zu,%zu,%zu,%.6f,%.3f\n", name, avg_len, len, delims, seconds,
+           (double)(len * rounds) / seconds / 1e9);
+}
+
+int main(int argc, char **argv) {
+    size_t mib = DEFAULT_BUFFER_MIB;
+    size_t rounds = DEFAULT_ROUNDS;
+    if (argc > 1) {
+        mib = (size_t)atoi(argv[1]);
+    }
+    if (argc > 2) {
+        rounds = (size_t)atoi(argv[2]);
+    }
+    if (mib == 0 || rounds == 0) {
+        fprintf(stderr, "usage: delim_bench [buffer_mib] [rounds]\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t len = mib * 1024 * 1024;
+    char *data = malloc(len);
+    size_t *ends = malloc(ENDS_PER_SCAN * sizeof(size_t));
+    if (data == NULL || ends == NULL) {
+        fprintf(stderr, "failed to alloc %zu MiB\n", mib);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "delim_scan uses %s\n", delim_kernel_name());
+    printf("kernel,avg_msg_len,bytes,delims,seconds,gb_per_sec\n");
+    for (size_t m = 0; m < sizeof(msg_lens) / sizeof(msg_lens[0]); m++) {
+        srand(1);
+        fill(data, len, msg_lens[m]);
+        size_t expected = scan_all(scan_bytes, data, len, ends);
+        bench_run("bytes", scan_bytes, data, len, msg_lens[m], rounds,
+                  expected, ends);
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            delim_scan_fn scan = delim_kernel(kernels[k]);
+            if (scan != NULL) {
+                bench_run(kernels[k], scan, data, len, msg_lens[m], rounds,
+                          expected, ends);
+            }
+        }
+    }
+    free(ends);
+    free(data);
+    return 0;
+}
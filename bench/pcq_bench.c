@@ -0,0 +1,296 @@
+/**
+ * Producer-consumer queue benchmark.
+ *
+ * Runs every combination of 1..N producers, 1..N consumers and a few queue
+ * capacities, for each queue backend, and prints one CSV row per run:
+ *
+ *   backend,producers,consumers,capacity,ops,seconds,ops_per_sec,
+ *   p50_ns,p99_ns,p999_ns,voluntary_csw,involuntary_csw
+ *
+ * Latencies are measured from just before the enqueue to just after the
+ * dequeue of each element. Context switches are the process-wide deltas
+ * reported by getrusage(2).
+ *
+ * usage: pcq_bench [max_threads] [ops_per_run]
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "producer-consumer.h"
+#include "work-stealing.h"
+
+#define DEFAULT_MAX_THREADS 4
+#define DEFAULT_OPS 50000
+
+static const size_t capacities[] = {1, 16, 256};
+
+typedef struct bench_elem_t {
+    // pc_queue_t expects queue objects
+    queue_obj_t obj;
+    uint64_t enqueued_ns;
+} bench_elem_t;
+
+/**
+ * A queue backend: a multi-producer queue or a single-producer scheduler
+ */
+typedef struct backend_t {
+    const char *name;
+    bool single_producer;
+    void *(*create)(size_t consumers, size_t capacity);
+    void (*enqueue)(void *queue, bench_elem_t *elem);
+    bench_elem_t *(*dequeue)(void *queue, size_t consumer);
+    void (*destroy)(void *queue);
+} backend_t;
+
+typedef struct run_t {
+    const backend_t *backend;
+    void *queue;
+    bench_elem_t *elems;
+    bench_elem_t *stop;
+    size_t producers;
+    size_t ops;
+    uint64_t *latencies;
+    size_t n_latencies;
+    pthread_mutex_t latencies_lock;
+} run_t;
+
+typedef struct thread_arg_t {
+    run_t *run;
+    size_t id;
+} thread_arg_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * pc_queue_t backend
+ */
+static void *pcq_backend_create(size_t consumers, size_t capacity) {
+    (void)consumers;
+    pc_queue_t *queue = malloc(sizeof(pc_queue_t));
+    if (queue == NULL || pcq_create(queue, capacity) != 0) {
+        fprintf(stderr, "failed to create pc_queue_t\n");
+        exit(EXIT_FAILURE);
+    }
+    return queue;
+}
+
+static void pcq_backend_enqueue(void *queue, bench_elem_t *elem) {
+    pcq_enqueue((pc_queue_t *)queue, elem);
+}
+
+static bench_elem_t *pcq_backend_dequeue(void *queue, size_t consumer) {
+    (void)consumer;
+    return (bench_elem_t *)pcq_dequeue((pc_queue_t *)queue);
+}
+
+static void pcq_backend_destroy(void *queue) {
+    pc_queue_t *pcq = (pc_queue_t *)queue;
+    // pcq_destroy frees whatever is left in the buffer, which is empty here
+    pcq_destroy(pcq);
+    free(pcq->pcq_buffer);
+    free(pcq);
+}
+
+/*
+ * Work-stealing scheduler backend (the broker's request queue)
+ */
+typedef struct ws_backend_t {
+    ws_scheduler_t scheduler;
+    ws_worker_t *workers;
+} ws_backend_t;
+
+static void *ws_backend_create(size_t consumers, size_t capacity) {
+    ws_backend_t *ws = malloc(sizeof(ws_backend_t));
+    size_t lane_depth[WS_LANES] = {capacity, 1};
+    if (ws == NULL ||
+        ws_create(&ws->scheduler, consumers, lane_depth, WS_STRICT_PRIORITY) !=
+            0) {
+        fprintf(stderr, "failed to create ws_scheduler_t\n");
+        exit(EXIT_FAILURE);
+    }
+    ws->workers = calloc(consumers, sizeof(ws_worker_t));
+    for (size_t i = 0; i < consumers; i++) {
+        ws->workers[i].scheduler = &ws->scheduler;
+        ws->workers[i].id = i;
+    }
+    return ws;
+}
+
+static void ws_backend_enqueue(void *queue, bench_elem_t *elem) {
+    ws_backend_t *ws = (ws_backend_t *)queue;
+    ws_submit(&ws->scheduler, elem, WS_LANE_CONTROL, WS_ANY_WORKER);
+}
+
+static bench_elem_t *ws_backend_dequeue(void *queue, size_t consumer) {
+    ws_backend_t *ws = (ws_backend_t *)queue;
+    return (bench_elem_t *)ws_take(&ws->workers[consumer]);
+}
+
+static void release_nothing(void *elem) { (void)elem; }
+
+static void ws_backend_destroy(void *queue) {
+    ws_backend_t *ws = (ws_backend_t *)queue;
+    ws_destroy(&ws->scheduler, release_nothing);
+    free(ws->workers);
+    free(ws);
+}
+
+static const backend_t backends[] = {
+    {"pcq", false, pcq_backend_create, pcq_backend_enqueue,
+     pcq_backend_dequeue, pcq_backend_destroy},
+    {"ws", true, ws_backend_create, ws_backend_enqueue, ws_backend_dequeue,
+     ws_backend_destroy},
+};
+
+static void *producer(void *arg) {
+    thread_arg_t *targ = (thread_arg_t *)arg;
+    run_t *run = targ->run;
+    for (size_t i = targ->id; i < run->ops; i += run->producers) {
+        bench_elem_t *elem = &run->elems[i];
+        elem->enqueued_ns = now_ns();
+        run->backend->enqueue(run->queue, elem);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    thread_arg_t *targ = (thread_arg_t *)arg;
+    run_t *run = targ->run;
+    uint64_t *latencies = malloc(run->ops * sizeof(uint64_t));
+    size_t count = 0;
+    while (true) {
+        bench_elem_t *elem = run->backend->dequeue(run->queue, targ->id);
+        uint64_t dequeued_ns = now_ns();
+        if (elem == NULL || elem == run->stop) {
+            break;
+        }
+        latencies[count++] = dequeued_ns - elem->enqueued_ns;
+    }
+
+    pthread_mutex_lock(&run->latencies_lock);
+    for (size_t i = 0; i < count; i++) {
+        run->latencies[run->n_latencies++] = latencies[i];
+    }
+    pthread_mutex_unlock(&run->latencies_lock);
+    free(latencies);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t idx = (size_t)(p * (double)(n - 1));
+    return sorted[idx];
+}
+
+static void bench_run(const backend_t *backend, size_t producers,
+                      size_t consumers, size_t capacity, size_t ops) {
+    run_t run = {
+        .backend = backend,
+        .queue = backend->create(consumers, capacity),
+        .elems = calloc(ops, sizeof(bench_elem_t)),
+        .producers = producers,
+        .ops = ops,
+        .latencies = malloc(ops * sizeof(uint64_t)),
+        .n_latencies = 0,
+    };
+    bench_elem_t stop = {0};
+    run.stop = &stop;
+    pthread_mutex_init(&run.latencies_lock, NULL);
+
+    pthread_t producer_threads[producers];
+    pthread_t consumer_threads[consumers];
+    thread_arg_t producer_args[producers];
+    thread_arg_t consumer_args[consumers];
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    uint64_t start = now_ns();
+
+    for (size_t i = 0; i < consumers; i++) {
+        consumer_args[i] = (thread_arg_t){&run, i};
+        pthread_create(&consumer_threads[i], NULL, consumer, &consumer_args[i]);
+    }
+    for (size_t i = 0; i < producers; i++) {
+        producer_args[i] = (thread_arg_t){&run, i};
+        pthread_create(&producer_threads[i], NULL, producer, &producer_args[i]);
+    }
+    for (size_t i = 0; i < producers; i++) {
+        pthread_join(producer_threads[i], NULL);
+    }
+    // One stop element per consumer, each consumer exits on the first it sees
+    for (size_t i = 0; i < consumers; i++) {
+        backend->enqueue(run.queue, &stop);
+    }
+    for (size_t i = 0; i < consumers; i++) {
+        pthread_join(consumer_threads[i], NULL);
+    }
+
+    uint64_t elapsed = now_ns() - start;
+    getrusage(RUSAGE_SELF, &after);
+
+    qsort(run.latencies, run.n_latencies, sizeof(uint64_t), cmp_u64);
+    double seconds = (double)elapsed / 1e9;
+    printf("%s,%zu,%zu,%zu,%zu,%.6f,%.0f,%lu,%lu,%lu,%ld,%ld\n", backend->name,
+           producers, consumers, capacity, run.n_latencies, seconds,
+           (double)run.n_latencies / seconds,
+           percentile(run.latencies, run.n_latencies, 0.50),
+           percentile(run.latencies, run.n_latencies, 0.99),
+           percentile(run.latencies, run.n_latencies, 0.999),
+           after.ru_nvcsw - before.ru_nvcsw, after.ru_nivcsw - before.ru_nivcsw);
+    fflush(stdout);
+
+    backend->destroy(run.queue);
+    pthread_mutex_destroy(&run.latencies_lock);
+    free(run.elems);
+    free(run.latencies);
+}
+
+int main(int argc, char **argv) {
+    size_t max_threads = DEFAULT_MAX_THREADS;
+    size_t ops = DEFAULT_OPS;
+    if (argc > 1) {
+        max_threads = (size_t)atoi(argv[1]);
+    }
+    if (argc > 2) {
+        ops = (size_t)atoi(argv[2]);
+    }
+    if (max_threads == 0 || ops == 0) {
+        fprintf(stderr, "usage: pcq_bench [max_threads] [ops_per_run]\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("backend,producers,consumers,capacity,ops,seconds,ops_per_sec,"
+           "p50_ns,p99_ns,p999_ns,voluntary_csw,involuntary_csw\n");
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        const backend_t *backend = &backends[b];
+        for (size_t c = 0; c < sizeof(capacities) / sizeof(capacities[0]);
+             c++) {
+            for (size_t p = 1; p <= max_threads; p++) {
+                if (backend->single_producer && p > 1) {
+                    break;
+                }
+                for (size_t q = 1; q <= max_threads; q++) {
+                    bench_run(backend, p, q, capacities[c], ops);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -18,6 +18,7 @@ tfs_params tfs_default_params() {
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .shared_data_name = NULL,
     };
     return params;
 }
@@ -104,8 +105,9 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 
         // Truncate (if requested)
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
+            if (inode->i_data_block != -1) {
                 data_block_free(inode->i_data_block);
+                inode->i_data_block = -1;
                 inode->i_size = 0;
             }
         }
@@ -208,7 +210,7 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     }
 
     if (to_write > 0) {
-        if (inode->i_size == 0) {
+        if (inode->i_data_block == -1) {
             // If empty file, allocate new block
             int bnum = data_block_alloc();
             if (bnum == -1) {
@@ -285,6 +287,73 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     return (ssize_t)to_read;
 }
 
+// Gets the data block of an open file, allocating it if the file has none yet
+// (same as the first write would do). Must be called with the library mutex
+// held. Returns -1 if the handle is invalid or there are no free blocks.
+static int file_data_block(int fhandle) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL,
+                  "file_data_block: inode of open file deleted");
+
+    if (inode->i_data_block == -1) {
+        inode->i_data_block = data_block_alloc();
+    }
+    return inode->i_data_block;
+}
+
+ssize_t tfs_block_offset(int fhandle, size_t *capacity) {
+    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+        WARN("failed to lock mutex: %s", strerror(errno));
+        return -1;
+    }
+
+    int block = file_data_block(fhandle);
+    ssize_t offset = -1;
+    if (block != -1) {
+        offset = (ssize_t)data_block_offset(block);
+        *capacity = state_block_size();
+    }
+
+    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
+        WARN("failed to unlock mutex: %s", strerror(errno));
+        return -1;
+    }
+    return offset;
+}
+
+int tfs_block_pin(int fhandle, char **data, size_t *capacity) {
+    if (pthread_mutex_lock(&g_library_mutex) == -1) {
+        WARN("failed to lock mutex: %s", strerror(errno));
+        return -1;
+    }
+
+    int block = file_data_block(fhandle);
+    if (block != -1) {
+        data_block_pin(block);
+        *data = data_block_get(block);
+        *capacity = state_block_size();
+    }
+
+    if (pthread_mutex_unlock(&g_library_mutex) == -1) {
+        WARN("failed to unlock mutex: %s", strerror(errno));
+        return -1;
+    }
+    return block;
+}
+
+void tfs_block_unpin(int block) {
+    ALWAYS_ASSERT(pthread_mutex_lock(&g_library_mutex) == 0,
+                  "failed to lock mutex");
+    data_block_unpin(block);
+    ALWAYS_ASSERT(pthread_mutex_unlock(&g_library_mutex) == 0,
+                  "failed to unlock mutex");
+}
+
 int tfs_unlink(char const *target) {
     if (pthread_mutex_lock(&g_library_mutex) == -1) {
         WARN("failed to lock mutex: %s", strerror(errno));
@@ -13,6 +13,10 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // If not NULL, the data blocks are kept in POSIX shared memory with this
+    // name, so other processes can map them (see tfs_block_offset)
+    char const *shared_data_name;
 } tfs_params;
 
 /**
@@ -113,6 +117,49 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Find where the contents of an open file are in the data blocks, so they can
+ * be read straight from the shared memory named by `shared_data_name` in the
+ * TécnicoFS parameters. A file without contents gets its data block right
+ * away, so it stays in place while the file grows.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - capacity: where the maximum size of the file is stored
+ *
+ * Returns the offset of the file contents in the data blocks if successful,
+ * or -1 in case of error.
+ */
+ssize_t tfs_block_offset(int fhandle, size_t *capacity);
+
+/**
+ * Pin the data block of an open file, so that it is not reused until
+ * tfs_block_unpin, even if the file is deleted in the meantime. Bytes written
+ * to a file never move, so while the block is pinned they can be referenced
+ * in place (e.g. by a pipe, with vmsplice). A file without contents gets its
+ * data block right away, as with tfs_block_offset.
+ *
+ * The block may also be written in place, bypassing tfs_write: the size of
+ * the file is then left as it is, for the caller to keep track of.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - data: where a pointer to the file contents is stored
+ *   - capacity: where the maximum size of the file is stored
+ *
+ * Returns the pinned block number if successful, or -1 in case of error.
+ */
+int tfs_block_pin(int fhandle, char **data, size_t *capacity);
+
+/**
+ * Release a block pinned with tfs_block_pin. A block whose file was deleted
+ * is freed once its last pin is released.
+ *
+ * Input:
+ *   - block: the block number returned by tfs_block_pin
+ */
+void tfs_block_unpin(int block);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -1,10 +1,13 @@
 #include "state.h"
 #include "betterassert.h"
 
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 /*
@@ -20,7 +23,13 @@ static allocation_state_t *freeinode_ts;
 
 // Data blocks
 static char *fs_data; // # blocks * block size
+// Set when fs_data is in shared memory (see tfs_params)
+static char fs_data_name[NAME_MAX];
 static allocation_state_t *free_blocks;
+// Pins taken on each data block (see data_block_pin), and whether the block
+// was freed while pinned
+static unsigned int *block_pins;
+static bool *block_free_deferred;
 
 /*
  * Volatile FS state
@@ -80,6 +89,34 @@ static void insert_delay(void) {
     }
 }
 
+/**
+ * Allocate the data blocks in POSIX shared memory, so other processes can
+ * map them.
+ *
+ * Input:
+ *   - name: the shared memory object name (starting with /)
+ *
+ * Returns a pointer to the data blocks, or NULL in the case of error.
+ */
+static char *shared_data_alloc(char const *name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    void *data = MAP_FAILED;
+    if (ftruncate(fd, (off_t)(DATA_BLOCKS * BLOCK_SIZE)) == 0) {
+        data = mmap(NULL, DATA_BLOCKS * BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    snprintf(fs_data_name, sizeof(fs_data_name), "%s", name);
+    return data;
+}
+
 /**
  * Initialize FS state.
  *
@@ -101,14 +138,19 @@ int state_init(tfs_params params) {
 
     inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
     freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
+    fs_data = params.shared_data_name == NULL
+                  ? malloc(DATA_BLOCKS * BLOCK_SIZE)
+                  : shared_data_alloc(params.shared_data_name);
     free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
+    block_pins = calloc(DATA_BLOCKS, sizeof(unsigned int));
+    block_free_deferred = calloc(DATA_BLOCKS, sizeof(bool));
     open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
     free_open_file_entries =
         malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
 
     if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
+        !block_pins || !block_free_deferred || !open_file_table ||
+        !free_open_file_entries) {
         return -1; // allocation failed
     }
 
@@ -135,8 +177,16 @@ int state_init(tfs_params params) {
 int state_destroy(void) {
     free(inode_table);
     free(freeinode_ts);
-    free(fs_data);
+    if (fs_data_name[0] != '\0') {
+        munmap(fs_data, DATA_BLOCKS * BLOCK_SIZE);
+        shm_unlink(fs_data_name);
+        fs_data_name[0] = '\0';
+    } else {
+        free(fs_data);
+    }
     free(free_blocks);
+    free(block_pins);
+    free(block_free_deferred);
     free(open_file_table);
     free(free_open_file_entries);
 
@@ -144,6 +194,8 @@ int state_destroy(void) {
     freeinode_ts = NULL;
     fs_data = NULL;
     free_blocks = NULL;
+    block_pins = NULL;
+    block_free_deferred = NULL;
     open_file_table = NULL;
     free_open_file_entries = NULL;
 
@@ -259,7 +311,7 @@ void inode_delete(int inumber) {
     ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
                   "inode_delete: inode already freed");
 
-    if (inode_table[inumber].i_size > 0) {
+    if (inode_table[inumber].i_data_block != -1) {
         data_block_free(inode_table[inumber].i_data_block);
     }
 
@@ -432,11 +484,52 @@ void data_block_free(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_free: invalid block number");
 
+    // Someone still references the contents in place, so the block is only
+    // freed when the last pin is released
+    if (block_pins[block_number] > 0) {
+        block_free_deferred[block_number] = true;
+        return;
+    }
+
     insert_delay(); // simulate storage access delay to free_blocks
 
     free_blocks[block_number] = FREE;
 }
 
+/**
+ * Prevent a data block from being reused until it is unpinned, even if it is
+ * freed meanwhile.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_pin(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_pin: invalid block number");
+
+    block_pins[block_number]++;
+}
+
+/**
+ * Release a pin of a data block, freeing the block if it was freed while
+ * pinned.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_unpin(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_unpin: invalid block number");
+    ALWAYS_ASSERT(block_pins[block_number] > 0,
+                  "data_block_unpin: block is not pinned");
+
+    block_pins[block_number]--;
+    if (block_pins[block_number] == 0 && block_free_deferred[block_number]) {
+        block_free_deferred[block_number] = false;
+        data_block_free(block_number);
+    }
+}
+
 /**
  * Obtain a pointer to the contents of a given block.
  *
@@ -453,6 +546,21 @@ void *data_block_get(int block_number) {
     return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
+/**
+ * Obtain the position of a given block in the data blocks.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns the offset of the first byte of the block.
+ */
+size_t data_block_offset(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_offset: invalid block number");
+
+    return (size_t)block_number * BLOCK_SIZE;
+}
+
 /**
  * Add a new entry to the open file table.
  *
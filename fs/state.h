@@ -57,6 +57,9 @@ int find_in_dir(inode_t const *inode, char const *sub_name);
 int data_block_alloc(void);
 void data_block_free(int block_number);
 void *data_block_get(int block_number);
+size_t data_block_offset(int block_number);
+void data_block_pin(int block_number);
+void data_block_unpin(int block_number);
 
 int add_to_open_file_table(int inumber, size_t offset);
 void remove_from_open_file_table(int fhandle);
@@ -1,4 +1,5 @@
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,115 +29,158 @@ static void print_usage() {
             "   manager <register_pipe_name> <pipe_name> list\n");
 }
 
+// Sends a request to the mbroker and returns where its response comes from:
+// our pipe, or the connection itself if the mbroker listens on a socket
+static int send_request(const char *server_pipe_name,
+                        const char *client_pipe_name, uint8_t opcode,
+                        const void *request, bool *uses_pipe) {
+    int sock = connect_mbroker_socket(server_pipe_name);
+    *uses_pipe = sock == -1;
+    if (sock != -1) {
+        send_proto_string(sock, opcode, request);
+        return sock;
+    }
+    // The pipe is opened before sending, so the mbroker never waits for us
+    create_pipe(client_pipe_name);
+    int rx = open_response_pipe(client_pipe_name);
+    int wx = open_pipe(server_pipe_name, O_WRONLY);
+    send_proto_string(wx, opcode, request);
+    close(wx);
+    return rx;
+}
+
+static void remove_client_pipe(const char *client_pipe_name, bool uses_pipe) {
+    if (uses_pipe) {
+        ALWAYS_ASSERT(remove(client_pipe_name) == 0, "Failed to remove pipe");
+    }
+}
+
 int list_boxes(const char *server_pipe_name, const char *client_pipe_name) {
     // Sends the request to the mbroker
-    list_boxes_request_proto_t *request =
-        list_boxes_request_proto(client_pipe_name);
-    int wx = open_pipe(server_pipe_name, O_WRONLY);
-    send_proto_string(wx, LIST_BOXES_REQUEST, request);
+    list_boxes_request_proto_t request;
+    list_boxes_request_proto(&request, client_pipe_name);
+    bool uses_pipe;
+    int rx = send_request(server_pipe_name, client_pipe_name,
+                          LIST_BOXES_REQUEST | PROTO_V2_FLAG, &request,
+                          &uses_pipe);
 
     size_t curr_index = 0;
     // Array for storing responses
-    list_boxes_response_proto_t **responses =
+    list_boxes_response_proto_t *responses =
         calloc(tfs_default_params().max_inode_count,
                sizeof(list_boxes_response_proto_t));
 
     // Reads all messages
-    // RG: O_RDONLY | O_CREAT faz sentido?
-    int rx = open_pipe(client_pipe_name, O_RDONLY | O_CREAT);
+    await_response(rx);
+    frame_reader_t reader;
+    ALWAYS_ASSERT(frame_reader_init(&reader, rx) == 0,
+                  "Failed to create pipe reader");
 
     // Breaks in the last box or if there was an error in the server side
     while (1) {
-        // temporary int opcode
-        int t_opcode = 0;
-        ssize_t rs = read(rx, &t_opcode, sizeof(uint8_t));
-
-        if (t_opcode == EOF) {
+        uint8_t opcode = 0;
+        const void *payload = NULL;
+        if (frame_reader_next(&reader, &opcode, &payload) != 1) {
             WARN("Error in the server side");
             break;
         }
 
-        uint8_t opcode = (uint8_t)t_opcode;
-
-        ALWAYS_ASSERT(opcode == LIST_BOXES_RESPONSE, "Received invalid opcode");
-        ALWAYS_ASSERT(rs == sizeof(uint8_t), "Failed to read op code");
-        list_boxes_response_proto_t *response =
-            (list_boxes_response_proto_t *)parse_protocol(rx, opcode);
-
-        responses[curr_index] = response;
+        if (PROTO_OPCODE(opcode) == BROKER_BUSY_RESPONSE) {
+            const char *error_msg;
+            size_t error_len;
+            frame_response(opcode, payload, &error_msg, &error_len);
+            fprintf(stderr, "%.*s", (int)error_len, error_msg);
+            remove_client_pipe(client_pipe_name, uses_pipe);
+            frame_reader_destroy(&reader);
+            return -1;
+        }
+        ALWAYS_ASSERT(PROTO_OPCODE(opcode) == LIST_BOXES_RESPONSE,
+                      "Received invalid opcode");
+        list_boxes_response_proto_t *response = &responses[curr_index];
+        memcpy(response, payload, sizeof(list_boxes_response_proto_t));
         curr_index++;
 
         if (response->last) {
             break;
         }
     }
+    frame_reader_destroy(&reader);
 
     // Sorts all things
     qsort(responses, curr_index, sizeof(list_boxes_response_proto_t),
           cmp_response);
 
-    // Prints all boxes
+    // Prints all boxes. Without boxes, the only response has an empty name.
+    if (curr_index == 1 && responses[0].box_name[0] == '\0') {
+        fprintf(stdout, "NO BOXES FOUND\n");
+        curr_index = 0;
+    }
     for (size_t i = 0; i < curr_index; i++) {
-        list_boxes_response_proto_t *res = responses[i];
+        list_boxes_response_proto_t *res = &responses[i];
         fprintf(stdout, "%s %zu %zu %zu\n", res->box_name, res->box_size,
                 res->n_publishers, res->n_subscribers);
     }
 
     // Removes the pipe
-    ALWAYS_ASSERT(remove(client_pipe_name) == 0, "Failed to remove pipe");
+    remove_client_pipe(client_pipe_name, uses_pipe);
 
     fprintf(stdout, "OK\n");
     return 0;
 }
 
-int create_box(const char *server_pipe_name, const char *client_pipe_name,
-               const char *box_name) {
-    // Sends the request to the mbroker
-    request_proto_t *request = request_proto(client_pipe_name, box_name);
-    int wx = open_pipe(server_pipe_name, O_WRONLY);
-    send_proto_string(wx, CREATE_BOX_REQUEST, request);
-
-    // Waits for the mbroker to send a response
-    int rx = open_pipe(client_pipe_name, O_RDONLY | O_CREAT);
+// Reads a create/remove response and prints the outcome
+static int print_response(const int rx, const char *client_pipe_name,
+                          bool uses_pipe) {
+    await_response(rx);
+    frame_reader_t reader;
+    ALWAYS_ASSERT(frame_reader_init(&reader, rx) == 0,
+                  "Failed to create pipe reader");
     uint8_t opcode = 0;
-    ssize_t rs = read(rx, &opcode, sizeof(uint8_t));
-    ALWAYS_ASSERT(rs == sizeof(uint8_t), "Invalid read size");
-    response_proto_t *response = (response_proto_t *)parse_protocol(rx, opcode);
-    ALWAYS_ASSERT(remove(client_pipe_name) == 0, "Failed to remove pipe");
+    const void *payload = NULL;
+    ALWAYS_ASSERT(frame_reader_next(&reader, &opcode, &payload) == 1,
+                  "Failed to read response");
+    const char *error_msg;
+    size_t error_len;
+    int32_t return_code =
+        frame_response(opcode, payload, &error_msg, &error_len);
+    remove_client_pipe(client_pipe_name, uses_pipe);
 
     // If there was an error in the mbroker, print it
-    if (response->return_code != 0) {
-        fprintf(stderr, "%s", response->error_msg);
-        return -1;
+    if (return_code != 0) {
+        fprintf(stderr, "%.*s", (int)error_len, error_msg);
     } else {
         fprintf(stdout, "OK\n");
-        return 0;
     }
+    frame_reader_destroy(&reader);
+    return return_code != 0 ? -1 : 0;
+}
+
+int create_box(const char *server_pipe_name, const char *client_pipe_name,
+               const char *box_name) {
+    // Sends the request to the mbroker
+    request_proto_t request;
+    request_proto(&request, client_pipe_name, box_name);
+    bool uses_pipe;
+    int rx = send_request(server_pipe_name, client_pipe_name,
+                          CREATE_BOX_REQUEST | PROTO_V2_FLAG, &request,
+                          &uses_pipe);
+
+    // Waits for the mbroker to send a response
+    return print_response(rx, client_pipe_name, uses_pipe);
 }
 
 int remove_box(const char *server_pipe_name, const char *client_pipe_name,
                const char *box_name) {
     // Send the request to the mbroker
-    request_proto_t *request = request_proto(client_pipe_name, box_name);
-    int wx = open_pipe(server_pipe_name, O_WRONLY);
-    send_proto_string(wx, REMOVE_BOX_REQUEST, request);
+    request_proto_t request;
+    request_proto(&request, client_pipe_name, box_name);
+    bool uses_pipe;
+    int rx = send_request(server_pipe_name, client_pipe_name,
+                          REMOVE_BOX_REQUEST | PROTO_V2_FLAG, &request,
+                          &uses_pipe);
 
-    // Waits for a response
-    int rx = open_pipe(client_pipe_name, O_RDONLY | O_CREAT);
-    uint8_t opcode = 0;
-    ssize_t rs = read(rx, &opcode, sizeof(uint8_t));
-    ALWAYS_ASSERT(rs == sizeof(uint8_t), "Invalid read size");
-    response_proto_t *response = (response_proto_t *)parse_protocol(rx, opcode);
-    ALWAYS_ASSERT(remove(client_pipe_name) == 0, "Failed to remove pipe");
-
-    // If there was an error in the mbroker side
-    if (response->return_code != 0) {
-        fprintf(stderr, "%s", response->error_msg);
-        return -1;
-    } else {
-        fprintf(stdout, "OK\n");
-        return 0;
-    }
+    // Waits for the mbroker to send a response
+    return print_response(rx, client_pipe_name, uses_pipe);
 }
 
 int main(int argc, char **argv) {
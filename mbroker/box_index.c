@@ -0,0 +1,127 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "box_index.h"
+#include "delim.h"
+
+// Message ends found per scan while indexing
+#define INDEX_SCAN_ENDS 64
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+int box_index_init(box_index_t *index, size_t capacity) {
+    // Every message takes a byte at least
+    index->max_entries = capacity / BOX_INDEX_STRIDE + 1;
+    index->entries = malloc(index->max_entries * sizeof(box_index_entry_t));
+    if (index->entries == NULL) {
+        return -1;
+    }
+    atomic_init(&index->len, 0);
+    atomic_init(&index->messages, 0);
+    return 0;
+}
+
+void box_index_destroy(box_index_t *index) { free(index->entries); }
+
+void box_index_append(box_index_t *index, const char *data, size_t start,
+                      size_t len) {
+    size_t messages =
+        atomic_load_explicit(&index->messages, memory_order_relaxed);
+    size_t entries = atomic_load_explicit(&index->len, memory_order_relaxed);
+    uint64_t time_ms = 0;
+    size_t ends[INDEX_SCAN_ENDS];
+    size_t offset = start;
+    size_t end = start + len;
+    while (offset < end) {
+        size_t n_ends =
+            delim_scan(data + offset, end - offset, ends, INDEX_SCAN_ENDS);
+        if (n_ends == 0) {
+            break; // Appends are whole messages
+        }
+        size_t base = offset;
+        for (size_t i = 0; i < n_ends; i++) {
+            if (messages % BOX_INDEX_STRIDE == 0 &&
+                entries < index->max_entries) {
+                if (time_ms == 0) {
+                    time_ms = now_ms();
+                }
+                index->entries[entries] = (box_index_entry_t){
+                    .offset = offset,
+                    .time_ms = time_ms,
+                };
+                atomic_store_explicit(&index->len, ++entries,
+                                      memory_order_release);
+            }
+            offset = base + ends[i] + 1;
+            messages++;
+        }
+    }
+    atomic_store_explicit(&index->messages, messages, memory_order_release);
+}
+
+// The last entry appended before `time_ms`, or the first one
+static size_t entry_before(const box_index_entry_t *entries, size_t len,
+                           uint64_t time_ms) {
+    size_t low = 0;
+    size_t high = len;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (entries[mid].time_ms < time_ms) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    // Messages after that entry may be newer
+    return low > 0 ? low - 1 : 0;
+}
+
+size_t box_index_seek(box_index_t *index, const char *data, size_t committed,
+                      seek_e seek, uint64_t position) {
+    size_t messages =
+        atomic_load_explicit(&index->messages, memory_order_acquire);
+    size_t len = atomic_load_explicit(&index->len, memory_order_acquire);
+    if (len == 0) {
+        return 0;
+    }
+
+    size_t entry;
+    size_t skip = 0;
+    switch (seek) {
+    case SEEK_TIME:
+        entry = entry_before(index->entries, len, position);
+        break;
+    case SEEK_LAST:
+        position = position < messages ? messages - position : 0;
+        // fall through
+    case SEEK_MESSAGE:
+    default:
+        entry = (size_t)(position / BOX_INDEX_STRIDE);
+        if (entry >= len) {
+            entry = len - 1;
+            skip = messages - entry * BOX_INDEX_STRIDE;
+        } else {
+            skip = (size_t)(position % BOX_INDEX_STRIDE);
+        }
+        break;
+    }
+
+    size_t offset = index->entries[entry].offset;
+    // Entries added since messages was read may make skip wrap around, but
+    // then the position is past the end anyway
+    if (offset >= committed || skip > BOX_INDEX_STRIDE) {
+        return committed;
+    }
+    if (skip > 0) {
+        size_t ends[BOX_INDEX_STRIDE];
+        size_t n_ends =
+            delim_scan(data + offset, committed - offset, ends, skip);
+        offset = n_ends < skip ? committed : offset + ends[n_ends - 1] + 1;
+    }
+    return offset;
+}
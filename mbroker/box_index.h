@@ -0,0 +1,82 @@
+#ifndef __BOX_INDEX_H__
+#define __BOX_INDEX_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../protocol/protocols.h"
+
+// Every how many messages the index of a box remembers where one starts
+#define BOX_INDEX_STRIDE 16
+
+typedef struct box_index_entry_t {
+    // Where message number i * BOX_INDEX_STRIDE starts in the box
+    size_t offset;
+    // When it was appended, in milliseconds since the epoch
+    uint64_t time_ms;
+} box_index_entry_t;
+
+/**
+ * @brief A sparse index of the messages of a box, so subscribers can start
+ * somewhere else than at the first message without scanning the box
+ *
+ * @details Remembers where every BOX_INDEX_STRIDE-th message starts and when
+ * it was appended. Only the publisher staging messages writes it (see
+ * append_messages), and the staging order already lets one publisher do so at
+ * a time. It is read without locks: an entry is written before the count that
+ * publishes it.
+ */
+typedef struct box_index_t {
+    box_index_entry_t *entries;
+    size_t max_entries;
+    // Entries published
+    _Atomic size_t len;
+    // Messages indexed
+    _Atomic size_t messages;
+} box_index_t;
+
+/**
+ * @brief Creates an empty index
+ *
+ * @param index the already allocated index
+ * @param capacity the size of the box, which bounds how many messages it has
+ * @return int 0 if was successful and -1 otherwise
+ */
+int box_index_init(box_index_t *index, size_t capacity);
+
+/**
+ * @brief Frees the entries of an index
+ *
+ * @param index the index
+ */
+void box_index_destroy(box_index_t *index);
+
+/**
+ * @brief Indexes messages staged to the box, right after the ones indexed
+ * before. Must not run concurrently with itself.
+ *
+ * @param index the index
+ * @param data the box
+ * @param start where the messages start in the box
+ * @param len their size, \0 separators included
+ */
+void box_index_append(box_index_t *index, const char *data, size_t start,
+                      size_t len);
+
+/**
+ * @brief Finds where a subscriber starts reading a box. Walks
+ * BOX_INDEX_STRIDE messages at most.
+ *
+ * @param index the index
+ * @param data the box
+ * @param committed the bytes of the box committed so far, which bound the
+ * result
+ * @param seek how to read position
+ * @param position the message number, count of last messages or time
+ * @return size_t where the first message to deliver starts
+ */
+size_t box_index_seek(box_index_t *index, const char *data, size_t committed,
+                      seek_e seek, uint64_t position);
+
+#endif // __BOX_INDEX_H__
@@ -1,92 +1,170 @@
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "../utils/betterassert.h"
 #include "box_metadata.h"
+#include "epoch.h"
+#include "operations.h"
+#include "work-stealing.h"
 
-box_metadata_t *box_metadata_create(const char *name,
-                                    const size_t max_sessions) {
-    box_metadata_t *box = malloc(sizeof(box_metadata_t));
+box_metadata_t *box_metadata_create(const char *name, int fd) {
+    box_metadata_t *box = aligned_alloc(BOX_CACHE_LINE, sizeof(box_metadata_t));
     ALWAYS_ASSERT(box != NULL, "Failed to alloc box_metadata");
-    pthread_mutex_init(&box->has_publisher_lock, NULL);
+    box->block = tfs_block_pin(fd, &box->data, &box->capacity);
+    if (box->block == -1) {
+        free(box);
+        return NULL;
+    }
+    if (box_index_init(&box->index, box->capacity) == -1) {
+        tfs_block_unpin(box->block);
+        free(box);
+        return NULL;
+    }
+    snprintf(box->name, BOX_NAME_SIZE, "%s", name);
+    atomic_init(&box->next, NULL);
+    // Commits every append right away, until given limits
+    box->commit_bytes = 0;
+    box->commit_window_us = 0;
+    atomic_init(&box->tail, 0);
+    fanout_init(&box->staged);
+    fanout_init(&box->fanout);
+    atomic_init(&box->commit_armed, false);
+    box->commit_next = NULL;
+    atomic_init(&box->publishers_count, 0);
+    atomic_init(&box->subscribers_count, 0);
+    for (size_t i = 0; i < STREAM_TRANSPORTS; i++) {
+        atomic_init(&box->streaming_loops[i], 0);
+        atomic_init(&box->advanced_loops[i], 0);
+    }
+    atomic_init(&box->refs, 1);
     pthread_mutex_init(&box->subscribers_lock, NULL);
-    pthread_mutex_init(&box->publisher_idx_lock, NULL);
-    pthread_mutex_init(&box->subscribers_count_lock, NULL);
-    pthread_mutex_init(&box->read_condvar_lock, NULL);
-    pthread_mutex_init(&box->total_message_size_lock, NULL);
-    pthread_cond_init(&box->read_condvar, NULL);
-    strcpy(box->name, name);
-    box->publisher_idx = -1;
-    box->subscribers = calloc(max_sessions, sizeof(size_t));
-    box->has_publisher = false;
-    box->subscribers_count = 0;
-    box->total_message_size = 0;
+    atomic_init(&box->exported, false);
+    subscriptions_init(&box->subscriptions, name, box->capacity);
     return box;
 }
 
 void box_metadata_destroy(box_metadata_t *box) {
-    pthread_mutex_destroy(&box->has_publisher_lock);
+    if (atomic_load(&box->exported)) {
+        box_export_destroy(&box->export);
+    }
     pthread_mutex_destroy(&box->subscribers_lock);
-    pthread_mutex_destroy(&box->publisher_idx_lock);
-    pthread_mutex_destroy(&box->subscribers_count_lock);
-    pthread_mutex_destroy(&box->read_condvar_lock);
-    pthread_mutex_destroy(&box->total_message_size_lock);
-    pthread_cond_destroy(&box->read_condvar);
-    free(box->name);
-    free(box->subscribers);
+    box_index_destroy(&box->index);
+    subscriptions_destroy(&box->subscriptions);
+    // Frees the block if the box was removed from TFS
+    tfs_block_unpin(box->block);
     free(box);
 }
 
+static void destroy_retired_box(void *box) {
+    box_metadata_destroy((box_metadata_t *)box);
+}
+
+void box_metadata_put(box_metadata_t *box) {
+    if (atomic_fetch_sub(&box->refs, 1) == 1) {
+        // Lookups that started before the box was removed may still be
+        // reading it
+        epoch_retire(box, destroy_retired_box);
+    }
+}
+
 int box_holder_create(box_holder_t *holder, const size_t max_boxes) {
     DEBUG("Creating box holder");
-    holder->current_size = 0;
-    holder->max_size = max_boxes;
-    holder->boxes = calloc(max_boxes, sizeof(box_metadata_t));
-    pthread_mutex_init(&holder->lock, NULL);
-    if (holder->boxes == NULL) {
+    size_t n_buckets = 1;
+    while (n_buckets < max_boxes) {
+        n_buckets <<= 1;
+    }
+    holder->buckets = calloc(n_buckets, sizeof(box_bucket_t));
+    if (holder->buckets == NULL) {
         return -1; // failed to alloc boxes
     }
+    holder->mask = n_buckets - 1;
+    for (size_t i = 0; i < n_buckets; i++) {
+        atomic_init(&holder->buckets[i].head, NULL);
+        pthread_mutex_init(&holder->buckets[i].lock, NULL);
+    }
     return 0;
 }
 
-void box_holder_insert(box_holder_t *holder, box_metadata_t *box) {
-    pthread_mutex_lock(&holder->lock);
+static box_bucket_t *bucket_of(box_holder_t *holder, const char *name) {
+    return &holder->buckets[ws_hash_string(name, BOX_NAME_SIZE) & holder->mask];
+}
+
+int box_holder_insert(box_holder_t *holder, box_metadata_t *box) {
+    box_bucket_t *bucket = bucket_of(holder, box->name);
+    pthread_mutex_lock(&bucket->lock);
+    box_metadata_t *head = atomic_load(&bucket->head);
+    for (box_metadata_t *b = head; b != NULL; b = atomic_load(&b->next)) {
+        if (strcmp(b->name, box->name) == 0) {
+            pthread_mutex_unlock(&bucket->lock);
+            return -1;
+        }
+    }
     DEBUG("Inserting box %s", box->name);
-    ALWAYS_ASSERT(holder->current_size < holder->max_size,
-                  "Already inserted max size of boxes");
-    holder->boxes[holder->current_size] = box;
-    holder->current_size++;
-    pthread_mutex_unlock(&holder->lock);
+    // Readers see either the old head or the fully initialized box
+    atomic_store(&box->next, head);
+    atomic_store(&bucket->head, box);
+    pthread_mutex_unlock(&bucket->lock);
+    return 0;
 }
 
 void box_holder_remove(box_holder_t *holder, const char *name) {
-    pthread_mutex_lock(&holder->lock);
+    box_bucket_t *bucket = bucket_of(holder, name);
+    pthread_mutex_lock(&bucket->lock);
     DEBUG("Removing box %s", name);
-    for (size_t i = 0; i < holder->current_size; i++) {
-        box_metadata_t *box = holder->boxes[i];
-        if (strcmp(box->name, name) == 0) {
-            holder->boxes[i] = NULL;
-            box_metadata_destroy(box);
-            for (size_t j = i; j < holder->current_size - 1; j++) {
-                holder->boxes[j] = holder->boxes[j + 1];
-            }
-            holder->current_size--;
-            return;
+    box_metadata_t *_Atomic *link = &bucket->head;
+    box_metadata_t *box;
+    while ((box = atomic_load(link)) != NULL && strcmp(box->name, name) != 0) {
+        link = &box->next;
+    }
+    if (box != NULL) {
+        // Readers standing on the box can still move on from it
+        atomic_store(link, atomic_load(&box->next));
+    }
+    pthread_mutex_unlock(&bucket->lock);
+
+    if (box == NULL) {
+        WARN("No boxes with the name: %s were removed", name);
+        return;
+    }
+    box_metadata_put(box);
+}
+
+// Takes a reference, unless the box is already on its way out
+static bool box_metadata_tryget(box_metadata_t *box) {
+    unsigned int refs = atomic_load(&box->refs);
+    while (refs > 0) {
+        if (atomic_compare_exchange_weak(&box->refs, &refs, refs + 1)) {
+            return true;
         }
     }
-    WARN("No boxes with the name: %s were removed", name);
-    pthread_mutex_unlock(&holder->lock);
+    return false;
 }
 
 box_metadata_t *box_holder_find_box(box_holder_t *holder, const char *name) {
-    pthread_mutex_lock(&holder->lock);
-    for (size_t i = 0; i < holder->current_size; i++) {
-        box_metadata_t *box = holder->boxes[i];
-        if (strcmp(box->name, name) == 0) {
-            return box; // found box
+    box_bucket_t *bucket = bucket_of(holder, name);
+    epoch_enter();
+    box_metadata_t *box = atomic_load(&bucket->head);
+    while (box != NULL && strcmp(box->name, name) != 0) {
+        box = atomic_load(&box->next);
+    }
+    if (box != NULL && !box_metadata_tryget(box)) {
+        box = NULL;
+    }
+    epoch_exit();
+    return box; // NULL if no box was found
+}
+
+void box_holder_for_each(box_holder_t *holder,
+                         void (*fn)(box_metadata_t *box, void *arg),
+                         void *arg) {
+    epoch_enter();
+    for (size_t i = 0; i <= holder->mask; i++) {
+        box_metadata_t *box = atomic_load(&holder->buckets[i].head);
+        for (; box != NULL; box = atomic_load(&box->next)) {
+            fn(box, arg);
         }
     }
-    return NULL; // no box was found
-    pthread_mutex_unlock(&holder->lock);
-}
\ No newline at end of file
+    epoch_exit();
+}
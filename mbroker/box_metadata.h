@@ -2,93 +2,197 @@
 #define __BOX_METADATA_T_H__
 
 #include "../protocol/protocols.h"
+#include "box_index.h"
+#include "fanout.h"
+#include "subscriptions.h"
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
+
+// Fields written by different threads are kept on different cache lines
+#define BOX_CACHE_LINE 64
+
+/**
+ * @brief What the event loops stream messages to subscribers over
+ */
+typedef enum stream_transport_e {
+    // Named pipes of the clients of the register pipe
+    STREAM_PIPE,
+    // Connections to the mbroker socket
+    STREAM_SOCKET,
+    STREAM_TRANSPORTS
+} stream_transport_e;
 
 /**
  * @brief Represents a box in the mbroker. Contains all info related to the box.
+ *
+ * @details The counters are atomics: appending messages costs the publisher
+ * one commit to the fan-out of the box, and listing the box takes no lock.
+ * The only lock guards the state created by the first mapped subscriber.
+ *
+ * Any number of publishers append to a box at once (see append_messages):
+ * each one reserves a range past `tail`, copies its messages there in place,
+ * and stages them once every range reserved before it is staged. What was
+ * staged is committed to the subscribers in groups (see group_commit.h). The
+ * size of the TFS file is left behind: the box is only read up to what its
+ * fan-out committed.
  */
 typedef struct box_metadata_t {
+    // Never written after the box is created, besides the links of the box
+    // holder
     char name[BOX_NAME_SIZE];
-
-    size_t total_message_size;
-    pthread_mutex_t total_message_size_lock;
-
-    pthread_mutex_t read_condvar_lock;
-    pthread_cond_t read_condvar;
-
-    int publisher_idx;
-    pthread_mutex_t publisher_idx_lock;
-
-    bool has_publisher;
-    pthread_mutex_t has_publisher_lock;
-
-    int subscribers_count;
-    pthread_mutex_t subscribers_count_lock;
-
-    int *subscribers;
-    pthread_mutex_t subscribers_lock;
+    // Next box in the same bucket of the box holder
+    struct box_metadata_t *_Atomic next;
+    // The TFS data block of the box, pinned for as long as the box lives
+    char *data;
+    size_t capacity;
+    int block;
+    // Group commit limits: bytes staged that are committed right away, and
+    // how long staged bytes may wait otherwise
+    size_t commit_bytes;
+    unsigned int commit_window_us;
+
+    // Bytes of the box reserved by publishers, never past the capacity
+    _Alignas(BOX_CACHE_LINE) _Atomic size_t tail;
+
+    // Bytes copied in place, in order. Publishers sleep on it while the
+    // ranges reserved before theirs are being copied.
+    fanout_t staged;
+    // Where the staged messages start, written in the staging order
+    _Alignas(BOX_CACHE_LINE) box_index_t index;
+    // Bytes committed to the subscribers, which sleep on it
+    fanout_t fanout;
+
+    // Whether the group commit window of the box is running. The rest is
+    // changed under the lock of the group commit.
+    _Alignas(BOX_CACHE_LINE) atomic_bool commit_armed;
+    struct timespec commit_deadline;
+    struct box_metadata_t *commit_next;
+
+    // Written when sessions start and end
+    _Alignas(BOX_CACHE_LINE) atomic_int publishers_count;
+    atomic_int subscribers_count;
+    // The event loops of each transport streaming subscribers of the box, a
+    // bit per loop set by the loop itself, and the ones woken up by an
+    // append they did not look at yet. Only those loops are woken up, once
+    // (see event_loop_notify).
+    _Atomic uint64_t streaming_loops[STREAM_TRANSPORTS];
+    _Atomic uint64_t advanced_loops[STREAM_TRANSPORTS];
+    // Held by the box holder while the box is in it, and by every session
+    // that found it there (see box_metadata_put)
+    atomic_uint refs;
+
+    _Alignas(BOX_CACHE_LINE) pthread_mutex_t subscribers_lock;
+
+    // Shared header for mapped subscribers, created by the first one.
+    // Changed under subscribers_lock.
+    atomic_bool exported;
+    box_export_t export;
+
+    // How far its named subscriptions got, with a lock of its own
+    subscriptions_t subscriptions;
 } box_metadata_t;
 
 /**
- * @brief Creates a box metadata structure
+ * @brief Creates a box metadata structure, with one reference that is handed
+ * over to the box holder by @link box_holder_insert
  *
  * @param name the box name
- * @param max_sessions the max sessions of the mbroker
- * @return box_metadata_t* the box metadata created
+ * @param fd a TFS handle of the empty box file, whose data block is pinned
+ * @return box_metadata_t* the box metadata created, or NULL if the box has no
+ * room
  */
-box_metadata_t *box_metadata_create(const char *name,
-                                    const size_t max_sessions);
+box_metadata_t *box_metadata_create(const char *name, int fd);
 
 /**
- * @brief Destroys a box metadata
+ * @brief Destroys a box metadata. Called once its last reference is dropped
+ * and no lookup can still be looking at it.
  *
  * @param box
  */
 void box_metadata_destroy(box_metadata_t *box);
 
 /**
- * @brief Holds the mbroker created boxes
+ * @brief Drops a reference to a box, taken by @link box_holder_find_box. The
+ * box is destroyed after the last one.
+ *
+ * @param box the box
  */
-typedef struct box_holder_t {
-    box_metadata_t **boxes;
-    size_t current_size;
-    size_t max_size;
+void box_metadata_put(box_metadata_t *box);
 
+/**
+ * @brief A bucket of the box holder: a list that is read without locks and
+ * changed under the bucket lock
+ */
+typedef struct box_bucket_t {
+    box_metadata_t *_Atomic head;
     pthread_mutex_t lock;
+} box_bucket_t;
+
+/**
+ * @brief Holds the mbroker created boxes, in a hash map keyed by name
+ *
+ * @details Lookups and listings take no lock: boxes are unlinked under the
+ * lock of their bucket and only freed once no reader can reach them (see
+ * utils/epoch.h). Boxes in different buckets are created and removed in
+ * parallel.
+ */
+typedef struct box_holder_t {
+    box_bucket_t *buckets;
+    // The number of buckets is a power of two
+    size_t mask;
 } box_holder_t;
 
 /**
  * @brief Creates a box_holder
  *
  * @param the already allocated holder
- * @param max_boxes
+ * @param max_boxes how many boxes are expected, to size the hash map (there
+ * may be more)
  * @return int 0 if was successful and -1 otherwise
  */
 int box_holder_create(box_holder_t *holder, const size_t max_boxes);
 
 /**
- * @brief Inserts a box metadata in the box holder
+ * @brief Inserts a box metadata in the box holder, which takes over the
+ * reference of the creator
  *
  * @param holder to insert at
  * @param box to be inserted
+ * @return int 0 if was successful and -1 if there already is a box with the
+ * same name
  */
-void box_holder_insert(box_holder_t *holder, box_metadata_t *box);
+int box_holder_insert(box_holder_t *holder, box_metadata_t *box);
 
 /**
- * @brief Removes a box from the holder
+ * @brief Removes a box from the holder. Sessions that found it before keep
+ * their reference.
  *
  * @param name of the box to remove
  */
 void box_holder_remove(box_holder_t *holder, const char *name);
 
 /**
- * @brief Finds a box with the given name
+ * @brief Finds a box with the given name, without taking any lock
  *
  * @param name the box name
- * @return box_metadata_t* if the was box found or NULL otherwise
+ * @return box_metadata_t* if the was box found or NULL otherwise. The caller
+ * gets a reference, to drop with @link box_metadata_put.
  */
 box_metadata_t *box_holder_find_box(box_holder_t *holder, const char *name);
 
+/**
+ * @brief Calls a function for every box in the holder, without taking any
+ * lock. Boxes created or removed meanwhile may or may not be seen.
+ *
+ * @param holder the holder
+ * @param fn called with each box, which stays valid until it returns
+ * @param arg passed to fn
+ */
+void box_holder_for_each(box_holder_t *holder,
+                         void (*fn)(box_metadata_t *box, void *arg),
+                         void *arg);
+
 #endif // __BOX_METADATA_T_H__
\ No newline at end of file
@@ -0,0 +1,312 @@
+#define _GNU_SOURCE // F_SETPIPE_SZ
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "delim.h"
+#include "delivery.h"
+#include "logging.h"
+#include "mbroker.h"
+#include "operations.h"
+#include "protocols.h"
+#include "session_engine.h"
+#include "socket_server.h"
+
+// At most 3 iovecs per message
+#define DELIVERY_MAX_MSGS (IOV_MAX / 3)
+
+struct delivery_t {
+    box_metadata_t *box;
+    int fd;
+    stream_transport_e transport;
+    bool v2;
+    // Bytes written at most per flush: the pipe capacity or a whole packet
+    size_t capacity;
+
+    // Bytes of the box already sent: the cursor of the subscriber
+    size_t sent;
+    // The named subscription, or -1, and the last offset recorded for it
+    ssize_t subscription;
+    size_t recorded;
+
+    // The flush being written: iovecs [iov_next, iov_next + iov_count), the
+    // bytes of the box they hold, and whether they are spliced
+    struct iovec iov[DELIVERY_MAX_MSGS * 3];
+    // Where the messages of the flush end, found in bulk
+    size_t ends[DELIVERY_MAX_MSGS];
+    int iov_next;
+    int iov_count;
+    size_t pending;
+    size_t pending_msgs;
+    bool splice;
+
+    // Statistics: flushes, messages and flushes done with vmsplice
+    uint64_t writes;
+    uint64_t msgs;
+    uint64_t spliced;
+};
+
+// Opcode and header of a version 2 message
+typedef struct __attribute__((__packed__)) msg_v2_prefix_t {
+    uint8_t opcode;
+    msg_v2_header_t header;
+} msg_v2_prefix_t;
+
+// Everything a frame holds besides the message itself comes from memory that
+// is never written again, so a pipe may keep referencing it after vmsplice:
+// the prefix of a version 2 message of each length (filled once), and the
+// opcode and padding of version 1 messages
+static msg_v2_prefix_t v2_prefixes[MSG_SIZE];
+static pthread_once_t v2_prefixes_once = PTHREAD_ONCE_INIT;
+static const uint8_t v1_opcode = SUBSCRIBER_MESSAGE;
+static const char zeros[MSG_SIZE];
+
+static void fill_v2_prefixes(void) {
+    for (uint32_t len = 0; len < MSG_SIZE; len++) {
+        v2_prefixes[len].opcode = PROTO_WITH_VERSION(SUBSCRIBER_MESSAGE, true);
+        v2_prefixes[len].header.len = len;
+    }
+}
+
+static size_t raise_pipe_size(int pipe_fd) {
+    int size = fcntl(pipe_fd, F_SETPIPE_SZ, SUBSCRIBER_PIPE_SIZE);
+    if (size == -1) {
+        // Above the limit of an unprivileged process, keeps the default
+        size = fcntl(pipe_fd, F_GETPIPE_SZ);
+    }
+    return size > 0 ? (size_t)size : PIPE_BUF;
+}
+
+// Puts as many of the messages committed to the box as fit in the pipe or a
+// packet in the next flush. The frames point straight into the box: small
+// ones are copied by writev or sendmsg, large ones are spliced into pipes.
+// Returns false if there is nothing to send.
+static bool prepare_flush(delivery_t *d, size_t committed) {
+    const char *first = d->box->data + d->sent;
+    size_t n_ends =
+        delim_scan(first, committed - d->sent, d->ends, DELIVERY_MAX_MSGS);
+    size_t consumed = 0;
+    size_t bytes = 0;
+    size_t msgs_len = 0;
+    size_t n_msgs = 0;
+    int count = 0;
+
+    while (n_msgs < n_ends) {
+        const char *msg = first + consumed;
+        size_t len = d->ends[n_msgs] - consumed;
+        if (len > MSG_SIZE - 1) {
+            len = MSG_SIZE - 1;
+        }
+        size_t frame_size = d->v2 ? sizeof(msg_v2_prefix_t) + len
+                                  : sizeof(uint8_t) + MSG_SIZE;
+        if (n_msgs > 0 && bytes + frame_size > d->capacity) {
+            break;
+        }
+
+        if (d->v2) {
+            d->iov[count++] =
+                (struct iovec){&v2_prefixes[len], sizeof(msg_v2_prefix_t)};
+            d->iov[count++] = (struct iovec){(void *)msg, len};
+        } else {
+            d->iov[count++] =
+                (struct iovec){(void *)&v1_opcode, sizeof(uint8_t)};
+            d->iov[count++] = (struct iovec){(void *)msg, len};
+            d->iov[count++] = (struct iovec){(void *)zeros, MSG_SIZE - len};
+        }
+        consumed = d->ends[n_msgs] + 1;
+        bytes += frame_size;
+        msgs_len += len;
+        n_msgs++;
+    }
+
+    if (n_msgs == 0) {
+        return false;
+    }
+    d->iov_next = 0;
+    d->iov_count = count;
+    d->pending = consumed;
+    d->pending_msgs = n_msgs;
+    // Every spliced iovec takes a pipe buffer of its own, which only pays off
+    // over a copy for large messages
+    d->splice = d->transport == STREAM_PIPE &&
+                msgs_len / n_msgs >= SUBSCRIBER_SPLICE_MIN_LEN;
+    return true;
+}
+
+// Writes the iovecs left as a pipe write or a single packet
+static ssize_t write_iov(delivery_t *d, struct iovec *iov) {
+    if (d->transport == STREAM_SOCKET) {
+        // A packet is sent whole or not at all
+        struct msghdr msg = {.msg_iov = iov,
+                             .msg_iovlen = (size_t)d->iov_count};
+        return sendmsg(d->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    return d->splice ? vmsplice(d->fd, iov, (size_t)d->iov_count,
+                                SPLICE_F_NONBLOCK)
+                     : writev(d->fd, iov, d->iov_count);
+}
+
+// Writes what is left of the current flush, resuming in the middle of an
+// iovec. Spliced pages are referenced by the pipe instead of copied, so they
+// must not change until the subscriber reads them. Returns 1 once the flush
+// is written, 0 if the fd is full and -1 if the subscriber left.
+static int write_pending(delivery_t *d) {
+    while (d->iov_count > 0) {
+        struct iovec *iov = d->iov + d->iov_next;
+        ssize_t written = write_iov(d, iov);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        size_t left = (size_t)written;
+        while (d->iov_count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            d->iov_next++;
+            d->iov_count--;
+        }
+        if (d->iov_count > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+
+    d->sent += d->pending;
+    d->writes++;
+    d->msgs += d->pending_msgs;
+    if (d->splice) {
+        d->spliced++;
+    }
+    d->pending = 0;
+    return 1;
+}
+
+delivery_t *delivery_start(box_metadata_t *box, int fd,
+                           stream_transport_e transport, bool v2,
+                           size_t start, ssize_t subscription) {
+    delivery_t *d = malloc(sizeof(delivery_t));
+    if (d == NULL) {
+        WARN("no memory to deliver messages of '%s'", box->name);
+        return NULL;
+    }
+    pthread_once(&v2_prefixes_once, fill_v2_prefixes);
+    d->box = box;
+    d->fd = fd;
+    d->transport = transport;
+    d->v2 = v2;
+    d->capacity = transport == STREAM_SOCKET ? SOCKET_PACKET_SIZE
+                                             : raise_pipe_size(fd);
+    d->sent = start;
+    d->subscription = subscription;
+    d->recorded = start;
+    d->iov_count = 0;
+    d->pending = 0;
+    d->writes = 0;
+    d->msgs = 0;
+    d->spliced = 0;
+    DEBUG("delivering '%s' with writes of up to %zu bytes", box->name,
+          d->capacity);
+    return d;
+}
+
+// Records how far the named subscription of the delivery got, if any. Only
+// the subscriptions decide when to write it to TFS.
+static void record_offset(delivery_t *d, bool last) {
+    if (d->subscription >= 0 && (last || d->sent != d->recorded)) {
+        subscriptions_update(&d->box->subscriptions, (size_t)d->subscription,
+                             d->sent, last);
+        d->recorded = d->sent;
+    }
+}
+
+int delivery_push(delivery_t *d) {
+    while (true) {
+        int ret = write_pending(d);
+        if (ret != 1) {
+            if (ret == 0) {
+                record_offset(d, false);
+            }
+            return ret;
+        }
+        size_t committed = fanout_committed(&d->box->fanout);
+        if (!prepare_flush(d, committed)) {
+            record_offset(d, false);
+            return 1; // Caught up
+        }
+    }
+}
+
+void delivery_stop(delivery_t *d) {
+    record_offset(d, true);
+    DEBUG("subscriber of '%s' left after %lu messages in %lu writes, %lu "
+          "spliced",
+          d->box->name, d->msgs, d->writes, d->spliced);
+    free(d);
+}
+
+// Creates the shared header of a box, if no mapped subscriber did yet
+static int export_box(box_metadata_t *box) {
+    static _Atomic unsigned long exports = 0;
+    int ret = 0;
+    pthread_mutex_lock(&box->subscribers_lock);
+    if (!atomic_load(&box->exported)) {
+        char name[BOX_MAP_NAME_SIZE];
+        snprintf(name, sizeof(name), BOX_EXPORT_NAME_FORMAT, getpid(),
+                 atomic_fetch_add(&exports, 1));
+        ret = box_export_create(&box->export, name,
+                                fanout_committed(&box->fanout));
+        if (ret == 0) {
+            atomic_store(&box->exported, true);
+            // Catches up with an append that did not see the export yet
+            box_export_commit(&box->export, fanout_committed(&box->fanout));
+        }
+    }
+    pthread_mutex_unlock(&box->subscribers_lock);
+    return ret;
+}
+
+int box_map_offer(box_metadata_t *box, int box_fd, box_map_proto_t *map) {
+    memset(map, 0, sizeof(*map));
+    size_t capacity;
+    ssize_t offset = tfs_block_offset(box_fd, &capacity);
+    if (offset == -1 || export_box(box) == -1) {
+        WARN("failed to export box '%s'", box->name);
+        return -1;
+    }
+    snprintf(map->header_name, BOX_MAP_NAME_SIZE, "%s", box->export.name);
+    snprintf(map->data_name, BOX_MAP_NAME_SIZE, "%s", tfs_data_name);
+    map->offset = (uint64_t)offset;
+    map->capacity = capacity;
+    return 0;
+}
+
+void notify_subscribers(box_metadata_t *box, size_t end) {
+    if (!fanout_commit_up_to(&box->fanout, end)) {
+        return; // Another flush got there first
+    }
+    // Socket and pipe subscribers are woken up by their event loops, without
+    // the lock
+    socket_server_notify(box);
+    session_engine_notify(box);
+    if (!atomic_load(&box->exported)) {
+        return;
+    }
+
+    // The header is only unmapped under the lock, when the box is removed
+    pthread_mutex_lock(&box->subscribers_lock);
+    if (atomic_load(&box->exported)) {
+        box_export_commit(&box->export, fanout_committed(&box->fanout));
+    }
+    pthread_mutex_unlock(&box->subscribers_lock);
+}
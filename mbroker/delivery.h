@@ -0,0 +1,84 @@
+#ifndef __DELIVERY_H__
+#define __DELIVERY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "box_metadata.h"
+
+/**
+ * @brief Streams the messages of a box to a subscriber pipe or socket,
+ * without ever blocking
+ *
+ * @details Everything stored in the box that the subscriber has not received
+ * yet is sent as SUBSCRIBER_MESSAGE frames in one go, up to the pipe capacity
+ * (raised to SUBSCRIBER_PIPE_SIZE) or a SOCKET_PACKET_SIZE packet. A flush cut
+ * short by a full pipe is resumed where it stopped, so a lagging subscriber
+ * catches up with a few writes and an idle box adds no latency.
+ *
+ * The frames point straight into the TFS data block of the box, pinned for
+ * as long as the box lives: messages of at least
+ * SUBSCRIBER_SPLICE_MIN_LEN bytes on average are spliced into a pipe
+ * without being copied at all, smaller ones are copied once, with writev.
+ * Packets are copied once, with sendmsg.
+ */
+typedef struct delivery_t delivery_t;
+
+/**
+ * @brief Starts delivering a box to a subscriber
+ *
+ * @param box the box, which must outlive the delivery
+ * @param fd the write end of the subscriber pipe or its SOCK_SEQPACKET
+ * connection, non-blocking
+ * @param transport what fd is
+ * @param v2 whether the subscriber negotiated the version 2 wire format
+ * @param start where the first message to deliver starts, committed already
+ * @param subscription the named subscription of the box whose offset follows
+ * the delivery (see subscriptions_open), or -1
+ * @return delivery_t* the delivery, or NULL if it failed
+ */
+delivery_t *delivery_start(box_metadata_t *box, int fd,
+                           stream_transport_e transport, bool v2,
+                           size_t start, ssize_t subscription);
+
+/**
+ * @brief Sends the subscriber what it misses, until it is caught up or its
+ * fd is full
+ *
+ * @param delivery the delivery
+ * @return int 1 once the subscriber is caught up, 0 if the fd is full (to be
+ * called again once it is writable) and -1 if the subscriber left
+ */
+int delivery_push(delivery_t *delivery);
+
+/**
+ * @brief Stops a delivery, before the reference to the box is dropped: a
+ * pipe may still hold pages of the box spliced into it
+ *
+ * @param delivery the delivery
+ */
+void delivery_stop(delivery_t *delivery);
+
+/**
+ * @brief Fills the SUBSCRIBER_MAP frame that lets a subscriber map a box,
+ * creating the shared header of the box if needed
+ *
+ * @param box the box
+ * @param box_fd TFS handle of the box
+ * @param map the frame
+ * @return int 0 if was successful and -1 otherwise
+ */
+int box_map_offer(box_metadata_t *box, int box_fd, box_map_proto_t *map);
+
+/**
+ * @brief Commits the messages appended to a box up to `end` and wakes up the
+ * subscribers of the box, once for all of them. Does nothing if they were
+ * committed already.
+ *
+ * @param box the box
+ * @param end bytes of the box to commit, all of them copied in place
+ */
+void notify_subscribers(box_metadata_t *box, size_t end);
+
+#endif // __DELIVERY_H__
@@ -0,0 +1,485 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "betterassert.h"
+#include "event_loop.h"
+#include "logging.h"
+#include "mbroker.h"
+#include "operations.h"
+#include "protocols.h"
+#include "requests.h"
+
+// Events taken per epoll_wait
+#define LOOP_EVENTS 64
+// Frames read from a session before serving the others
+#define LOOP_READ_BURST 16
+
+void event_loop_wake(event_loop_t *loop) {
+    uint64_t one = 1;
+    if (write(loop->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        WARN("failed to wake event loop: %s", strerror(errno));
+    }
+}
+
+void event_loop_notify(event_loop_t *loop, box_metadata_t *box) {
+    uint64_t bit = UINT64_C(1) << loop->index;
+    // Appends after the first one find the bit set until the loop takes it
+    if ((atomic_fetch_or(&box->advanced_loops[loop->ops->transport], bit) &
+         bit) == 0) {
+        event_loop_wake(loop);
+    }
+}
+
+static int watch(event_loop_t *loop, session_t *s, int op, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.ptr = s};
+    return epoll_ctl(loop->epoll_fd, op, s->fd, &ev);
+}
+
+static void link_session(session_t **list, session_t *s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = s;
+    }
+    *list = s;
+}
+
+static void unlink_session(session_t **list, session_t *s) {
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        *list = s->next;
+    }
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+}
+
+// Lists a subscriber with the others of its box in the loop. The first one
+// has appends to the box wake the loop up.
+static int watch_box(event_loop_t *loop, session_t *s) {
+    loop_box_t *watch = loop->boxes;
+    while (watch != NULL && watch->box != s->box) {
+        watch = watch->next;
+    }
+    if (watch == NULL) {
+        watch = calloc(1, sizeof(loop_box_t));
+        if (watch == NULL) {
+            return -1;
+        }
+        watch->box = s->box;
+        watch->next = loop->boxes;
+        loop->boxes = watch;
+        stream_transport_e transport = loop->ops->transport;
+        uint64_t bit = UINT64_C(1) << loop->index;
+        atomic_fetch_or(&s->box->streaming_loops[transport], bit);
+        // Left set if the box advanced while the loop was dropping its last
+        // subscribers. Cleared before the subscriber is first flushed, so
+        // appends after that flush wake the loop up.
+        atomic_fetch_and(&s->box->advanced_loops[transport], ~bit);
+    }
+    s->watch = watch;
+    link_session(&watch->subscribers, s);
+    return 0;
+}
+
+static void unwatch_box(event_loop_t *loop, session_t *s) {
+    loop_box_t *watch = s->watch;
+    unlink_session(&watch->subscribers, s);
+    s->watch = NULL;
+    if (watch->subscribers != NULL) {
+        return;
+    }
+    atomic_fetch_and(&watch->box->streaming_loops[loop->ops->transport],
+                     ~(UINT64_C(1) << loop->index));
+    loop_box_t **link = &loop->boxes;
+    while (*link != watch) {
+        link = &(*link)->next;
+    }
+    *link = watch->next;
+    free(watch);
+}
+
+// Lists a session in the loop: subscribers by box, every other one with the
+// rest
+static int link_to_loop(event_loop_t *loop, session_t *s) {
+    if (s->role == SESSION_SUBSCRIBER) {
+        return watch_box(loop, s);
+    }
+    link_session(&loop->sessions, s);
+    return 0;
+}
+
+static void unlink_from_loop(event_loop_t *loop, session_t *s) {
+    if (s->role != SESSION_SUBSCRIBER) {
+        unlink_session(&loop->sessions, s);
+    } else if (s->watch != NULL) {
+        unwatch_box(loop, s);
+    }
+}
+
+void session_init(session_t *s, event_loop_t *loop, int fd,
+                  session_role_e role, uint32_t events) {
+    s->fd = fd;
+    s->role = role;
+    s->events = events;
+    s->box_fd = -1;
+    s->loop = loop;
+    histogram_reset(&s->batch_sizes);
+}
+
+void event_loop_hand_over(session_t *s) {
+    event_loop_t *loop = s->loop;
+    pthread_mutex_lock(&loop->incoming_lock);
+    s->next = loop->incoming;
+    loop->incoming = s;
+    pthread_mutex_unlock(&loop->incoming_lock);
+    event_loop_wake(loop);
+}
+
+int event_loop_add(event_loop_t *loop, session_t *s) {
+    if (link_to_loop(loop, s) == -1) {
+        return -1;
+    }
+    return watch(loop, s, EPOLL_CTL_ADD, s->events);
+}
+
+void event_loop_remove(event_loop_t *loop, session_t *s) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+    unlink_from_loop(loop, s);
+}
+
+void event_loop_close(event_loop_t *loop, session_t *s) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+    close(s->fd);
+    s->fd = -1;
+    // While the session still holds its box
+    unlink_from_loop(loop, s);
+    switch (s->role) {
+    case SESSION_PUBLISHER: {
+        char histogram_name[BOX_NAME_SIZE + 32];
+        snprintf(histogram_name, sizeof(histogram_name),
+                 "messages per batch in '%s'", s->box->name);
+        histogram_log(&s->batch_sizes, histogram_name);
+        DEBUG("Publisher of '%s' left", s->box->name);
+        // Drops the reference to the box
+        publisher_detach(s->box);
+        s->box = NULL;
+        break;
+    }
+    case SESSION_SUBSCRIBER:
+        // The subscriber closed its end, or the loop stops
+        delivery_stop(s->delivery);
+        // fall through
+    case SESSION_MAPPED:
+        atomic_fetch_sub(&s->box->subscribers_count, 1);
+        break;
+    case SESSION_NEW:
+    default:
+        break;
+    }
+    if (loop->ops->end != NULL) {
+        loop->ops->end(s);
+    }
+    if (s->box_fd != -1) {
+        tfs_close(s->box_fd);
+    }
+    // Also set by a subscription refused halfway
+    if (s->box != NULL) {
+        box_metadata_put(s->box);
+        s->box = NULL;
+    }
+
+    s->prev = NULL;
+    s->next = loop->closed;
+    loop->closed = s;
+}
+
+// Sends a subscriber what it misses, until its fd is full. Returns -1 if the
+// subscriber left.
+static int flush_subscriber(event_loop_t *loop, session_t *s) {
+    if (s->blocked) {
+        return 0;
+    }
+    int ret = delivery_push(s->delivery);
+    if (ret == 0) {
+        // Resumes on EPOLLOUT
+        s->blocked = true;
+        return watch(loop, s, EPOLL_CTL_MOD, s->events | EPOLLOUT);
+    }
+    return ret == 1 ? 0 : -1;
+}
+
+int event_loop_deliver(event_loop_t *loop, session_t *s,
+                       delivery_t *delivery) {
+    unlink_from_loop(loop, s);
+    s->role = SESSION_SUBSCRIBER;
+    s->delivery = delivery;
+    // Appends from now on wake the loop up
+    if (watch_box(loop, s) == -1) {
+        return -1;
+    }
+    return flush_subscriber(loop, s);
+}
+
+// Appends the messages of a publisher frame to its box. Returns -1 once the
+// session should be closed, and 1 if it left the loop.
+static int publish(event_loop_t *loop, session_t *s, uint8_t opcode,
+                   const void *payload) {
+    if (PROTO_OPCODE(opcode) == PUBLISHER_RING) {
+        if (loop->ops->ring == NULL) {
+            // The publisher falls back to its fd once its offer times out
+            WARN("publisher rings are not served here");
+            return 0;
+        }
+        return loop->ops->ring(loop, s, (const ring_proto_t *)payload);
+    }
+    size_t count;
+    ssize_t msgs_len = frame_to_messages(opcode, payload, loop->msgs, &count);
+    if (msgs_len == -1) {
+        DEBUG("Received invalid opcode from publisher for box '%s'",
+              s->box->name);
+        // Didn't expect this message: quit
+        return -1;
+    }
+    histogram_add(&s->batch_sizes, count);
+    // A whole batch is appended with a single write
+    return append_messages(s->box, loop->msgs, (size_t)msgs_len);
+}
+
+// Serves the frames a session sent. Returns -1 once it should be closed, and
+// 1 if it left the loop.
+static int read_session(event_loop_t *loop, session_t *s) {
+    s->ready = false;
+    for (int i = 0; i < LOOP_READ_BURST; i++) {
+        uint8_t opcode;
+        const void *payload;
+        int ret = loop->ops->next_frame(loop, s, &opcode, &payload);
+        if (ret != 1) {
+            return ret;
+        }
+        switch (s->role) {
+        case SESSION_NEW:
+            ret = loop->ops->request(loop, s, opcode, payload);
+            break;
+        case SESSION_PUBLISHER:
+            ret = publish(loop, s, opcode, payload);
+            break;
+        case SESSION_SUBSCRIBER:
+        case SESSION_MAPPED:
+        default:
+            // Subscribers only listen
+            ret = -1;
+            break;
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    // Frames may be left buffered, which epoll knows nothing about
+    s->ready = true;
+    s->next_ready = loop->ready;
+    loop->ready = s;
+    return 0;
+}
+
+static void serve_frames(event_loop_t *loop, session_t *s) {
+    if (read_session(loop, s) == -1) {
+        event_loop_close(loop, s);
+    }
+}
+
+// Starts serving the sessions handed over since the last time
+static void adopt_sessions(event_loop_t *loop) {
+    pthread_mutex_lock(&loop->incoming_lock);
+    session_t *s = loop->incoming;
+    loop->incoming = NULL;
+    pthread_mutex_unlock(&loop->incoming_lock);
+
+    while (s != NULL) {
+        session_t *next = s->next;
+        if (event_loop_add(loop, s) == -1 || s->failed) {
+            event_loop_close(loop, s);
+        } else if (s->role == SESSION_PUBLISHER) {
+            // Frames may have been buffered before the session moved
+            serve_frames(loop, s);
+        } else if (s->role == SESSION_SUBSCRIBER &&
+                   flush_subscriber(loop, s) == -1) {
+            // Gets what was appended before it was watched
+            event_loop_close(loop, s);
+        }
+        s = next;
+    }
+}
+
+// Adopts new sessions and sends the subscribers of every box that advanced
+// what they miss
+static void serve_wake_up(event_loop_t *loop) {
+    uint64_t count;
+    if (read(loop->wake_fd, &count, sizeof(count)) == -1) {
+        return; // Someone else already served the wake up
+    }
+    adopt_sessions(loop);
+    uint64_t bit = UINT64_C(1) << loop->index;
+    loop_box_t *watch = loop->boxes;
+    while (watch != NULL) {
+        // Freed once its last subscriber is closed
+        loop_box_t *next_watch = watch->next;
+        _Atomic uint64_t *advanced =
+            &watch->box->advanced_loops[loop->ops->transport];
+        // Taken before flushing, so appends from now on wake the loop up
+        if ((atomic_load(advanced) & bit) != 0 &&
+            (atomic_fetch_and(advanced, ~bit) & bit) != 0) {
+            session_t *s = watch->subscribers;
+            while (s != NULL) {
+                session_t *next = s->next;
+                if (flush_subscriber(loop, s) == -1) {
+                    event_loop_close(loop, s);
+                }
+                s = next;
+            }
+        }
+        watch = next_watch;
+    }
+}
+
+static void serve_session(event_loop_t *loop, session_t *s,
+                          uint32_t events) {
+    if (s->fd == -1) {
+        return; // Closed while handling an earlier event
+    }
+    int ret = 0;
+    // Reading finds out when a client that may still send something hung up,
+    // once what it sent is served
+    if ((events & EPOLLIN) || s->role == SESSION_NEW ||
+        s->role == SESSION_PUBLISHER) {
+        if (!s->ready) {
+            ret = read_session(loop, s);
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+        // The write end of a pipe reports EPOLLERR once the read end is
+        // closed
+        ret = -1;
+    }
+    if (ret == 0 && (events & EPOLLOUT) && s->role == SESSION_SUBSCRIBER) {
+        s->blocked = false;
+        ret = watch(loop, s, EPOLL_CTL_MOD, s->events);
+        if (ret == 0) {
+            ret = flush_subscriber(loop, s);
+        }
+    }
+    if (ret == -1) {
+        event_loop_close(loop, s);
+    }
+}
+
+// Serves the sessions that had frames left after their burst
+static void serve_ready(event_loop_t *loop) {
+    session_t *s = loop->ready;
+    loop->ready = NULL;
+    while (s != NULL) {
+        session_t *next = s->next_ready;
+        if (s->fd != -1) {
+            serve_frames(loop, s);
+        }
+        s = next;
+    }
+}
+
+static void free_closed(event_loop_t *loop) {
+    while (loop->closed != NULL) {
+        session_t *s = loop->closed;
+        loop->closed = s->next;
+        free(s);
+    }
+}
+
+static void *event_loop(void *arg) {
+    event_loop_t *loop = (event_loop_t *)arg;
+    struct epoll_event events[LOOP_EVENTS];
+    while (!atomic_load(&loop->stop)) {
+        int n = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS,
+                           loop->ready != NULL ? 0 : -1);
+        if (n == -1) {
+            ALWAYS_ASSERT(errno == EINTR, "Failed to wait for sessions");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                loop->ops->accept(loop);
+            } else if (ptr == loop) {
+                serve_wake_up(loop);
+            } else {
+                serve_session(loop, (session_t *)ptr, events[i].events);
+            }
+        }
+        serve_ready(loop);
+        free_closed(loop);
+    }
+
+    adopt_sessions(loop);
+    while (loop->sessions != NULL) {
+        event_loop_close(loop, loop->sessions);
+    }
+    while (loop->boxes != NULL) {
+        event_loop_close(loop, loop->boxes->subscribers);
+    }
+    free_closed(loop);
+    return NULL;
+}
+
+int event_loop_start(event_loop_t *loop, const event_loop_ops_t *ops,
+                     void *owner, size_t index, int listen_fd) {
+    if (index >= EVENT_LOOP_MAX) {
+        return -1;
+    }
+    loop->index = index;
+    loop->ops = ops;
+    loop->owner = owner;
+    atomic_init(&loop->stop, false);
+    pthread_mutex_init(&loop->incoming_lock, NULL);
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epoll_fd == -1 || loop->wake_fd == -1) {
+        return -1;
+    }
+    struct epoll_event wake_ev = {.events = EPOLLIN, .data.ptr = loop};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &wake_ev) ==
+        -1) {
+        return -1;
+    }
+    if (listen_fd != -1) {
+        // Only one of the loops is woken up for each connection
+        struct epoll_event listen_ev = {.events = EPOLLIN | EPOLLEXCLUSIVE,
+                                        .data.ptr = NULL};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &listen_ev) ==
+            -1) {
+            return -1;
+        }
+    }
+    return pthread_create(&loop->thread, NULL, event_loop, loop) == 0 ? 0
+                                                                      : -1;
+}
+
+void event_loop_stop(event_loop_t *loop) {
+    atomic_store(&loop->stop, true);
+    event_loop_wake(loop);
+}
+
+void event_loop_join(event_loop_t *loop) {
+    pthread_join(loop->thread, NULL);
+    close(loop->epoll_fd);
+    close(loop->wake_fd);
+    pthread_mutex_destroy(&loop->incoming_lock);
+}
@@ -0,0 +1,273 @@
+#ifndef __EVENT_LOOP_H__
+#define __EVENT_LOOP_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "box_metadata.h"
+#include "delivery.h"
+#include "histogram.h"
+
+// Loops of a transport, at most, since each one has a bit in the boxes it
+// streams
+#define EVENT_LOOP_MAX 64
+
+typedef struct event_loop_t event_loop_t;
+typedef struct loop_box_t loop_box_t;
+
+typedef enum session_role_e {
+    // Nothing received yet, only for socket connections
+    SESSION_NEW,
+    SESSION_PUBLISHER,
+    SESSION_SUBSCRIBER,
+    // Reads the box from shared memory, only waits to hang up
+    SESSION_MAPPED,
+} session_role_e;
+
+/**
+ * @brief A session served by an event loop, whatever it runs over
+ *
+ * @details Transports allocate sessions with malloc, possibly as the first
+ * member of a larger struct, and the loop frees them once they are closed
+ * and no event taken for them is left.
+ */
+typedef struct session_t {
+    // -1 once closed, until the loop frees it
+    int fd;
+    session_role_e role;
+    bool v2;
+    // Events watched, besides EPOLLOUT while a subscriber is blocked
+    uint32_t events;
+    box_metadata_t *box;
+    // A TFS handle of the box closed with the session, or -1
+    int box_fd;
+    event_loop_t *loop;
+    // Set by a thread that had the session to itself when it must end once
+    // back in its loop
+    bool failed;
+
+    // Publishers: messages per batch, and whether frames may be left after
+    // a burst, served again before the loop sleeps
+    histogram_t batch_sizes;
+    bool ready;
+    struct session_t *next_ready;
+
+    // Subscribers: what they were sent, whether the fd is full and we wait
+    // for EPOLLOUT, and the subscribers of the same box in the loop
+    delivery_t *delivery;
+    bool blocked;
+    loop_box_t *watch;
+
+    // The subscribers of the same box, every other session of the loop, or
+    // the closed ones not freed yet
+    struct session_t *prev;
+    struct session_t *next;
+} session_t;
+
+/**
+ * @brief What a transport (pipes or sockets) adds to the loop
+ */
+typedef struct event_loop_ops_t {
+    // How subscribers are written to, and which streaming_loops of their
+    // box the loop is in
+    stream_transport_e transport;
+
+    /**
+     * @brief Reads the next frame a session sent, without blocking
+     *
+     * @return int 1 with a frame, 0 if there is none for now and -1 once
+     * the session should be closed (the peer hung up or sent garbage)
+     */
+    int (*next_frame)(event_loop_t *loop, session_t *s, uint8_t *opcode,
+                      const void **payload);
+
+    /**
+     * @brief Serves the first frame of a SESSION_NEW session (may be NULL
+     * if the transport has none)
+     *
+     * @return int -1 once the session should be closed, be it because it was
+     * refused or answered, and 0 otherwise
+     */
+    int (*request)(event_loop_t *loop, session_t *s, uint8_t opcode,
+                   const void *payload);
+
+    /**
+     * @brief Handles the PUBLISHER_RING offer of a publisher (may be NULL if
+     * the transport serves no rings)
+     *
+     * @return int 1 if the session left the loop, 0 if it keeps being read
+     * and -1 once it should be closed
+     */
+    int (*ring)(event_loop_t *loop, session_t *s, const ring_proto_t *offer);
+
+    /**
+     * @brief Releases what the transport keeps for a session once it ended
+     * (may be NULL)
+     */
+    void (*end)(session_t *s);
+
+    /**
+     * @brief Accepts the connections waiting on the listening fd (may be
+     * NULL if there is none)
+     */
+    void (*accept)(event_loop_t *loop);
+} event_loop_ops_t;
+
+/**
+ * @brief A box a loop streams subscribers of, with those subscribers
+ */
+struct loop_box_t {
+    box_metadata_t *box;
+    session_t *subscribers;
+    struct loop_box_t *next;
+};
+
+/**
+ * @brief An event loop: one thread and one epoll instance serving sessions
+ *
+ * @details A session stays in its loop, so only one thread ever touches it,
+ * and no session holds a thread while it waits:
+ * - publisher frames are appended to their box as they arrive, a burst at a
+ *   time so that none starves the others;
+ * - subscribers get whatever they miss whenever their box advances (see
+ *   @link event_loop_notify) or their fd becomes writable again. Only the
+ *   subscribers of the boxes that advanced are flushed;
+ * - mapped subscribers are only watched until they hang up.
+ *
+ * Sessions are handed over from other threads through a list the loop
+ * adopts when woken up.
+ */
+struct event_loop_t {
+    pthread_t thread;
+    // Which of the loops of its transport it is, its bit in the boxes
+    size_t index;
+    int epoll_fd;
+    // Rung when a box it streams advances, a session is handed over or the
+    // loop stops
+    int wake_fd;
+    _Atomic bool stop;
+    const event_loop_ops_t *ops;
+    // The session engine or socket server running the loop
+    void *owner;
+
+    // Sessions handed over by other threads, not adopted yet
+    pthread_mutex_t incoming_lock;
+    session_t *incoming;
+
+    // Boxes with streamed subscribers, every other session, closed sessions
+    // and publishers with frames left
+    loop_box_t *boxes;
+    session_t *sessions;
+    session_t *closed;
+    session_t *ready;
+    char msgs[BATCH_MAX_SIZE];
+};
+
+/**
+ * @brief Starts a loop
+ *
+ * @param loop the already allocated (zeroed) loop
+ * @param ops the transport
+ * @param owner what the transport runs the loop for
+ * @param index which of the loops of the transport it is, below
+ * EVENT_LOOP_MAX
+ * @param listen_fd a listening fd whose connections are accepted by one loop
+ * each (see `accept`), or -1
+ * @return int 0 if was successful and -1 otherwise
+ */
+int event_loop_start(event_loop_t *loop, const event_loop_ops_t *ops,
+                     void *owner, size_t index, int listen_fd);
+
+/**
+ * @brief Asks a loop to stop, without waiting for it
+ *
+ * @param loop the loop
+ */
+void event_loop_stop(event_loop_t *loop);
+
+/**
+ * @brief Waits for a stopped loop to close its sessions, and releases it
+ *
+ * @param loop the loop
+ */
+void event_loop_join(event_loop_t *loop);
+
+/**
+ * @brief Wakes a loop up. Takes no lock.
+ *
+ * @param loop the loop
+ */
+void event_loop_wake(event_loop_t *loop);
+
+/**
+ * @brief Tells a loop streaming subscribers of a box that the box advanced,
+ * so that they get what they miss. Only wakes the loop up if it looked at
+ * the box since the last time. Takes no lock.
+ *
+ * @param loop the loop, one of the box's streaming_loops
+ * @param box the box
+ */
+void event_loop_notify(event_loop_t *loop, box_metadata_t *box);
+
+/**
+ * @brief Initializes the fields every session starts with
+ *
+ * @param s the session, zeroed
+ * @param loop the loop it is served by
+ * @param fd the fd it runs over, non-blocking
+ * @param role what the session is
+ * @param events the events watched for it
+ */
+void session_init(session_t *s, event_loop_t *loop, int fd,
+                  session_role_e role, uint32_t events);
+
+/**
+ * @brief Gives a session to its loop, from any thread
+ *
+ * @param s the session
+ */
+void event_loop_hand_over(session_t *s);
+
+/**
+ * @brief Starts watching a session, from the thread of its loop
+ *
+ * @param loop the loop
+ * @param s the session
+ * @return int 0 if was successful and -1 otherwise
+ */
+int event_loop_add(event_loop_t *loop, session_t *s);
+
+/**
+ * @brief Stops watching a session that leaves the loop for a while, from the
+ * thread of the loop. It comes back with @link event_loop_hand_over or
+ * @link event_loop_add.
+ *
+ * @param loop the loop
+ * @param s the session
+ */
+void event_loop_remove(event_loop_t *loop, session_t *s);
+
+/**
+ * @brief Turns a session into a subscriber streamed by its loop, and sends
+ * it what it misses
+ *
+ * @param loop the loop
+ * @param s the session, with its box and v2 set
+ * @param delivery where the subscriber is in the box
+ * @return int 0 if was successful and -1 if the session should be closed
+ */
+int event_loop_deliver(event_loop_t *loop, session_t *s,
+                       delivery_t *delivery);
+
+/**
+ * @brief Ends a session. It is only freed once the events already taken for
+ * it are handled.
+ *
+ * @param loop the loop
+ * @param s the session
+ */
+void event_loop_close(event_loop_t *loop, session_t *s);
+
+#endif // __EVENT_LOOP_H__
@@ -0,0 +1,54 @@
+#define _GNU_SOURCE // syscall
+#include "fanout.h"
+#include "futex.h"
+
+void fanout_init(fanout_t *fanout) {
+    atomic_init(&fanout->committed, 0);
+    atomic_init(&fanout->seq, 0);
+    atomic_init(&fanout->sleepers, 0);
+}
+
+// A subscriber that registered as a sleeper before the load of sleepers is
+// woken up, one that registers after it sees the new seq and does not sleep
+static void wake_sleepers(fanout_t *fanout) {
+    atomic_fetch_add(&fanout->seq, 1);
+    if (atomic_load(&fanout->sleepers) > 0) {
+        futex_wake(&fanout->seq);
+    }
+}
+
+size_t fanout_commit(fanout_t *fanout, size_t bytes) {
+    size_t committed = atomic_fetch_add(&fanout->committed, bytes) + bytes;
+    wake_sleepers(fanout);
+    return committed;
+}
+
+bool fanout_commit_up_to(fanout_t *fanout, size_t end) {
+    size_t committed = atomic_load(&fanout->committed);
+    do {
+        if (committed >= end) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&fanout->committed, &committed,
+                                           end));
+    wake_sleepers(fanout);
+    return true;
+}
+
+size_t fanout_committed(fanout_t *fanout) {
+    return atomic_load(&fanout->committed);
+}
+
+size_t fanout_wait(fanout_t *fanout, size_t seen, long timeout_ms) {
+    uint32_t seq = atomic_load(&fanout->seq);
+    size_t committed = atomic_load(&fanout->committed);
+    if (committed > seen) {
+        return committed;
+    }
+
+    atomic_fetch_add(&fanout->sleepers, 1);
+    // Sleeps only if no commit happened since the committed size was read
+    futex_wait(&fanout->seq, seq, timeout_ms);
+    atomic_fetch_sub(&fanout->sleepers, 1);
+    return atomic_load(&fanout->committed);
+}
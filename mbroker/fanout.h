@@ -0,0 +1,81 @@
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Keeps what the publisher writes and what sleeping subscribers write on
+// separate cache lines
+#define FANOUT_CACHE_LINE 64
+
+/**
+ * @brief Hands what a box commits out to its subscribers
+ *
+ * @details The box only keeps how many bytes it committed. Every subscriber
+ * keeps its own cursor into the box and chases the committed size at its own
+ * pace, so subscribers never share anything to write besides the count of
+ * sleepers.
+ *
+ * The publisher commits whole batches. A commit is an atomic add plus a bump
+ * of a futex word, and a single FUTEX_WAKE if some subscriber sleeps on it:
+ * its cost does not grow with the number of subscribers.
+ */
+typedef struct fanout_t {
+    // Bytes committed so far
+    _Alignas(FANOUT_CACHE_LINE) _Atomic size_t committed;
+    // Futex word, bumped after every commit
+    _Atomic uint32_t seq;
+
+    // Subscribers sleeping on seq, so commits nobody waits for make no
+    // syscall
+    _Alignas(FANOUT_CACHE_LINE) atomic_int sleepers;
+} fanout_t;
+
+/**
+ * @brief Initializes a fan-out with nothing committed
+ *
+ * @param fanout the fan-out
+ */
+void fanout_init(fanout_t *fanout);
+
+/**
+ * @brief Commits a batch and wakes up the subscribers sleeping for it
+ *
+ * @param fanout the fan-out
+ * @param bytes size of the batch
+ * @return size_t bytes committed, the batch included
+ */
+size_t fanout_commit(fanout_t *fanout, size_t bytes);
+
+/**
+ * @brief Commits everything up to `end`, unless a commit got further already,
+ * and wakes up the subscribers sleeping for it. Commits of overlapping
+ * prefixes may then race, and the largest one wins.
+ *
+ * @param fanout the fan-out
+ * @param end bytes committed after the call, at least
+ * @return bool whether anything was committed
+ */
+bool fanout_commit_up_to(fanout_t *fanout, size_t end);
+
+/**
+ * @brief Tells how many bytes were committed
+ *
+ * @param fanout the fan-out
+ * @return size_t bytes committed
+ */
+size_t fanout_committed(fanout_t *fanout);
+
+/**
+ * @brief Sleeps until more than `seen` bytes are committed
+ *
+ * @param fanout the fan-out
+ * @param seen the cursor of the subscriber
+ * @param timeout_ms how long to sleep at most, or -1 to sleep until a commit
+ * @return size_t bytes committed, which is `seen` if it timed out
+ */
+size_t fanout_wait(fanout_t *fanout, size_t seen, long timeout_ms);
+
+#endif // __FANOUT_H__
@@ -0,0 +1,132 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "delivery.h"
+#include "group_commit.h"
+#include "logging.h"
+
+static bool before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Commits everything staged to a box whose window ended, and drops the
+// reference of the list
+static void commit_box(box_metadata_t *box) {
+    // Cleared before reading what was staged: a publisher that still sees
+    // the window running staged its messages before this, so they are
+    // committed here, and a publisher that does not starts a new window
+    atomic_store(&box->commit_armed, false);
+    notify_subscribers(box, fanout_committed(&box->staged));
+    box_metadata_put(box);
+}
+
+static void *group_commit_thread(void *arg) {
+    group_commit_t *gc = (group_commit_t *)arg;
+    pthread_mutex_lock(&gc->lock);
+    while (true) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        // Takes the boxes whose window ended out of the list, and finds when
+        // the next window ends
+        box_metadata_t *due = NULL;
+        bool waiting = false;
+        struct timespec next;
+        box_metadata_t **link = &gc->boxes;
+        while (*link != NULL) {
+            box_metadata_t *box = *link;
+            if (gc->stop || !before(&now, &box->commit_deadline)) {
+                *link = box->commit_next;
+                box->commit_next = due;
+                due = box;
+            } else {
+                if (!waiting || before(&box->commit_deadline, &next)) {
+                    next = box->commit_deadline;
+                    waiting = true;
+                }
+                link = &box->commit_next;
+            }
+        }
+
+        if (due != NULL) {
+            pthread_mutex_unlock(&gc->lock);
+            while (due != NULL) {
+                box_metadata_t *box = due;
+                due = box->commit_next;
+                commit_box(box);
+            }
+            pthread_mutex_lock(&gc->lock);
+            continue;
+        }
+        if (gc->stop) {
+            break;
+        }
+        if (waiting) {
+            pthread_cond_timedwait(&gc->armed, &gc->lock, &next);
+        } else {
+            pthread_cond_wait(&gc->armed, &gc->lock);
+        }
+    }
+    pthread_mutex_unlock(&gc->lock);
+    return NULL;
+}
+
+int group_commit_create(group_commit_t *gc, size_t max_bytes,
+                        unsigned int window_us) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    // Deadlines are taken from the monotonic clock
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&gc->armed, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&gc->lock, NULL);
+    gc->boxes = NULL;
+    gc->stop = false;
+    gc->max_bytes = max_bytes;
+    gc->window_us = window_us;
+    if (pthread_create(&gc->thread, NULL, group_commit_thread, gc) != 0) {
+        pthread_cond_destroy(&gc->armed);
+        pthread_mutex_destroy(&gc->lock);
+        return -1;
+    }
+    LOG("group commit: up to %zu bytes or %u us per box", max_bytes,
+        window_us);
+    return 0;
+}
+
+void group_commit_destroy(group_commit_t *gc) {
+    pthread_mutex_lock(&gc->lock);
+    gc->stop = true;
+    pthread_cond_signal(&gc->armed);
+    pthread_mutex_unlock(&gc->lock);
+    pthread_join(gc->thread, NULL);
+    pthread_cond_destroy(&gc->armed);
+    pthread_mutex_destroy(&gc->lock);
+}
+
+void group_commit_staged(group_commit_t *gc, box_metadata_t *box,
+                         size_t end) {
+    if (end - fanout_committed(&box->fanout) >= box->commit_bytes) {
+        notify_subscribers(box, end);
+        return;
+    }
+    if (atomic_exchange(&box->commit_armed, true)) {
+        return; // The window is running, and will commit these as well
+    }
+
+    // Starts the window of the box
+    atomic_fetch_add(&box->refs, 1);
+    clock_gettime(CLOCK_MONOTONIC, &box->commit_deadline);
+    long nsec = box->commit_deadline.tv_nsec +
+                (long)(box->commit_window_us % 1000000) * 1000;
+    box->commit_deadline.tv_sec += box->commit_window_us / 1000000 +
+                                   nsec / 1000000000;
+    box->commit_deadline.tv_nsec = nsec % 1000000000;
+    pthread_mutex_lock(&gc->lock);
+    box->commit_next = gc->boxes;
+    gc->boxes = box;
+    pthread_cond_signal(&gc->armed);
+    pthread_mutex_unlock(&gc->lock);
+}
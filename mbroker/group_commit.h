@@ -0,0 +1,68 @@
+#ifndef __GROUP_COMMIT_H__
+#define __GROUP_COMMIT_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "box_metadata.h"
+
+/**
+ * @brief Hands the messages appended to boxes to their subscribers in groups
+ *
+ * @details Copying messages into a box is cheap, waking its subscribers up is
+ * not: it bumps a futex, writes to the eventfd of every event loop and takes
+ * the lock of the exported header. Publishers only stage their messages in
+ * place (see append_messages), and a box commits what was staged once
+ * `commit_bytes` of it pile up, or `commit_window_us` after the first of it,
+ * whichever comes first.
+ *
+ * The publisher that fills the budget commits right away. Boxes below their
+ * budget wait in a list for a thread that commits them when their window
+ * ends, so a message to an idle box is delayed by one window at most.
+ */
+typedef struct group_commit_t {
+    pthread_mutex_t lock;
+    // Signalled when a box joins the list, and when stopping
+    pthread_cond_t armed;
+    // Boxes waiting for their window to end, each one holding a reference
+    box_metadata_t *boxes;
+    bool stop;
+    pthread_t thread;
+
+    // Limits of the boxes created from now on
+    size_t max_bytes;
+    unsigned int window_us;
+} group_commit_t;
+
+/**
+ * @brief Starts the thread committing boxes whose window ended
+ *
+ * @param gc the already allocated group commit
+ * @param max_bytes bytes staged in a box that make it commit right away, or
+ * 0 to commit every append right away
+ * @param window_us how long a box may hold staged bytes below the budget
+ * @return int 0 if was successful and -1 otherwise
+ */
+int group_commit_create(group_commit_t *gc, size_t max_bytes,
+                        unsigned int window_us);
+
+/**
+ * @brief Commits every box still waiting for its window and stops the thread
+ *
+ * @param gc the group commit
+ */
+void group_commit_destroy(group_commit_t *gc);
+
+/**
+ * @brief Commits a box after messages were staged to it, right away if the
+ * box went over its budget, and at the end of its window otherwise. Takes no
+ * lock unless the window of the box starts.
+ *
+ * @param gc the group commit
+ * @param box the box
+ * @param end bytes of the box staged so far, at least
+ */
+void group_commit_staged(group_commit_t *gc, box_metadata_t *box, size_t end);
+
+#endif // __GROUP_COMMIT_H__
@@ -5,6 +5,7 @@
 #include "requests.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -12,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -21,44 +23,99 @@
 #include "fs/operations.h"
 #include "logging.h"
 #include "mbroker.h"
+#include "object_pool.h"
 #include "producer-consumer.h"
 #include "protocols.h"
 #include "requests.h"
+#include "session_engine.h"
+#include "socket_server.h"
+#include "work-stealing.h"
+#include "worker_pool.h"
 
 #define MAX_BOXES 1024
 
-uint8_t sigint_called = 0;
+box_holder_t box_holder;
+session_engine_t session_engine;
+socket_server_t socket_server;
+group_commit_t group_commit;
+size_t max_sessions;
+char tfs_data_name[BOX_MAP_NAME_SIZE];
 
-static box_holder_t box_holder;
-
-void sigint_handler() { sigint_called = 1; }
+// Sleeps until the register pipe has something to read. Returns false once
+// SIGINT arrives.
+static bool wait_for_requests(int rx, int sig_fd) {
+    struct pollfd fds[2] = {
+        {.fd = rx, .events = POLLIN},
+        {.fd = sig_fd, .events = POLLIN},
+    };
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            ALWAYS_ASSERT(errno == EINTR, "failed to wait for requests");
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            ALWAYS_ASSERT(read(sig_fd, &info, sizeof(info)) == sizeof(info),
+                          "failed to read signal");
+            return false;
+        }
+        if (fds[0].revents != 0) {
+            return true;
+        }
+    }
+}
 
 int main(int argc, char **argv) {
     set_log_level(LOG_VERBOSE); // TODO: Remove
     // Must have at least 3 arguments
     if (argc < 3) {
-        PANIC("usage: mbroker <register_pipe_name> <max_sessions>");
+        PANIC("usage: mbroker <register_pipe_name> <max_sessions> "
+              "[socket_path]");
     }
 
     const char *register_pipe_name = argv[1];
     const char *max_sessions_str = argv[2];
-    const size_t max_sessions = (size_t)atoi(max_sessions_str);
+    max_sessions = (size_t)atoi(max_sessions_str);
 
     if (box_holder_create(&box_holder, MAX_BOXES) == -1) {
         PANIC("Failed to create box holder\n");
     }
 
-    // Bootstrap tfs file system
-    ALWAYS_ASSERT(tfs_init(NULL) != -1, "Failed to initialize TFS");
+    // Bootstrap tfs file system, with the data blocks in shared memory so
+    // mapped subscribers can read the boxes in place
+    tfs_params params = tfs_default_params();
+    snprintf(tfs_data_name, BOX_MAP_NAME_SIZE, TFS_DATA_NAME_FORMAT, getpid());
+    params.shared_data_name = tfs_data_name;
+    ALWAYS_ASSERT(tfs_init(&params) != -1, "Failed to initialize TFS");
 
-    // Redefine SIGINT treatment
-    signal(SIGINT, sigint_handler);
+    // SIGINT is read from a signalfd by the register pipe listener. It is
+    // blocked before any thread is created, so every thread inherits the mask
+    // and none of them is interrupted by it.
+    sigset_t sigint_mask;
+    sigemptyset(&sigint_mask);
+    sigaddset(&sigint_mask, SIGINT);
+    ALWAYS_ASSERT(pthread_sigmask(SIG_BLOCK, &sigint_mask, NULL) == 0,
+                  "Failed to block SIGINT");
+    int sig_fd = signalfd(-1, &sigint_mask, SFD_CLOEXEC);
+    ALWAYS_ASSERT(sig_fd != -1, "Failed to create signalfd");
+    // A client that goes away must not take the broker with it
+    signal(SIGPIPE, SIG_IGN);
 
-    // producer-consumer queue
-    pc_queue_t pc_queue;
-    // Creates the producer-consumer queue
-    if (pcq_create(&pc_queue, max_sessions) == -1) {
-        PANIC("failed to create queue\n");
+    // One deque per worker and lane; idle workers steal from busy ones
+    const size_t max_threads = max_sessions + POOL_SPARE_THREADS;
+    ws_scheduler_t scheduler;
+    size_t lane_depth[WS_LANES] = {
+        [WS_LANE_CONTROL] = CONTROL_LANE_DEPTH,
+        [WS_LANE_SESSION] = max_sessions,
+    };
+    if (ws_create(&scheduler, max_threads, lane_depth, CONTROL_LANE_WEIGHT) ==
+        -1) {
+        PANIC("failed to create scheduler\n");
+    }
+    for (size_t l = 0; l < WS_LANES; l++) {
+        size_t high = lane_depth[l] * OVERLOAD_HIGH_WATERMARK_PCT / 100;
+        size_t low = lane_depth[l] * OVERLOAD_LOW_WATERMARK_PCT / 100;
+        ws_set_watermarks(&scheduler, (ws_lane_e)l, high > 0 ? high : 1, low);
     }
 
     // Remove the pipe if it does not exist
@@ -71,61 +128,152 @@ int main(int argc, char **argv) {
         PANIC("mkfifo failed: %s\n", register_pipe_name);
     }
 
-    // Create threads
-    pthread_t threads[max_sessions];
-    for (int i = 0; i < max_sessions; i++) {
-        DEBUG("Creating thread %d", i);
-        pthread_create(&threads[i], NULL, listen_for_requests, &pc_queue);
+    // Appends are committed to subscribers in groups
+    size_t commit_bytes = GROUP_COMMIT_BYTES;
+    const char *commit_bytes_str = getenv("MBROKER_COMMIT_BYTES");
+    if (commit_bytes_str != NULL) {
+        commit_bytes = (size_t)atol(commit_bytes_str);
+    }
+    unsigned int commit_window_us = GROUP_COMMIT_WINDOW_US;
+    const char *commit_window_str = getenv("MBROKER_COMMIT_WINDOW_US");
+    if (commit_window_str != NULL) {
+        commit_window_us = (unsigned int)atol(commit_window_str);
+    }
+    if (group_commit_create(&group_commit, commit_bytes, commit_window_us) ==
+        -1) {
+        PANIC("failed to start the group commit\n");
+    }
+
+    // Clients may also connect to a socket, served without worker threads
+    const char *socket_path = argc > 3 ? argv[3] : NULL;
+    if (socket_path != NULL &&
+        socket_server_create(&socket_server, socket_path,
+                             SOCKET_SERVER_THREADS) == -1) {
+        PANIC("failed to listen on socket: %s\n", socket_path);
     }
 
-    // This waits to other process to write in the pipe
-    int rx = open(register_pipe_name, O_RDONLY);
+    // Workers only register sessions: the engine runs them
+    if (session_engine_create(&session_engine, SESSION_ENGINE_THREADS) ==
+        -1) {
+        PANIC("failed to start the session engine\n");
+    }
+
+    // Create the worker threads; more are spawned on demand
+    worker_pool_t pool;
+    if (worker_pool_create(&pool, &scheduler, handle_request,
+                           POOL_MIN_THREADS, max_threads,
+                           POOL_IDLE_TIMEOUT_MS) == -1) {
+        PANIC("failed to create worker pool\n");
+    }
+
+    // Holding the write end as well means the pipe never reaches EOF when the
+    // last client closes it, so the listener sleeps in poll between requests
+    // instead of spinning on read. O_RDWR does not wait for a writer (Linux).
+    int rx = open(register_pipe_name, O_RDWR | O_NONBLOCK);
     if (rx == -1) {
         PANIC("failed to open register pipe: %s\n", register_pipe_name);
         remove(register_pipe_name);
     }
 
+    // Requests are pulled from the register pipe in bursts
+    frame_reader_t reader;
+    if (frame_reader_init(&reader, rx) == -1) {
+        PANIC("failed to create register pipe reader\n");
+    }
+
     // Listen to events in the register pipe
-    while (sigint_called == 0) {
+    while (true) {
         uint8_t prot_code = 0;
-        ssize_t ret = read(rx, &prot_code, sizeof(uint8_t));
-        DEBUG("Read proto code %u", prot_code);
+        const void *payload = NULL;
+        ssize_t ret = frame_reader_next(&reader, &prot_code, &payload);
 
         if (ret == 0) {
-            INFO("pipe closed\n");
-            continue;
+            // We are a writer ourselves, so this should never happen
+            PANIC("register pipe closed: %s\n", register_pipe_name);
         } else if (ret == -1) {
+            if (errno == EAGAIN) {
+                if (!wait_for_requests(rx, sig_fd)) {
+                    break;
+                }
+                continue;
+            }
+            if (errno == EPROTO) {
+                WARN("discarding frames with invalid opcode %u", prot_code);
+                continue;
+            }
             PANIC("failed to read named pipe: %s\n", register_pipe_name);
         }
+        DEBUG("Read proto code %u", prot_code);
+        // Messages and responses are shorter than proto_size says, or have
+        // no fixed size at all, and no client sends them here anyway
+        if (!proto_is_request(PROTO_OPCODE(prot_code))) {
+            WARN("discarding frame with opcode %u on the register pipe",
+                 prot_code);
+            continue;
+        }
 
-        void *protocol = parse_protocol(rx, prot_code);
+        // Fails fast instead of blocking the register pipe while saturated
+        ws_lane_e lane = request_lane(prot_code);
+        if (ws_overloaded(&scheduler, lane)) {
+            DEBUG("rejecting request of protocol: %u", prot_code);
+            reject_request(prot_code, payload);
+            continue;
+        }
 
-        queue_obj_t *obj = malloc(sizeof(queue_obj_t));
+        // The payload only lives until the next frame, so the worker gets
+        // its own copy
+        size_t proto_sz = proto_size(PROTO_OPCODE(prot_code));
+        void *protocol = obj_pool_alloc(proto_sz);
+        queue_obj_t *obj = obj_pool_alloc(sizeof(queue_obj_t));
+        ALWAYS_ASSERT(protocol != NULL && obj != NULL,
+                      "Failed to alloc queue object");
+        memcpy(protocol, payload, proto_sz);
 
         obj->opcode = prot_code;
         obj->protocol = protocol;
 
+        // Requests that touch the same box go to the same worker. Every
+        // request but the box listing starts with request_proto_t.
+        uint64_t affinity = WS_ANY_WORKER;
+        if (PROTO_OPCODE(prot_code) != LIST_BOXES_REQUEST) {
+            affinity = ws_hash_string(((request_proto_t *)protocol)->box_name,
+                                      BOX_NAME_SIZE);
+        }
+
         DEBUG("enqueue request of protocol: %u", obj->opcode);
 
-        pcq_enqueue(&pc_queue, obj);
+        worker_pool_submit(&pool, obj, lane, affinity);
     }
     DEBUG("Caught SIGINT signal, cleaning up...");
+    LOG("pool size: %zu threads", worker_pool_size(&pool));
+    LOG("register pipe: %lu frames in %lu reads", reader.frames, reader.reads);
 
-    // Wait for all threads to finish
-    for (int i = 0; i < max_sessions; i++) {
-        pthread_join(threads[i], NULL);
+    if (socket_path != NULL) {
+        socket_server_destroy(&socket_server);
     }
 
+    // Wait for all threads to finish, then end the sessions they registered
+    worker_pool_destroy(&pool);
+    session_engine_destroy(&session_engine);
+    // Commits what the last publishers staged
+    group_commit_destroy(&group_commit);
+
     // Closes the register pipe
+    frame_reader_destroy(&reader);
     close(rx);
+    close(sig_fd);
 
     // Removes the pipe
     if (remove(register_pipe_name) != 0) {
         PANIC("failed to remove named pipe: %s\n", register_pipe_name);
     }
 
-    // Destroys the queue
-    pcq_destroy(&pc_queue);
+    // Destroys the scheduler
+    ws_destroy(&scheduler, release_request);
+
+    obj_pool_stats_t stats = obj_pool_stats();
+    LOG("object pool: %lu allocs, %lu frees, %lu mallocs, %lu depot exchanges",
+        stats.allocs, stats.frees, stats.mallocs, stats.depot_exchanges);
 
     // Destroys TFS
     ALWAYS_ASSERT(tfs_destroy() != -1, "Failed to destroy TFS");
@@ -2,7 +2,83 @@
 #define __MBROKER_H__
 
 #include "box_metadata.h"
+#include "group_commit.h"
+#include "session_engine.h"
+#include "socket_server.h"
+#include "work-stealing.h"
 
-static box_holder_t box_holder;
+// Maximum number of queued manager requests (create, remove, list)
+#define CONTROL_LANE_DEPTH 64
+
+// WS_STRICT_PRIORITY, or how many manager requests a worker may serve in a
+// row while registrations are waiting
+#define CONTROL_LANE_WEIGHT WS_STRICT_PRIORITY
+
+// Overload protection: once a lane holds this percentage of its depth, the
+// reader answers new requests for it with a busy response instead of queueing
+// them, until the lane drains down to the low watermark
+#define OVERLOAD_HIGH_WATERMARK_PCT 90
+#define OVERLOAD_LOW_WATERMARK_PCT 50
+
+// Worker threads kept alive even when there are no requests
+#define POOL_MIN_THREADS 2
+
+// Extra threads on top of max_sessions, so manager requests can still be
+// served while every worker registering a session waits for its client to
+// open the pipe
+#define POOL_SPARE_THREADS 1
+
+// How long a worker waits for a subscriber to open its pipe once it
+// registered, trying every CLIENT_PIPE_RETRY_MS. Publishers are not waited
+// for: their session starts right away and reads nothing until they open it.
+#define CLIENT_PIPE_TIMEOUT_MS 1000
+#define CLIENT_PIPE_RETRY_MS 5
+
+// How long a thread above POOL_MIN_THREADS may stay idle before exiting
+#define POOL_IDLE_TIMEOUT_MS 5000
+
+// Largest capacity asked for a subscriber pipe (F_SETPIPE_SZ), so a lagging
+// subscriber catches up with few writes. The kernel may cap it lower.
+#define SUBSCRIBER_PIPE_SIZE (1024 * 1024)
+
+// Subscribers whose messages are at least this long on average get them
+// spliced (vmsplice) from the TFS data blocks into their pipe instead of
+// copied. Each spliced piece takes a whole pipe buffer, so small messages are
+// cheaper to copy.
+#define SUBSCRIBER_SPLICE_MIN_LEN 512
+
+// How often a thread draining a publisher ring checks if the publisher died
+// or the mbroker stops
+#define RING_POLL_MS 200
+
+// Most publisher rings drained at once, each by a thread of its own. Rings
+// offered past it are turned down and their publishers keep their pipe.
+#define RING_MAX_THREADS 8
+
+// Group commit: messages appended to a box reach its subscribers once this
+// many bytes of them pile up, or this long after the first of them, whichever
+// comes first. Overridden by the MBROKER_COMMIT_BYTES and
+// MBROKER_COMMIT_WINDOW_US environment variables; 0 bytes commits every
+// append right away.
+#define GROUP_COMMIT_BYTES 256
+#define GROUP_COMMIT_WINDOW_US 200
+
+// Event loops running the sessions of the clients of the register pipe
+#define SESSION_ENGINE_THREADS 2
+
+// Event loops serving the clients connected to the mbroker socket
+#define SOCKET_SERVER_THREADS 2
+
+// Shared memory objects read by mapped subscribers, named after the pid of the
+// mbroker: the TFS data blocks, and the header of each exported box
+#define TFS_DATA_NAME_FORMAT "/mbroker-%d-tfs"
+#define BOX_EXPORT_NAME_FORMAT "/mbroker-%d-box-%lu"
+
+extern box_holder_t box_holder;
+extern session_engine_t session_engine;
+extern socket_server_t socket_server;
+extern group_commit_t group_commit;
+extern size_t max_sessions;
+extern char tfs_data_name[BOX_MAP_NAME_SIZE];
 
 #endif
\ No newline at end of file
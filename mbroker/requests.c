@@ -1,51 +1,156 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "betterassert.h"
+#include "delivery.h"
 #include "logging.h"
 #include "mbroker.h"
+#include "object_pool.h"
 #include "operations.h"
 #include "protocols.h"
 #include "requests.h"
+#include "session_engine.h"
 
-// Guarantees atomicity of checking if a publisher is attached to a box, and if
-// not, attach one to it.
+// Guarantees atomicity of checking if a box exists in TFS, and if not,
+// creating it
 pthread_mutex_t tfs_ops = PTHREAD_MUTEX_INITIALIZER;
 
-void *listen_for_requests(void *queue) {
-    set_log_level(LOG_VERBOSE);
-    while (true) {
-        queue_obj_t *obj = (queue_obj_t *)pcq_dequeue((pc_queue_t *)queue);
-        DEBUG("Dequeued object with code %u", obj->opcode);
-        parse_request(obj);
-        free(obj->protocol);
-        free(obj);
+void handle_request(void *request) {
+    queue_obj_t *obj = (queue_obj_t *)request;
+    DEBUG("Dequeued object with code %u", obj->opcode);
+    parse_request(obj);
+    release_request(obj);
+}
+
+void release_request(void *request) {
+    queue_obj_t *obj = (queue_obj_t *)request;
+    obj_pool_free(obj->protocol);
+    obj_pool_free(obj);
+}
+
+ws_lane_e request_lane(uint8_t opcode) {
+    switch (PROTO_OPCODE(opcode)) {
+    case REGISTER_PUBLISHER:
+    case REGISTER_SUBSCRIBER:
+    case REGISTER_SUBSCRIBER_MAPPED:
+    case REGISTER_SUBSCRIBER_FROM:
+        return WS_LANE_SESSION;
+    default:
+        return WS_LANE_CONTROL;
+    }
+}
+
+static void send_busy_response(const char *client_named_pipe_path,
+                               uint8_t opcode, bool v2) {
+    int pipe_fd = open(client_named_pipe_path, O_WRONLY | O_NONBLOCK);
+    if (pipe_fd == -1) {
+        WARN("Client pipe %s is not open, dropping request",
+             client_named_pipe_path);
+        return;
+    }
+
+    // Smaller than PIPE_BUF, so it is written whole or not at all
+    if (send_response_frame(pipe_fd, PROTO_WITH_VERSION(opcode, v2), -1,
+                            ERR_BROKER_BUSY) == -1) {
+        WARN("Failed to send busy response to %s", client_named_pipe_path);
+    }
+    close(pipe_fd);
+}
+
+static void refuse_session(const char *client_named_pipe_path, int flags) {
+    int pipe_fd = open(client_named_pipe_path, flags | O_NONBLOCK);
+    if (pipe_fd == -1) {
+        WARN("Client pipe %s is not open, dropping session",
+             client_named_pipe_path);
+        return;
+    }
+    close(pipe_fd); // The client sees EOF (or EPIPE)
+}
+
+// Opens the pipe of a client registering a session without ever blocking
+// the worker. The write end only opens once the client opened its read end,
+// which it does right after registering, so it is tried again for up to
+// CLIENT_PIPE_TIMEOUT_MS. The read end always opens.
+static int open_client_pipe(const char *client_named_pipe_path, int flags) {
+    for (int waited = 0;; waited += CLIENT_PIPE_RETRY_MS) {
+        int pipe_fd = open(client_named_pipe_path, flags | O_NONBLOCK);
+        if (pipe_fd != -1 || (errno != ENXIO && errno != EINTR) ||
+            waited >= CLIENT_PIPE_TIMEOUT_MS) {
+            return pipe_fd;
+        }
+        poll(NULL, 0, CLIENT_PIPE_RETRY_MS);
+    }
+}
+
+void reject_request(uint8_t opcode, const void *protocol) {
+    // Answers in the wire format version of the request
+    bool v2 = PROTO_IS_V2(opcode);
+    const char *client_pipe;
+    switch (PROTO_OPCODE(opcode)) {
+    case CREATE_BOX_REQUEST:
+        client_pipe =
+            ((const create_box_proto_t *)protocol)->client_named_pipe_path;
+        send_busy_response(client_pipe, CREATE_BOX_RESPONSE, v2);
+        break;
+    case REMOVE_BOX_REQUEST:
+        client_pipe =
+            ((const remove_box_proto_t *)protocol)->client_named_pipe_path;
+        send_busy_response(client_pipe, REMOVE_BOX_RESPONSE, v2);
+        break;
+    case LIST_BOXES_REQUEST:
+        client_pipe = ((const list_boxes_request_proto_t *)protocol)
+                          ->client_named_pipe_path;
+        send_busy_response(client_pipe, BROKER_BUSY_RESPONSE, v2);
+        break;
+    case REGISTER_PUBLISHER:
+        client_pipe =
+            ((const register_pub_proto_t *)protocol)->client_named_pipe_path;
+        refuse_session(client_pipe, O_RDONLY);
+        break;
+    case REGISTER_SUBSCRIBER:
+    case REGISTER_SUBSCRIBER_MAPPED:
+    case REGISTER_SUBSCRIBER_FROM:
+        client_pipe =
+            ((const register_sub_proto_t *)protocol)->client_named_pipe_path;
+        refuse_session(client_pipe, O_WRONLY);
+        break;
+    default:
+        WARN("invalid protocol code\n");
+        break;
     }
-    return NULL;
 }
 
 void parse_request(queue_obj_t *obj) {
-    switch (obj->opcode) {
+    bool v2 = PROTO_IS_V2(obj->opcode);
+    switch (PROTO_OPCODE(obj->opcode)) {
     case REGISTER_PUBLISHER:
-        register_publisher(obj->protocol);
+        register_publisher(obj->protocol, v2);
         break;
     case REGISTER_SUBSCRIBER:
-        register_subscriber(obj->protocol);
+        register_subscriber(obj->protocol, v2);
+        break;
+    case REGISTER_SUBSCRIBER_MAPPED:
+        register_mapped_subscriber(obj->protocol, v2);
+        break;
+    case REGISTER_SUBSCRIBER_FROM:
+        register_subscriber_from(obj->protocol, v2);
         break;
     case CREATE_BOX_REQUEST:
-        create_box(obj->protocol);
+        create_box(obj->protocol, v2);
         break;
     case REMOVE_BOX_REQUEST:
-        remove_box(obj->protocol);
+        remove_box(obj->protocol, v2);
         break;
     case LIST_BOXES_REQUEST:
-        list_boxes(obj->protocol);
+        list_boxes(obj->protocol, v2);
         break;
     default:
         WARN("invalid protocol code\n");
@@ -53,106 +158,249 @@ void parse_request(queue_obj_t *obj) {
     }
 }
 
-void register_publisher(void *protocol) {
+// Bytes of the whole messages at the start of `msgs` that fit in `room`
+static size_t fitting_prefix(const char *msgs, size_t msgs_len, size_t room) {
+    if (msgs_len <= room) {
+        return msgs_len;
+    }
+    // Every message ends with its NUL
+    size_t len = room;
+    while (len > 0 && msgs[len - 1] != '\0') {
+        len--;
+    }
+    return len;
+}
+
+int append_messages(box_metadata_t *box, const char *msgs,
+                    size_t msgs_len) {
+    // Publishers of the same box copy their messages in parallel, each one
+    // into the range it reserved. A range only takes the messages that fit,
+    // so the ones that don't leave the rest of the box to smaller ones.
+    size_t start = atomic_load(&box->tail);
+    size_t len;
+    do {
+        len = fitting_prefix(msgs, msgs_len, box->capacity - start);
+        if (len == 0) {
+            DEBUG("Box '%s' is full", box->name);
+            return -1;
+        }
+    } while (!atomic_compare_exchange_weak(&box->tail, &start, start + len));
+    memcpy(box->data + start, msgs, len);
+
+    // Stages in the order of the reservations, so subscribers only ever see
+    // contiguous messages
+    size_t staged;
+    while ((staged = fanout_committed(&box->staged)) < start) {
+        fanout_wait(&box->staged, staged, -1);
+    }
+    box_index_append(&box->index, box->data, start, len);
+    group_commit_staged(&group_commit, box,
+                        fanout_commit(&box->staged, len));
+    if (len < msgs_len) {
+        DEBUG("Box '%s' is full, %zu bytes of the batch were dropped",
+              box->name, msgs_len - len);
+        return -1;
+    }
+    return 0;
+}
+
+box_metadata_t *publisher_attach(const char *box_name) {
+    box_metadata_t *box = box_holder_find_box(&box_holder, box_name);
+    if (box != NULL) {
+        atomic_fetch_add(&box->publishers_count, 1);
+    }
+    return box;
+}
+
+void publisher_detach(box_metadata_t *box) {
+    atomic_fetch_sub(&box->publishers_count, 1);
+    box_metadata_put(box);
+}
+
+size_t copy_message(char *dst, const char *msg, size_t len) {
+    // A message ends at its first \0, as it does for subscribers reading
+    // the box
+    const char *nul = memchr(msg, '\0', len);
+    if (nul != NULL) {
+        len = (size_t)(nul - msg);
+    }
+    if (len > MSG_SIZE - 1) {
+        len = MSG_SIZE - 1;
+    }
+    memcpy(dst, msg, len);
+    dst[len] = '\0';
+    return len + 1;
+}
+
+ssize_t frame_to_messages(uint8_t opcode, const void *payload,
+                          char msgs[BATCH_MAX_SIZE], size_t *count) {
+    size_t msgs_len = 0;
+    size_t msg_len;
+    const char *msg;
+    if (PROTO_OPCODE(opcode) == PUBLISHER_MESSAGE) {
+        msg = frame_message(opcode, payload, &msg_len);
+        msgs_len = copy_message(msgs, msg, msg_len);
+        *count = 1;
+    } else if (PROTO_OPCODE(opcode) == PUBLISHER_BATCH) {
+        batch_iter_t iter;
+        batch_iter_init(&iter, payload);
+        *count = 0;
+        while ((msg = batch_iter_next(&iter, &msg_len)) != NULL) {
+            msgs_len += copy_message(msgs + msgs_len, msg, msg_len);
+            (*count)++;
+        }
+    } else {
+        return -1;
+    }
+    return (ssize_t)msgs_len;
+}
+
+void register_publisher(void *protocol, bool v2) {
     register_pub_proto_t *request = (register_pub_proto_t *)protocol;
-    // TODO: O_WRONLY | O_CREAT faz sentido sequer?
-    int pipe_fd = open(request->client_named_pipe_path, O_WRONLY);
-    ALWAYS_ASSERT(pipe_fd != -1, "Failed to open client named pipe")
-
-    int fd = tfs_open(request->box_name, TFS_O_APPEND);
-    /*
-    Meta-file for the box. If this file exists, then a publisher is registered
-    to it. Max filename from TFS is 40 (config.h), (len(BOX_NAME_SIZE +
-    ".pub\0") = 37) < 40, should be okay
-    */
-    char meta_filename[MAX_FILE_NAME];
-    snprintf(meta_filename, MAX_FILE_NAME, "%s.pub", request->box_name);
-    pthread_mutex_lock(&tfs_ops);
-    int meta_fd = tfs_open(meta_filename, 0);
-    // If we couldn't open the box for whatever reason, or the meta-file exists,
-    // exit.
-    if (fd == -1 || meta_fd != -1) {
+    // The publisher writes to its pipe, we only read
+    int pipe_fd = open_client_pipe(request->client_named_pipe_path, O_RDONLY);
+    if (pipe_fd == -1) {
+        WARN("Failed to open client named pipe %s",
+             request->client_named_pipe_path);
+        return;
+    }
+
+    box_metadata_t *box = publisher_attach(request->box_name);
+    if (box == NULL) {
         close(pipe_fd); // Supposedly, this is equivalent to sending EOF.
-        tfs_close(fd);
-        tfs_close(meta_fd);
-        tfs_unlink(meta_filename);
-        pthread_mutex_unlock(&tfs_ops);
         return;
     }
-    // At this point, meta-file doesn't exist.
-    ALWAYS_ASSERT((meta_fd = tfs_open(meta_filename, TFS_O_CREAT)) != -1,
-                  "An error ocurred while creating meta-file for %s",
-                  request->box_name);
-    ALWAYS_ASSERT(tfs_close(meta_fd) == 0,
-                  "An error ocurred closing meta-file for %s",
-                  request->box_name);
-    pthread_mutex_unlock(&tfs_ops);
 
-    // Start receiving messages
-    // char *msg = calloc(MSG_SIZE, sizeof(char));
-    //  int bytes_read = -1;
-    uint8_t op;
-    publisher_msg_proto_t *pub_msg;
-    ssize_t written = -1;
-    size_t msg_len;
-    while (0) { // FIXME: Should check a variable! (Maybe create an array that a
-                // signal handler changes this thread's variable)
-        op = recv_opcode(pipe_fd);
-        if (op != PUBLISHER_MESSAGE) {
-            DEBUG("Received invalid opcode from publisher for box '%s'",
-                  request->box_name);
-            // Didn't expect this message: quit
-            break;
-        }
-        pub_msg = (publisher_msg_proto_t *)parse_protocol(pipe_fd, op);
-        DEBUG("Received this message from publisher of '%s': '%s'",
-              request->box_name, pub_msg->msg);
-        written = tfs_write(fd, pub_msg->msg,
-                            strlen(pub_msg->msg) + 1); //+1 to include \0
-        if (written != msg_len) {
-            // We don't explicitly disallow new publishers to connect after this
-            // one quits, But subsequent publishers will all fail here and won't
-            // write anything else.
-            DEBUG("Couldn't write entire message to TFS. Quitting.")
-            break;
-        }
+    (void)v2; // Messages carry their own version in the opcode
+    // Runs until the publisher closes its pipe, without this worker
+    if (session_engine_add_publisher(&session_engine, pipe_fd, box) == -1) {
+        WARN("Failed to start session for publisher of '%s'",
+             request->box_name);
+        close(pipe_fd);
+        publisher_detach(box);
     }
-    DEBUG("Cleaning up thread for publisher of '%s'", request->box_name);
-    close(pipe_fd);
-    tfs_close(fd);
-    ALWAYS_ASSERT(tfs_unlink(meta_filename) == 0,
-                  "Failed to delete meta-file while removing publisher");
-    DEBUG("Thread for publisher of '%s' finished", request->box_name);
-    return;
-    // There's no publisher, continue
-    // tfs_write(metadata_fd, )
-    // TODO RG: look here
+}
+
+int subscriber_start(box_metadata_t *box,
+                     const register_sub_from_proto_t *from, size_t *start,
+                     ssize_t *subscription, bool *created) {
+    *start = 0;
+    *subscription = -1;
+    *created = false;
+    if (from == NULL) {
+        return 0;
+    }
+    *start = box_index_seek(&box->index, box->data,
+                            fanout_committed(&box->fanout),
+                            (seek_e)from->seek, from->position);
+    if (from->subscription[0] == '\0') {
+        return 0;
+    }
+    if (from->mapped) {
+        DEBUG("Mapped subscriber of '%s' named its subscription", box->name);
+        return -1;
+    }
+    // Resumes where the subscription stopped, if it exists
+    *subscription = subscriptions_open(&box->subscriptions,
+                                       from->subscription, start, created);
+    if (*subscription == -1) {
+        DEBUG("No room for another subscription of '%s'", box->name);
+        return -1;
+    }
+    return 0;
+}
+
+void subscriber_cancel(box_metadata_t *box, ssize_t subscription,
+                       bool created) {
+    if (subscription != -1) {
+        subscriptions_cancel(&box->subscriptions, (size_t)subscription,
+                             created);
+    }
+}
 
-    // if (STR_MATCH(cur_publisher))
-    /*TODO these checks:
-    if tfs_write fails;
-    if a publisher already exists;
+// Registers a subscriber session, pushing messages through its pipe or
+// letting it map the box. Starts at the position asked for, if any.
+static void subscribe(register_sub_proto_t *request, bool v2, bool mapped,
+                      const register_sub_from_proto_t *from) {
+    // The subscriber reads from its pipe, we only write
+    int pipe_fd = open_client_pipe(request->client_named_pipe_path, O_WRONLY);
+    if (pipe_fd == -1) {
+        WARN("Failed to open client named pipe %s",
+             request->client_named_pipe_path);
+        return;
+    }
+
+    box_metadata_t *box = box_holder_find_box(&box_holder, request->box_name);
+    int fd = box == NULL ? -1 : tfs_open(request->box_name, 0);
+    if (fd == -1) {
+        DEBUG("Subscriber asked for unknown box '%s'", request->box_name);
+        if (box != NULL) {
+            box_metadata_put(box);
+        }
+        close(pipe_fd); // The subscriber sees EOF
+        return;
+    }
 
-    */
+    size_t start;
+    ssize_t subscription;
+    bool created;
+    int ret = subscriber_start(box, from, &start, &subscription, &created);
+    box_map_proto_t map;
+    if (ret == 0 && mapped) {
+        ret = box_map_offer(box, fd, &map);
+        map.start = start;
+        if (ret == 0) {
+            ret = send_frame(pipe_fd, PROTO_WITH_VERSION(SUBSCRIBER_MAP, v2),
+                             &map);
+        }
+        if (ret == 0) {
+            DEBUG("exported '%s' to a subscriber through %s", box->name,
+                  map.header_name);
+        }
+    }
+    // Runs until the subscriber closes its pipe, without this worker
+    if (ret == -1 || session_engine_add_subscriber(&session_engine, pipe_fd,
+                                                   box, fd, v2, mapped,
+                                                   start,
+                                                   subscription) == -1) {
+        WARN("Failed to start session for subscriber of '%s'",
+             request->box_name);
+        subscriber_cancel(box, subscription, created);
+        box_metadata_put(box);
+        tfs_close(fd);
+        close(pipe_fd);
+    }
 }
 
-void register_subscriber(void *protocol) {
-    (void)protocol;
-    WARN("not implemented\n"); // Todo: implement me
+void register_subscriber(void *protocol, bool v2) {
+    subscribe((register_sub_proto_t *)protocol, v2, false, NULL);
 }
 
-void create_box(void *protocol) {
-    create_box_proto_t *request = (create_box_proto_t *)protocol;
+void register_mapped_subscriber(void *protocol, bool v2) {
+    subscribe((register_mapped_sub_proto_t *)protocol, v2, true, NULL);
+}
 
-    create_box_response_proto_t *response =
-        calloc(1, sizeof(create_box_response_proto_t));
-    ALWAYS_ASSERT(
-        response != NULL,
-        "Call to calloc failed."); // TODO: wrap calloc instead of this
-    response->return_code = REMOVE_BOX_RESPONSE;
+void register_subscriber_from(void *protocol, bool v2) {
+    register_sub_from_proto_t *request =
+        (register_sub_from_proto_t *)protocol;
+    // Starts with the same fields as every registration
+    subscribe((register_sub_proto_t *)protocol, v2, request->mapped != 0,
+              request);
+}
 
-    int pipe_fd = open_pipe(request->client_named_pipe_path, O_WRONLY);
+// A client that went away must not take the worker with it
+static void send_response(int pipe_fd, uint8_t opcode, int32_t return_code,
+                          const char *error_msg) {
+    if (send_response_frame(pipe_fd, opcode, return_code, error_msg) == -1) {
+        WARN("Failed to send response %u: %s", opcode, strerror(errno));
+    }
+}
 
+int create_box_named(const char *box_name, const char **error_msg) {
+    if (subscriptions_reserved(box_name)) {
+        *error_msg = ERR_BOX_NAME_RESERVED;
+        return -1;
+    }
     // Check if the box already exists.
     // Send error and quit, if so.
     pthread_mutex_lock(&tfs_ops);
@@ -161,40 +409,137 @@ void create_box(void *protocol) {
     // `CREATE_IF_NOT_EXISTS`-equivalent flag. Since TFS doesn't have that
     // feature (and we can't use tfs_lookup here), we have to call `tfs_open`
     // twice
-    int fd = tfs_open(request->box_name, 0);
+    int fd = tfs_open(box_name, 0);
     if (fd != -1) {
-        snprintf(response->error_msg, MSG_SIZE, ERR_BOX_ALREADY_EXISTS);
         tfs_close(fd);
         pthread_mutex_unlock(&tfs_ops);
-        send_proto_string(pipe_fd, REMOVE_BOX_RESPONSE, response);
-        close(pipe_fd);
-        return;
+        *error_msg = ERR_BOX_ALREADY_EXISTS;
+        return -1;
     }
     // Create the new file for the box
-    fd = tfs_open(request->box_name, TFS_O_CREAT | TFS_O_TRUNC);
-
-    if (fd == -1) {
-        snprintf(response->error_msg, MSG_SIZE, ERR_BOX_CREATION);
+    fd = tfs_open(box_name, TFS_O_CREAT | TFS_O_TRUNC);
+    if (fd != -1) {
+        box_metadata_t *box = box_metadata_create(box_name, fd);
         tfs_close(fd);
+        if (box == NULL) {
+            // No data block left for the box
+            tfs_unlink(box_name);
+            fd = -1;
+        } else {
+            box->commit_bytes = group_commit.max_bytes;
+            box->commit_window_us = group_commit.window_us;
+            // The TFS file did not exist, so neither did the box
+            ALWAYS_ASSERT(box_holder_insert(&box_holder, box) == 0,
+                          "Box %s already in the box holder", box_name);
+        }
     }
     pthread_mutex_unlock(&tfs_ops);
-    send_proto_string(pipe_fd, REMOVE_BOX_RESPONSE, response);
+
+    if (fd == -1) {
+        *error_msg = ERR_BOX_CREATION;
+        return -1;
+    }
+    *error_msg = "";
+    return 0;
+}
+
+void create_box(void *protocol, bool v2) {
+    create_box_proto_t *request = (create_box_proto_t *)protocol;
+    uint8_t opcode = PROTO_WITH_VERSION(CREATE_BOX_RESPONSE, v2);
+
+    int pipe_fd = open_pipe(request->client_named_pipe_path, O_WRONLY);
+    const char *error_msg;
+    int32_t return_code = create_box_named(request->box_name, &error_msg);
+    send_response(pipe_fd, opcode, return_code, error_msg);
     close(pipe_fd);
-    return;
 }
 
-void remove_box(void *protocol) {
-    remove_box_proto_t *request = (remove_box_proto_t *)protocol;
+int remove_box_named(const char *box_name) {
     pthread_mutex_lock(&tfs_ops);
-    ALWAYS_ASSERT(tfs_unlink(request->box_name) == 0, "Failed to remove box");
+    // Mapped subscribers must stop reading before the data block is reused
+    box_metadata_t *box = box_holder_find_box(&box_holder, box_name);
+    if (box == NULL) {
+        // Not a box, though it may be the subscriptions file of one
+        pthread_mutex_unlock(&tfs_ops);
+        return -1;
+    }
+    pthread_mutex_lock(&box->subscribers_lock);
+    if (atomic_load(&box->exported)) {
+        atomic_store(&box->exported, false);
+        box_export_destroy(&box->export);
+    }
+    pthread_mutex_unlock(&box->subscribers_lock);
+    int ret = tfs_unlink(box_name);
+    subscriptions_remove(&box->subscriptions);
+    // Sessions still running keep the box until they end
+    box_holder_remove(&box_holder, box_name);
+    box_metadata_put(box);
 
     // todo: remove all subscribers and publishers from this box.
 
     pthread_mutex_unlock(&tfs_ops);
+    return ret;
 }
 
-void list_boxes(void *protocol) {
+void remove_box(void *protocol, bool v2) {
+    remove_box_proto_t *request = (remove_box_proto_t *)protocol;
+    uint8_t opcode = PROTO_WITH_VERSION(REMOVE_BOX_RESPONSE, v2);
+
+    int pipe_fd = open_pipe(request->client_named_pipe_path, O_WRONLY);
+    int32_t return_code = remove_box_named(request->box_name);
+    send_response(pipe_fd, opcode, return_code,
+                  return_code == 0 ? "" : ERR_BOX_NOT_FOUND);
+    close(pipe_fd);
+}
+
+// Sends the listing one box behind, so the last box can be flagged
+typedef struct box_list_t {
+    int fd;
+    uint8_t opcode;
+    bool pending;
+    list_boxes_response_proto_t response;
+    int ret;
+} box_list_t;
+
+static void list_box(box_metadata_t *box, void *arg) {
+    box_list_t *list = (box_list_t *)arg;
+    if (list->pending &&
+        send_frame(list->fd, list->opcode, &list->response) == -1) {
+        list->ret = -1;
+    }
+
+    uint64_t box_size = fanout_committed(&box->fanout);
+    uint64_t n_publishers = (uint64_t)atomic_load(&box->publishers_count);
+    uint64_t n_subscribers = (uint64_t)atomic_load(&box->subscribers_count);
+    list_boxes_response_proto(&list->response, 0, box->name, box_size,
+                              n_publishers, n_subscribers);
+    list->pending = true;
+}
+
+int send_box_list(int fd, bool v2) {
+    box_list_t list = {
+        .fd = fd,
+        .opcode = PROTO_WITH_VERSION(LIST_BOXES_RESPONSE, v2),
+        .pending = false,
+        .ret = 0,
+    };
+    box_holder_for_each(&box_holder, list_box, &list);
+    if (!list.pending) {
+        list_boxes_response_proto(&list.response, 1, "", 0, 0, 0);
+    }
+    list.response.last = 1;
+    if (send_frame(fd, list.opcode, &list.response) == -1) {
+        list.ret = -1;
+    }
+    return list.ret;
+}
+
+void list_boxes(void *protocol, bool v2) {
     list_boxes_request_proto_t *request =
         (list_boxes_request_proto_t *)protocol;
-    (void)request;
-}
\ No newline at end of file
+    int pipe_fd = open_pipe(request->client_named_pipe_path, O_WRONLY);
+    if (send_box_list(pipe_fd, v2) == -1) {
+        WARN("Failed to send the box list: %s", strerror(errno));
+    }
+    close(pipe_fd);
+}
@@ -1,14 +1,45 @@
 #ifndef __REQUESTS_H__
 #define __REQUESTS_H__
 
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "box_metadata.h"
 #include "producer-consumer.h"
+#include "work-stealing.h"
+
+/**
+ * Solves a request taken by a worker of the pool and frees it
+ *
+ * @param request the queue_obj_t holding the request
+ */
+void handle_request(void *request);
+
+/**
+ * Frees a request and its protocol
+ *
+ * @param request the queue_obj_t holding the request
+ */
+void release_request(void *request);
+
+/**
+ * Returns the scheduler lane a request belongs to: sessions go to their own
+ * lane so they can't delay manager requests
+ *
+ * @param opcode the code of the request @link(protocols.h)
+ */
+ws_lane_e request_lane(uint8_t opcode);
 
 /**
- * Will listen to the queue and solve a request if it is made
+ * Answers a request right away without queueing it, because the broker is
+ * overloaded. Manager requests get a busy response and sessions are refused
+ * by opening and closing the client pipe. Never blocks: if the client has
+ * not opened its pipe yet, the request is just dropped.
  *
- * @param queue the current producer-consumer queue
+ * @param opcode the code of the request @link(protocols.h)
+ * @param protocol the string containing the other parameters in the request
  */
-void *listen_for_requests(void *queue);
+void reject_request(uint8_t opcode, const void *protocol);
 
 /**
  * Receives a request code and redirects to the method that will handle
@@ -23,35 +54,169 @@ void parse_request(queue_obj_t *obj);
  * Register a publisher
  *
  * @param protocol the string containing the other parameters in the request
+ * @param v2 whether the client negotiated the version 2 wire format
  */
-void register_publisher(void *protocol);
+void register_publisher(void *protocol, bool v2);
 
 /**
  * Register a subscriber
  *
  * @param protocol the string containing the other parameters in the request
+ * @param v2 whether the client negotiated the version 2 wire format
+ */
+void register_subscriber(void *protocol, bool v2);
+
+/**
+ * Register a subscriber that reads the box straight from shared memory
+ *
+ * @param protocol the string containing the other parameters in the request
+ * @param v2 whether the client negotiated the version 2 wire format
+ */
+void register_mapped_subscriber(void *protocol, bool v2);
+
+/**
+ * Register a subscriber that starts reading its box at some position, be it
+ * through its pipe or from shared memory
+ *
+ * @param protocol the string containing the other parameters in the request
+ * @param v2 whether the client negotiated the version 2 wire format
+ */
+void register_subscriber_from(void *protocol, bool v2);
+
+/**
+ * Finds where a subscriber starts reading a box, among the messages committed
+ * so far (see box_index.h), or where its named subscription stopped
+ *
+ * @param box the box
+ * @param from the REGISTER_SUBSCRIBER_FROM request, or NULL to start at the
+ * first message
+ * @param start where the first message to deliver starts is stored
+ * @param subscription where the named subscription is stored, or -1
+ * @param created where whether the named subscription was created is stored
+ * @return int 0 if was successful and -1 if the subscription was refused
+ */
+int subscriber_start(box_metadata_t *box,
+                     const register_sub_from_proto_t *from, size_t *start,
+                     ssize_t *subscription, bool *created);
+
+/**
+ * Undoes @link subscriber_start for a subscriber whose session could not be
+ * set up, so a subscription it created does not outlive it
+ *
+ * @param box the box
+ * @param subscription the named subscription, or -1
+ * @param created whether @link subscriber_start created it
+ */
+void subscriber_cancel(box_metadata_t *box, ssize_t subscription,
+                       bool created);
+
+/**
+ * Attaches a publisher to a box, next to the ones already attached
+ *
+ * @param box_name the box
+ * @return box_metadata_t* the box, with a reference held until
+ * @link publisher_detach, or NULL if it does not exist
+ */
+box_metadata_t *publisher_attach(const char *box_name);
+
+/**
+ * Detaches a publisher from its box
+ *
+ * @param box the box returned by @link publisher_attach
+ */
+void publisher_detach(box_metadata_t *box);
+
+/**
+ * Copies a message as it is stored in a box: up to its first \0, cut to
+ * MSG_SIZE - 1 bytes and followed by a \0
+ *
+ * @param dst where the message is stored, with room for len + 1 bytes
+ * @param msg the message, not necessarily ending in \0
+ * @param len its length
+ * @return size_t the bytes stored, \0 included
+ */
+size_t copy_message(char *dst, const char *msg, size_t len);
+
+/**
+ * Converts a PUBLISHER_MESSAGE or PUBLISHER_BATCH frame to messages as they
+ * are stored in a box (see @link copy_message). They never take more room
+ * than the frame, since every length prefix is longer than a \0.
+ *
+ * @param opcode the frame opcode
+ * @param payload the frame payload
+ * @param msgs where the messages are stored
+ * @param count where the number of messages is stored
+ * @return ssize_t the size of the messages, or -1 if the frame has none
+ */
+ssize_t frame_to_messages(uint8_t opcode, const void *payload,
+                          char msgs[BATCH_MAX_SIZE], size_t *count);
+
+/**
+ * Appends \0-separated messages to a box. Any number of publishers may
+ * append to the same box at once: each one copies its messages in parallel
+ * into the range it reserved, and the ranges are staged in the order they
+ * were reserved. Subscribers get them with the next group commit of the box
+ * (see group_commit.h). If the box fills up, the messages that still fit
+ * are appended and the rest are dropped, the way they would have been if
+ * they were sent one at a time.
+ *
+ * @param box the box returned by @link publisher_attach
+ * @param msgs the messages
+ * @param msgs_len their size
+ * @return int 0 if was successful and -1 if some did not fit
+ */
+int append_messages(box_metadata_t *box, const char *msgs, size_t msgs_len);
+
+/**
+ * Creates a box, in the TFS and in the box holder
+ *
+ * @param box_name the box
+ * @param error_msg where the error for the client is stored
+ * @return int 0 if was successful and -1 otherwise
+ */
+int create_box_named(const char *box_name, const char **error_msg);
+
+/**
+ * Removes a box from the TFS and from the box holder, closing its shared
+ * header first
+ *
+ * @param box_name the box
+ * @return int 0 if was successful and -1 otherwise
+ */
+int remove_box_named(const char *box_name);
+
+/**
+ * Sends a LIST_BOXES_RESPONSE frame for every box, the last one flagged.
+ * Without boxes, a single response with an empty name is sent.
+ *
+ * @param fd where to send the responses
+ * @param v2 whether the client negotiated the version 2 wire format
+ * @return int 0 if was successful and -1 otherwise
  */
-void register_subscriber(void *protocol);
+int send_box_list(int fd, bool v2);
 
 /**
  * Creates a message box in the TFS
  *
  * @param protocol the string containing the other parameters in the request
+ * @param v2 whether the client negotiated the version 2 wire format
  */
-void create_box(void *protocol);
+void create_box(void *protocol, bool v2);
 
 /**
  * Removes a message box in the TFS
  *
  * @param protocol the string containing the other parameters in the request
+ * @param v2 whether the client negotiated the version 2 wire format
  */
-void remove_box(void *protocol);
+void remove_box(void *protocol, bool v2);
 
 /**
  * List all message boxes in the TFS
  *
  * @param protocol the string containing the other parameters in the request
+ * @param v2 whether the client negotiated the version 2 wire format
  */
-void list_boxes(void *protocol);
+void list_boxes(void *protocol, bool v2);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "betterassert.h"
+#include "delivery.h"
+#include "event_loop.h"
+#include "histogram.h"
+#include "logging.h"
+#include "mbroker.h"
+#include "protocols.h"
+#include "requests.h"
+#include "session_engine.h"
+#include "shm_ring.h"
+
+// A session over a client pipe
+typedef struct pipe_session_t {
+    session_t session;
+    // Publishers: frames buffered from the pipe, and the ring being drained
+    frame_reader_t reader;
+    ring_proto_t ring;
+} pipe_session_t;
+
+static bool pipe_hung_up(int pipe_fd) {
+    struct pollfd pfd = {.fd = pipe_fd, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP) != 0;
+}
+
+static int pipe_next_frame(event_loop_t *loop, session_t *s, uint8_t *opcode,
+                           const void **payload) {
+    (void)loop;
+    pipe_session_t *ps = (pipe_session_t *)s;
+    ssize_t ret = frame_reader_next(&ps->reader, opcode, payload);
+    if (ret == 1) {
+        return 1;
+    }
+    if (ret == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    // A FIFO reads as closed until the publisher opens it, but only reports
+    // POLLHUP once a writer came and left
+    if (ret == 0 && !pipe_hung_up(s->fd)) {
+        return 0;
+    }
+    if (ret == -1 && errno == EPROTO) {
+        DEBUG("Received invalid opcode from publisher for box '%s'",
+              s->box->name);
+    }
+    // The publisher closed its pipe
+    return -1;
+}
+
+// Moves the messages of a publisher ring to the box until the publisher
+// closes the ring or its pipe, or the engine stops. Returns -1 if the box is
+// full or the ring is corrupt.
+static int consume_ring(session_t *s, shm_ring_t *ring, char *msgs) {
+    session_engine_t *engine = (session_engine_t *)s->loop->owner;
+    while (true) {
+        // Drains the ring in batches, one write each
+        size_t msgs_len = 0;
+        size_t count = 0;
+        size_t len;
+        const void *msg;
+        int front;
+        while ((front = shm_ring_front(ring, &msg, &len)) == 1) {
+            size_t copy = len < MSG_SIZE - 1 ? len : MSG_SIZE - 1;
+            if (msgs_len + copy + 1 > BATCH_MAX_SIZE) {
+                break;
+            }
+            msgs_len += copy_message(msgs + msgs_len, msg, len);
+            shm_ring_pop(ring, len);
+            count++;
+        }
+        if (count > 0) {
+            histogram_add(&s->batch_sizes, count);
+            if (append_messages(s->box, msgs, msgs_len) == -1) {
+                return -1;
+            }
+        }
+        if (front == -1) {
+            WARN("Publisher of '%s' corrupted its ring", s->box->name);
+            return -1;
+        }
+        if (count > 0) {
+            continue;
+        }
+
+        int ready = shm_ring_wait(ring, RING_POLL_MS);
+        if (ready == -1) {
+            return 0; // Closed and drained
+        }
+        if (ready == 0 && atomic_load(&engine->stop)) {
+            return 0;
+        }
+        if (ready == 0 && pipe_hung_up(s->fd)) {
+            WARN("Publisher of '%s' left without closing its ring",
+                 s->box->name);
+            return 0;
+        }
+    }
+}
+
+// Drains the ring of a publisher, then gives the publisher back to its loop
+static void *ring_thread(void *arg) {
+    pipe_session_t *ps = (pipe_session_t *)arg;
+    session_t *s = &ps->session;
+    session_engine_t *engine = (session_engine_t *)s->loop->owner;
+
+    shm_ring_t ring;
+    if (shm_ring_attach(&ring, ps->ring.shm_name) == 0) {
+        DEBUG("Publisher of '%s' moved to ring %s", s->box->name,
+              ps->ring.shm_name);
+        char *msgs = malloc(BATCH_MAX_SIZE);
+        s->failed = msgs == NULL || consume_ring(s, &ring, msgs) == -1;
+        free(msgs);
+        shm_ring_destroy(&ring);
+    } else {
+        // The publisher falls back to its pipe
+        WARN("Failed to map publisher ring %s", ps->ring.shm_name);
+    }
+    event_loop_hand_over(s);
+
+    pthread_mutex_lock(&engine->rings_lock);
+    engine->rings--;
+    pthread_cond_broadcast(&engine->rings_done);
+    pthread_mutex_unlock(&engine->rings_lock);
+    return NULL;
+}
+
+// Takes a publisher out of its loop while a thread drains its ring. Turns the
+// offer down if there are RING_MAX_THREADS already or the thread could not be
+// started, and the publisher keeps its pipe.
+static int pipe_ring(event_loop_t *loop, session_t *s,
+                     const ring_proto_t *offer) {
+    session_engine_t *engine = (session_engine_t *)loop->owner;
+    pipe_session_t *ps = (pipe_session_t *)s;
+    memcpy(&ps->ring, offer, sizeof(ring_proto_t));
+    ps->ring.shm_name[RING_NAME_SIZE - 1] = '\0';
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    // The thread hands the session back as soon as it is done
+    event_loop_remove(loop, s);
+    int ret = -1;
+    pthread_mutex_lock(&engine->rings_lock);
+    if (engine->rings < RING_MAX_THREADS) {
+        engine->rings++;
+        pthread_t thread;
+        ret = pthread_create(&thread, &attr, ring_thread, ps) == 0 ? 0 : -1;
+        if (ret == -1) {
+            engine->rings--;
+            WARN("Failed to start a thread for ring %s", ps->ring.shm_name);
+        }
+    } else {
+        DEBUG("Too many rings, publisher of '%s' keeps its pipe",
+              s->box->name);
+    }
+    pthread_mutex_unlock(&engine->rings_lock);
+    pthread_attr_destroy(&attr);
+    if (ret == 0) {
+        return 1;
+    }
+    shm_ring_refuse(ps->ring.shm_name);
+    return event_loop_add(loop, s);
+}
+
+static void pipe_end(session_t *s) {
+    if (s->role == SESSION_PUBLISHER) {
+        frame_reader_destroy(&((pipe_session_t *)s)->reader);
+    }
+}
+
+static const event_loop_ops_t pipe_ops = {
+    .transport = STREAM_PIPE,
+    .next_frame = pipe_next_frame,
+    .request = NULL,
+    .ring = pipe_ring,
+    .end = pipe_end,
+    .accept = NULL,
+};
+
+int session_engine_create(session_engine_t *engine, size_t threads) {
+    engine->n_loops = 0;
+    atomic_init(&engine->next_loop, 0);
+    pthread_mutex_init(&engine->rings_lock, NULL);
+    pthread_cond_init(&engine->rings_done, NULL);
+    engine->rings = 0;
+    atomic_init(&engine->stop, false);
+    engine->loops = calloc(threads, sizeof(event_loop_t));
+    if (engine->loops == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        if (event_loop_start(&engine->loops[i], &pipe_ops, engine, i, -1) ==
+            -1) {
+            return -1;
+        }
+        engine->n_loops++;
+    }
+    return 0;
+}
+
+void session_engine_destroy(session_engine_t *engine) {
+    // Ring threads notice within RING_POLL_MS and give their publishers back
+    atomic_store(&engine->stop, true);
+    pthread_mutex_lock(&engine->rings_lock);
+    while (engine->rings > 0) {
+        pthread_cond_wait(&engine->rings_done, &engine->rings_lock);
+    }
+    pthread_mutex_unlock(&engine->rings_lock);
+
+    for (size_t i = 0; i < engine->n_loops; i++) {
+        event_loop_stop(&engine->loops[i]);
+    }
+    for (size_t i = 0; i < engine->n_loops; i++) {
+        event_loop_join(&engine->loops[i]);
+    }
+    free(engine->loops);
+    pthread_mutex_destroy(&engine->rings_lock);
+    pthread_cond_destroy(&engine->rings_done);
+}
+
+static pipe_session_t *session_create(session_engine_t *engine, int pipe_fd,
+                                      box_metadata_t *box,
+                                      session_role_e role, uint32_t events) {
+    int flags = fcntl(pipe_fd, F_GETFL);
+    if (flags == -1 || fcntl(pipe_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return NULL;
+    }
+    pipe_session_t *ps = calloc(1, sizeof(pipe_session_t));
+    if (ps == NULL) {
+        return NULL;
+    }
+    size_t turn = atomic_fetch_add(&engine->next_loop, 1);
+    session_init(&ps->session, &engine->loops[turn % engine->n_loops],
+                 pipe_fd, role, events);
+    ps->session.box = box;
+    return ps;
+}
+
+int session_engine_add_publisher(session_engine_t *engine, int pipe_fd,
+                                 box_metadata_t *box) {
+    pipe_session_t *ps =
+        session_create(engine, pipe_fd, box, SESSION_PUBLISHER, EPOLLIN);
+    if (ps == NULL) {
+        return -1;
+    }
+    if (frame_reader_init(&ps->reader, pipe_fd) == -1) {
+        free(ps);
+        return -1;
+    }
+    event_loop_hand_over(&ps->session);
+    return 0;
+}
+
+int session_engine_add_subscriber(session_engine_t *engine, int pipe_fd,
+                                  box_metadata_t *box, int box_fd, bool v2,
+                                  bool mapped, size_t start,
+                                  ssize_t subscription) {
+    // The write end of a pipe only reports errors unless it is full
+    pipe_session_t *ps = session_create(
+        engine, pipe_fd, box, mapped ? SESSION_MAPPED : SESSION_SUBSCRIBER, 0);
+    if (ps == NULL) {
+        return -1;
+    }
+    session_t *s = &ps->session;
+    s->v2 = v2;
+    if (!mapped) {
+        s->delivery = delivery_start(box, pipe_fd, STREAM_PIPE, v2, start,
+                                     subscription);
+        if (s->delivery == NULL) {
+            free(ps);
+            return -1;
+        }
+        // Sent what it misses once the loop adopts it, and woken up by
+        // appends from then on
+    }
+    atomic_fetch_add(&box->subscribers_count, 1);
+    s->box_fd = box_fd;
+    event_loop_hand_over(s);
+    return 0;
+}
+
+void session_engine_notify(box_metadata_t *box) {
+    uint64_t loops = atomic_load(&box->streaming_loops[STREAM_PIPE]);
+    for (size_t i = 0; loops != 0 && i < session_engine.n_loops; i++) {
+        if ((loops & (UINT64_C(1) << i)) != 0) {
+            event_loop_notify(&session_engine.loops[i], box);
+        }
+    }
+}
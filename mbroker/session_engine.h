@@ -0,0 +1,99 @@
+#ifndef __SESSION_ENGINE_H__
+#define __SESSION_ENGINE_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "box_metadata.h"
+#include "event_loop.h"
+
+/**
+ * @brief Runs the sessions of the clients registered through the register
+ * pipe, so that none of them holds a worker thread
+ *
+ * @details A worker only opens the client pipe and attaches the session to
+ * its box, then hands the pipe over to one of a few event loops (see
+ * event_loop.h). The pipe is non-blocking and its readiness drives the
+ * session; publisher frames are read through a frame reader, since a pipe
+ * keeps no frame boundaries.
+ *
+ * A publisher that moves to a shared memory ring is drained by a thread of
+ * its own, since the ring rings a futex no epoll can wait for, and comes back
+ * to its loop once it closes the ring.
+ */
+typedef struct session_engine_t {
+    event_loop_t *loops;
+    size_t n_loops;
+    // Sessions are spread over the loops in turns
+    _Atomic size_t next_loop;
+
+    // Threads draining publisher rings, waited for when stopping
+    pthread_mutex_t rings_lock;
+    pthread_cond_t rings_done;
+    size_t rings;
+    _Atomic bool stop;
+} session_engine_t;
+
+/**
+ * @brief Starts the event loops
+ *
+ * @param engine the already allocated engine
+ * @param threads how many event loops serve the sessions
+ * @return int 0 if was successful and -1 otherwise
+ */
+int session_engine_create(session_engine_t *engine, size_t threads);
+
+/**
+ * @brief Stops the event loops and ends every session
+ *
+ * @param engine the engine
+ */
+void session_engine_destroy(session_engine_t *engine);
+
+/**
+ * @brief Runs the session of a publisher attached to a box (see
+ * @link publisher_attach) until the publisher closes its pipe
+ *
+ * @param engine the engine
+ * @param pipe_fd the read end of the publisher pipe, owned by the engine from
+ * now on
+ * @param box the box, detached from when the session ends
+ * @return int 0 if was successful and -1 otherwise, in which case the caller
+ * still owns everything
+ */
+int session_engine_add_publisher(session_engine_t *engine, int pipe_fd,
+                                 box_metadata_t *box);
+
+/**
+ * @brief Runs the session of a subscriber until it closes its pipe
+ *
+ * @param engine the engine
+ * @param pipe_fd the write end of the subscriber pipe, owned by the engine
+ * from now on
+ * @param box the box, whose reference is dropped when the session ends
+ * @param box_fd a TFS handle of the box, closed when the session ends
+ * @param v2 whether the subscriber negotiated the version 2 wire format
+ * @param mapped whether the subscriber reads the box from shared memory and
+ * already got its SUBSCRIBER_MAP frame
+ * @param start where the first message pushed through the pipe starts
+ * @param subscription the named subscription the session delivers, or -1
+ * @return int 0 if was successful and -1 otherwise, in which case the caller
+ * still owns everything
+ */
+int session_engine_add_subscriber(session_engine_t *engine, int pipe_fd,
+                                  box_metadata_t *box, int box_fd, bool v2,
+                                  bool mapped, size_t start,
+                                  ssize_t subscription);
+
+/**
+ * @brief Wakes up the loops serving subscribers of a box after messages were
+ * appended to it, and only those. Takes no lock, and does nothing if the box
+ * has no pipe subscribers.
+ *
+ * @param box the box
+ */
+void session_engine_notify(box_metadata_t *box);
+
+#endif // __SESSION_ENGINE_H__
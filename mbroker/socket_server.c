@@ -0,0 +1,267 @@
+#define _GNU_SOURCE // accept4
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "betterassert.h"
+#include "delivery.h"
+#include "event_loop.h"
+#include "logging.h"
+#include "mbroker.h"
+#include "operations.h"
+#include "protocols.h"
+#include "requests.h"
+#include "socket_server.h"
+
+// Events watched on every connection
+#define SOCKET_EVENTS (EPOLLIN | EPOLLRDHUP)
+
+struct socket_loop_t {
+    event_loop_t loop;
+    // Packets are received here, one at a time
+    char received[SOCKET_PACKET_SIZE];
+};
+
+static int socket_next_frame(event_loop_t *loop, session_t *s,
+                             uint8_t *opcode, const void **payload) {
+    char *received = ((socket_loop_t *)loop)->received;
+    while (true) {
+        ssize_t n = recv(s->fd, received, SOCKET_PACKET_SIZE,
+                         MSG_DONTWAIT | MSG_TRUNC);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        // Every packet holds exactly one frame
+        if (n > SOCKET_PACKET_SIZE || frame_size(received, (size_t)n) != n) {
+            WARN("dropping connection that sent an invalid packet");
+            return -1;
+        }
+        *opcode = (uint8_t)received[0];
+        *payload = received + sizeof(uint8_t);
+        return 1;
+    }
+}
+
+static int subscribe(event_loop_t *loop, session_t *s,
+                     const register_sub_proto_t *request, bool v2,
+                     const register_sub_from_proto_t *from) {
+    box_metadata_t *box = box_holder_find_box(&box_holder, request->box_name);
+    if (box == NULL) {
+        return -1;
+    }
+    // The connection keeps the reference until it is closed
+    s->box = box;
+    size_t start;
+    ssize_t subscription;
+    bool created;
+    if (subscriber_start(box, from, &start, &subscription, &created) == -1) {
+        return -1;
+    }
+    delivery_t *delivery =
+        delivery_start(box, s->fd, STREAM_SOCKET, v2, start, subscription);
+    if (delivery == NULL) {
+        subscriber_cancel(box, subscription, created);
+        return -1;
+    }
+    // From now on the delivery records how far the subscription got, even
+    // if the session ends right away
+    s->v2 = v2;
+    atomic_fetch_add(&box->subscribers_count, 1);
+    return event_loop_deliver(loop, s, delivery);
+}
+
+static int subscribe_mapped(session_t *s, const register_sub_proto_t *request,
+                            bool v2, const register_sub_from_proto_t *from) {
+    box_metadata_t *box = box_holder_find_box(&box_holder, request->box_name);
+    if (box == NULL) {
+        return -1;
+    }
+    // The connection keeps the reference until it is closed
+    s->box = box;
+    int fd = tfs_open(request->box_name, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    box_map_proto_t map;
+    int ret = box_map_offer(box, fd, &map);
+    tfs_close(fd);
+    size_t start;
+    ssize_t subscription;
+    bool created;
+    if (ret == 0) {
+        ret = subscriber_start(box, from, &start, &subscription, &created);
+        map.start = start;
+    }
+    if (ret == -1) {
+        return -1;
+    }
+    if (send_frame(s->fd, PROTO_WITH_VERSION(SUBSCRIBER_MAP, v2), &map) ==
+        -1) {
+        subscriber_cancel(box, subscription, created);
+        return -1;
+    }
+    s->role = SESSION_MAPPED;
+    s->v2 = v2;
+    atomic_fetch_add(&box->subscribers_count, 1);
+    return 0;
+}
+
+// Serves the first packet of a connection. Returns -1 once the connection
+// should be closed, be it because it was refused or answered.
+static int socket_request(event_loop_t *loop, session_t *s, uint8_t opcode,
+                          const void *payload) {
+    bool v2 = PROTO_IS_V2(opcode);
+    const request_proto_t *request = (const request_proto_t *)payload;
+    const char *error_msg;
+    int32_t return_code;
+    switch (PROTO_OPCODE(opcode)) {
+    case REGISTER_PUBLISHER:
+        s->box = publisher_attach(request->box_name);
+        if (s->box == NULL) {
+            return -1;
+        }
+        s->role = SESSION_PUBLISHER;
+        return 0;
+    case REGISTER_SUBSCRIBER:
+        return subscribe(loop, s, request, v2, NULL);
+    case REGISTER_SUBSCRIBER_MAPPED:
+        return subscribe_mapped(s, request, v2, NULL);
+    case REGISTER_SUBSCRIBER_FROM: {
+        // Starts with the same fields as every registration
+        const register_sub_from_proto_t *from =
+            (const register_sub_from_proto_t *)payload;
+        return from->mapped ? subscribe_mapped(s, request, v2, from)
+                            : subscribe(loop, s, request, v2, from);
+    }
+    case CREATE_BOX_REQUEST:
+        return_code = create_box_named(request->box_name, &error_msg);
+        send_response_frame(s->fd,
+                            PROTO_WITH_VERSION(CREATE_BOX_RESPONSE, v2),
+                            return_code, error_msg);
+        return -1;
+    case REMOVE_BOX_REQUEST:
+        return_code = remove_box_named(request->box_name);
+        send_response_frame(s->fd,
+                            PROTO_WITH_VERSION(REMOVE_BOX_RESPONSE, v2),
+                            return_code,
+                            return_code == 0 ? "" : ERR_BOX_NOT_FOUND);
+        return -1;
+    case LIST_BOXES_REQUEST:
+        // Every response is a packet of its own
+        if (send_box_list(s->fd, v2) == -1) {
+            WARN("Failed to send the box list: %s", strerror(errno));
+        }
+        return -1;
+    default:
+        WARN("unsupported request %u on the socket", opcode);
+        return -1;
+    }
+}
+
+static void socket_accept(event_loop_t *loop) {
+    socket_server_t *server = (socket_server_t *)loop->owner;
+    while (true) {
+        int fd = accept4(server->listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                WARN("failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+        session_t *s = calloc(1, sizeof(session_t));
+        if (s == NULL) {
+            close(fd);
+            continue;
+        }
+        session_init(s, loop, fd, SESSION_NEW, SOCKET_EVENTS);
+        if (event_loop_add(loop, s) == -1) {
+            event_loop_close(loop, s);
+        }
+    }
+}
+
+// Publishers on the socket get no ring: theirs times out and they fall back
+// to the socket
+static const event_loop_ops_t socket_ops = {
+    .transport = STREAM_SOCKET,
+    .next_frame = socket_next_frame,
+    .request = socket_request,
+    .ring = NULL,
+    .end = NULL,
+    .accept = socket_accept,
+};
+
+int socket_server_create(socket_server_t *server, const char *path,
+                         size_t threads) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    snprintf(server->path, sizeof(server->path), "%s", path);
+    server->n_loops = 0;
+    server->loops = calloc(threads, sizeof(socket_loop_t));
+    if (server->loops == NULL) {
+        return -1;
+    }
+
+    if (unlink(path) != 0 && errno != ENOENT) {
+        return -1;
+    }
+    server->listen_fd =
+        socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server->listen_fd == -1 ||
+        bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ==
+            -1 ||
+        listen(server->listen_fd, SOMAXCONN) == -1) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < threads; i++) {
+        if (event_loop_start(&server->loops[i].loop, &socket_ops, server, i,
+                             server->listen_fd) == -1) {
+            return -1;
+        }
+        server->n_loops++;
+    }
+    return 0;
+}
+
+void socket_server_destroy(socket_server_t *server) {
+    for (size_t i = 0; i < server->n_loops; i++) {
+        event_loop_stop(&server->loops[i].loop);
+    }
+    for (size_t i = 0; i < server->n_loops; i++) {
+        event_loop_join(&server->loops[i].loop);
+    }
+    free(server->loops);
+    close(server->listen_fd);
+    unlink(server->path);
+}
+
+void socket_server_notify(box_metadata_t *box) {
+    uint64_t loops = atomic_load(&box->streaming_loops[STREAM_SOCKET]);
+    for (size_t i = 0; loops != 0 && i < socket_server.n_loops; i++) {
+        if ((loops & (UINT64_C(1) << i)) != 0) {
+            event_loop_notify(&socket_server.loops[i].loop, box);
+        }
+    }
+}
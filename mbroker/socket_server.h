@@ -0,0 +1,58 @@
+#ifndef __SOCKET_SERVER_H__
+#define __SOCKET_SERVER_H__
+
+#include <stddef.h>
+#include <sys/un.h>
+
+#include "box_metadata.h"
+#include "event_loop.h"
+
+typedef struct socket_loop_t socket_loop_t;
+
+/**
+ * @brief Serves the clients connected to the mbroker socket (see "Sessions
+ * over a socket" in protocols.h)
+ *
+ * @details A few event loops (see event_loop.h) serve every connection. A
+ * connection stays in the loop that accepted it, and its first packet says
+ * what it is: manager requests are answered right away, and registrations
+ * turn the connection into a session. Every packet holds one frame, and
+ * subscribers get whole packets of frames. A client that dies is dropped as
+ * soon as epoll reports the hang up.
+ */
+typedef struct socket_server_t {
+    int listen_fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    socket_loop_t *loops;
+    size_t n_loops;
+} socket_server_t;
+
+/**
+ * @brief Starts listening on a socket
+ *
+ * @param server the already allocated server
+ * @param path where to create the socket
+ * @param threads how many event loops serve the connections
+ * @return int 0 if was successful and -1 otherwise
+ */
+int socket_server_create(socket_server_t *server, const char *path,
+                         size_t threads);
+
+/**
+ * @brief Stops the event loops, closes every connection and removes the
+ * socket
+ *
+ * @param server the server
+ */
+void socket_server_destroy(socket_server_t *server);
+
+/**
+ * @brief Wakes up the loops serving subscribers of a box after messages were
+ * appended to it, and only those. Takes no lock, and does nothing if the box
+ * has no socket subscribers.
+ *
+ * @param box the box
+ */
+void socket_server_notify(box_metadata_t *box);
+
+#endif // __SOCKET_SERVER_H__
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logging.h"
+#include "operations.h"
+#include "subscriptions.h"
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+bool subscriptions_reserved(const char *box_name) {
+    size_t len = strnlen(box_name, BOX_NAME_SIZE);
+    size_t suffix_len = strlen(SUBSCRIPTIONS_FILE_SUFFIX);
+    return len >= suffix_len &&
+           memcmp(box_name + len - suffix_len, SUBSCRIPTIONS_FILE_SUFFIX,
+                  suffix_len) == 0;
+}
+
+void subscriptions_init(subscriptions_t *subs, const char *box_name,
+                        size_t capacity) {
+    pthread_mutex_init(&subs->lock, NULL);
+    snprintf(subs->file_name, sizeof(subs->file_name), "%s%s", box_name,
+             SUBSCRIPTIONS_FILE_SUFFIX);
+    subs->entries = NULL;
+    subs->opens = NULL;
+    subs->len = 0;
+    subs->max_entries = capacity / sizeof(subscription_t);
+    subs->loaded = false;
+    subs->removed = false;
+    subs->dirty = false;
+    subs->committed_ms = 0;
+}
+
+void subscriptions_destroy(subscriptions_t *subs) {
+    pthread_mutex_destroy(&subs->lock);
+    free(subs->entries);
+    free(subs->opens);
+}
+
+// Reads the subscriptions file, if there is one. Called with the lock held.
+static int load(subscriptions_t *subs) {
+    subs->entries = calloc(subs->max_entries, sizeof(subscription_t));
+    subs->opens = calloc(subs->max_entries, sizeof(unsigned int));
+    if (subs->entries == NULL || subs->opens == NULL) {
+        free(subs->entries);
+        free(subs->opens);
+        subs->entries = NULL;
+        subs->opens = NULL;
+        return -1;
+    }
+    int fd = tfs_open(subs->file_name, 0);
+    if (fd != -1) {
+        ssize_t bytes = tfs_read(fd, subs->entries,
+                                subs->max_entries * sizeof(subscription_t));
+        tfs_close(fd);
+        subs->len = bytes > 0 ? (size_t)bytes / sizeof(subscription_t) : 0;
+        DEBUG("Read %zu subscriptions from '%s'", subs->len, subs->file_name);
+    }
+    subs->loaded = true;
+    return 0;
+}
+
+// Writes every offset to the subscriptions file at once. Called with the
+// lock held.
+static void commit(subscriptions_t *subs) {
+    subs->dirty = false;
+    subs->committed_ms = now_ms();
+    if (subs->removed) {
+        return;
+    }
+    int fd = tfs_open(subs->file_name, TFS_O_CREAT | TFS_O_TRUNC);
+    size_t size = subs->len * sizeof(subscription_t);
+    if (fd == -1 || tfs_write(fd, subs->entries, size) != (ssize_t)size) {
+        WARN("failed to write subscriptions to '%s'", subs->file_name);
+    }
+    if (fd != -1) {
+        tfs_close(fd);
+    }
+}
+
+ssize_t subscriptions_open(subscriptions_t *subs, const char *name,
+                           size_t *offset, bool *created) {
+    ssize_t subscription = -1;
+    *created = false;
+    pthread_mutex_lock(&subs->lock);
+    if (subs->loaded || load(subs) == 0) {
+        // Entries without a name were cancelled, and are taken again
+        ssize_t free_entry = -1;
+        for (size_t i = 0; i < subs->len; i++) {
+            if (strncmp(subs->entries[i].name, name,
+                        SUBSCRIPTION_NAME_SIZE) == 0) {
+                *offset = (size_t)subs->entries[i].offset;
+                subscription = (ssize_t)i;
+                break;
+            }
+            if (subs->entries[i].name[0] == '\0' && free_entry == -1) {
+                free_entry = (ssize_t)i;
+            }
+        }
+        if (subscription == -1 && free_entry == -1 &&
+            subs->len < subs->max_entries) {
+            free_entry = (ssize_t)subs->len++;
+        }
+        if (subscription == -1 && free_entry != -1) {
+            subscription_t *entry = &subs->entries[free_entry];
+            memset(entry, 0, sizeof(*entry));
+            strncpy(entry->name, name, SUBSCRIPTION_NAME_SIZE - 1);
+            entry->offset = *offset;
+            subs->opens[free_entry] = 0;
+            subscription = free_entry;
+            subs->dirty = true;
+            *created = true;
+        }
+        if (subscription != -1) {
+            subs->opens[subscription]++;
+        }
+    }
+    pthread_mutex_unlock(&subs->lock);
+    return subscription;
+}
+
+void subscriptions_cancel(subscriptions_t *subs, size_t subscription,
+                          bool created) {
+    pthread_mutex_lock(&subs->lock);
+    if (created && subs->opens[subscription] == 1) {
+        memset(&subs->entries[subscription], 0, sizeof(subscription_t));
+        subs->opens[subscription] = 0;
+        // Trailing free entries are not written
+        while (subs->len > 0 && subs->entries[subs->len - 1].name[0] == '\0') {
+            subs->len--;
+        }
+        subs->dirty = true;
+    }
+    pthread_mutex_unlock(&subs->lock);
+}
+
+void subscriptions_update(subscriptions_t *subs, size_t subscription,
+                          size_t offset, bool last) {
+    pthread_mutex_lock(&subs->lock);
+    subscription_t *entry = &subs->entries[subscription];
+    if (entry->offset != offset) {
+        entry->offset = offset;
+        subs->dirty = true;
+    }
+    if (subs->dirty &&
+        (last || now_ms() - subs->committed_ms >= SUBSCRIPTION_COMMIT_MS)) {
+        commit(subs);
+    }
+    pthread_mutex_unlock(&subs->lock);
+}
+
+void subscriptions_remove(subscriptions_t *subs) {
+    pthread_mutex_lock(&subs->lock);
+    subs->removed = true;
+    tfs_unlink(subs->file_name);
+    pthread_mutex_unlock(&subs->lock);
+}
@@ -0,0 +1,128 @@
+#ifndef __SUBSCRIPTIONS_H__
+#define __SUBSCRIPTIONS_H__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../protocol/protocols.h"
+
+// How often a running session writes how far it got to TFS
+#define SUBSCRIPTION_COMMIT_MS 1000
+
+// Appended to the name of a box to name the TFS file of its subscriptions.
+// Box names can't end with it (see @link subscriptions_reserved).
+#define SUBSCRIPTIONS_FILE_SUFFIX ".subs"
+
+/**
+ * @brief How far a named subscription got: a record of the subscriptions
+ * file
+ */
+typedef struct __attribute__((__packed__)) subscription_t {
+    char name[SUBSCRIPTION_NAME_SIZE];
+    // Bytes of the box delivered, always a message boundary
+    uint64_t offset;
+} subscription_t;
+
+/**
+ * @brief The named subscriptions of a box
+ *
+ * @details A subscriber that registers under a subscription name resumes
+ * where the last session under that name stopped (see
+ * REGISTER_SUBSCRIBER_FROM). Sessions update their offset in memory as they
+ * deliver messages, and the offsets are written to a TFS file next to the
+ * box in batches: at most once every SUBSCRIPTION_COMMIT_MS while sessions
+ * run, and when one ends. The file is only read, lazily, by the first
+ * session of the box. A box with named subscriptions takes two TFS inodes.
+ */
+typedef struct subscriptions_t {
+    pthread_mutex_t lock;
+    char file_name[MAX_FILE_NAME];
+    subscription_t *entries;
+    // Sessions opened under each subscription, in memory only
+    unsigned int *opens;
+    size_t len;
+    size_t max_entries;
+    bool loaded;
+    // Set once the box is removed, so the file is not written again
+    bool removed;
+    // Offsets changed since the last commit, and when that was
+    bool dirty;
+    uint64_t committed_ms;
+} subscriptions_t;
+
+/**
+ * @brief Returns whether a box name would collide with the subscriptions
+ * file of another box, which shares the TFS namespace of boxes
+ *
+ * @param box_name the box name, at most BOX_NAME_SIZE bytes
+ * @return bool whether the name is reserved
+ */
+bool subscriptions_reserved(const char *box_name);
+
+/**
+ * @brief Creates the subscriptions of a box, with nothing read yet
+ *
+ * @param subs the already allocated subscriptions
+ * @param box_name the box
+ * @param capacity the size of a TFS file, which bounds how many
+ * subscriptions fit in it
+ */
+void subscriptions_init(subscriptions_t *subs, const char *box_name,
+                        size_t capacity);
+
+/**
+ * @brief Frees the subscriptions, without writing them
+ *
+ * @param subs the subscriptions
+ */
+void subscriptions_destroy(subscriptions_t *subs);
+
+/**
+ * @brief Starts a session of a named subscription, creating it if needed
+ *
+ * @param subs the subscriptions
+ * @param name the subscription
+ * @param offset where a new subscription starts, replaced by where the
+ * subscription stopped if it exists
+ * @param created where whether the subscription was created is stored
+ * @return ssize_t the subscription, to update, or -1 if there is no room
+ * for it
+ */
+ssize_t subscriptions_open(subscriptions_t *subs, const char *name,
+                           size_t *offset, bool *created);
+
+/**
+ * @brief Undoes @link subscriptions_open for a session that never ran. A
+ * subscription it created goes away, unless another session opened it
+ * since.
+ *
+ * @param subs the subscriptions
+ * @param subscription returned by @link subscriptions_open
+ * @param created whether @link subscriptions_open created it
+ */
+void subscriptions_cancel(subscriptions_t *subs, size_t subscription,
+                          bool created);
+
+/**
+ * @brief Records how far a session of a subscription got, writing every
+ * offset to TFS if the last commit is old enough or if the session ends
+ *
+ * @param subs the subscriptions
+ * @param subscription returned by @link subscriptions_open
+ * @param offset bytes of the box delivered
+ * @param last whether the session ended
+ */
+void subscriptions_update(subscriptions_t *subs, size_t subscription,
+                          size_t offset, bool last);
+
+/**
+ * @brief Removes the subscriptions file, when the box is removed
+ *
+ * @param subs the subscriptions
+ */
+void subscriptions_remove(subscriptions_t *subs);
+
+#endif // __SUBSCRIPTIONS_H__
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "logging.h"
+#include "worker_pool.h"
+
+// Must be called with the pool lock held
+static void update_active_workers(worker_pool_t *pool) {
+    size_t highest = 0;
+    for (size_t i = 0; i < pool->max_threads; i++) {
+        if (pool->slot_used[i]) {
+            highest = i + 1;
+        }
+    }
+    ws_set_active_workers(pool->scheduler, highest);
+}
+
+// Decides, with the pool lock held, whether an idle thread may exit
+static bool try_retire(worker_pool_t *pool, ws_worker_t *worker) {
+    bool retire = false;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_threads > pool->min_threads) {
+        // Stop counting ourselves as idle before looking at the pending
+        // requests: whoever submits one concurrently will either see us gone
+        // (and spawn) or we will see it (and stay)
+        atomic_fetch_sub(&pool->idle, 1);
+        if (atomic_load(&pool->pending) > atomic_load(&pool->idle)) {
+            atomic_fetch_add(&pool->idle, 1);
+        } else {
+            retire = true;
+            pool->slot_used[worker->id] = false;
+            pool->n_threads--;
+            update_active_workers(pool);
+            if (pool->n_threads == 0) {
+                pthread_cond_signal(&pool->all_exited);
+            }
+            LOG("worker %zu retired, pool size: %zu threads", worker->id,
+                pool->n_threads);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return retire;
+}
+
+typedef struct pool_thread_args_t {
+    worker_pool_t *pool;
+    ws_worker_t *worker;
+} pool_thread_args_t;
+
+static void *pool_worker_main(void *arg) {
+    pool_thread_args_t args = *(pool_thread_args_t *)arg;
+    free(arg);
+    worker_pool_t *pool = args.pool;
+    ws_worker_t *worker = args.worker;
+    ws_scheduler_t *scheduler = pool->scheduler;
+
+    atomic_fetch_add(&pool->idle, 1);
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += pool->idle_timeout_ms / 1000;
+        deadline.tv_nsec += (pool->idle_timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        void *request = ws_take_timed(worker, &deadline);
+        if (request == NULL) {
+            if (atomic_load(&scheduler->shutdown)) {
+                break;
+            }
+            if (errno == ETIMEDOUT && try_retire(pool, worker)) {
+                return NULL;
+            }
+            continue;
+        }
+
+        atomic_fetch_sub(&pool->idle, 1);
+        atomic_fetch_sub(&pool->pending, 1);
+        pool->handler(request);
+        atomic_fetch_add(&pool->idle, 1);
+    }
+
+    atomic_fetch_sub(&pool->idle, 1);
+    pthread_mutex_lock(&pool->lock);
+    pool->slot_used[worker->id] = false;
+    pool->n_threads--;
+    if (pool->n_threads == 0) {
+        pthread_cond_signal(&pool->all_exited);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Must be called with the pool lock held
+static int spawn_thread(worker_pool_t *pool) {
+    size_t id = 0;
+    while (id < pool->max_threads && pool->slot_used[id]) {
+        id++;
+    }
+    if (id == pool->max_threads) {
+        return -1;
+    }
+
+    pool_thread_args_t *args = malloc(sizeof(pool_thread_args_t));
+    if (args == NULL) {
+        return -1;
+    }
+    ws_worker_t *worker = &pool->workers[id];
+    worker->scheduler = pool->scheduler;
+    worker->id = id;
+    worker->control_streak = 0;
+    args->pool = pool;
+    args->worker = worker;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_worker_main, args) != 0) {
+        free(args);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    pool->slot_used[id] = true;
+    pool->n_threads++;
+    update_active_workers(pool);
+    return 0;
+}
+
+int worker_pool_create(worker_pool_t *pool, ws_scheduler_t *scheduler,
+                       void (*handler)(void *request), size_t min_threads,
+                       size_t max_threads, long idle_timeout_ms) {
+    if (max_threads == 0 || max_threads > scheduler->n_workers) {
+        WARN("pool needs between 1 and %zu threads", scheduler->n_workers);
+        return -1;
+    }
+    if (min_threads > max_threads) {
+        min_threads = max_threads;
+    }
+
+    pool->scheduler = scheduler;
+    pool->handler = handler;
+    pool->min_threads = min_threads;
+    pool->max_threads = max_threads;
+    pool->idle_timeout_ms = idle_timeout_ms;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->idle, 0);
+    pool->n_threads = 0;
+
+    pool->slot_used = calloc(max_threads, sizeof(bool));
+    pool->workers = calloc(max_threads, sizeof(ws_worker_t));
+    if (pool->slot_used == NULL || pool->workers == NULL) {
+        WARN("no memory to allocate the worker pool");
+        return -1;
+    }
+
+    if (pthread_mutex_init(&pool->lock, NULL) != 0 ||
+        pthread_cond_init(&pool->all_exited, NULL) != 0) {
+        WARN("error while initializing mutexes and condvar\n");
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < min_threads; i++) {
+        if (spawn_thread(pool) != 0) {
+            pthread_mutex_unlock(&pool->lock);
+            WARN("failed to spawn worker thread");
+            return -1;
+        }
+    }
+    update_active_workers(pool);
+    LOG("pool size: %zu threads (min %zu, max %zu)", pool->n_threads,
+        min_threads, max_threads);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int worker_pool_submit(worker_pool_t *pool, void *request, ws_lane_e lane,
+                       uint64_t affinity) {
+    // Counts the request before deciding, so a thread about to retire either
+    // sees it or is already gone from the idle count
+    size_t pending = atomic_fetch_add(&pool->pending, 1) + 1;
+    if (pending > atomic_load(&pool->idle)) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->n_threads < pool->max_threads && spawn_thread(pool) == 0) {
+            LOG("pool grew, pool size: %zu threads", pool->n_threads);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (ws_submit(pool->scheduler, request, lane, affinity) != 0) {
+        atomic_fetch_sub(&pool->pending, 1);
+        return -1;
+    }
+    return 0;
+}
+
+size_t worker_pool_size(worker_pool_t *pool) {
+    pthread_mutex_lock(&pool->lock);
+    size_t size = pool->n_threads;
+    pthread_mutex_unlock(&pool->lock);
+    return size;
+}
+
+void worker_pool_destroy(worker_pool_t *pool) {
+    ws_shutdown(pool->scheduler);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->n_threads > 0) {
+        pthread_cond_wait(&pool->all_exited, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->all_exited);
+    free(pool->slot_used);
+    free(pool->workers);
+}
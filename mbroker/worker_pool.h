@@ -0,0 +1,82 @@
+#ifndef __WORKER_POOL_H__
+#define __WORKER_POOL_H__
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "work-stealing.h"
+
+/**
+ * @brief Elastic pool of worker threads serving a scheduler.
+ *
+ * @details The pool starts with `min_threads` threads and spawns a new one
+ * whenever a request is submitted and there are more pending requests than
+ * idle workers (workers blocked in sessions are never idle), up to
+ * `max_threads`. Threads above the minimum exit after staying idle for
+ * `idle_timeout_ms`. Worker `i` always runs on deque `i` of the scheduler.
+ */
+typedef struct worker_pool_t {
+    ws_scheduler_t *scheduler;
+    void (*handler)(void *request);
+
+    size_t min_threads;
+    size_t max_threads;
+    long idle_timeout_ms;
+
+    // Requests submitted but not taken yet
+    atomic_size_t pending;
+    // Threads waiting for a request
+    atomic_size_t idle;
+
+    // Protects everything below
+    pthread_mutex_t lock;
+    pthread_cond_t all_exited;
+    size_t n_threads;
+    bool *slot_used;
+    ws_worker_t *workers;
+} worker_pool_t;
+
+/**
+ * @brief Creates a pool and spawns its first `min_threads` threads
+ *
+ * @param pool the already allocated pool
+ * @param scheduler the scheduler, with at least `max_threads` workers
+ * @param handler called by a worker for every request it takes
+ * @param min_threads threads that are kept alive even when idle
+ * @param max_threads maximum number of threads
+ * @param idle_timeout_ms how long a thread above the minimum may stay idle
+ * @return int 0 if was successful and -1 otherwise
+ */
+int worker_pool_create(worker_pool_t *pool, ws_scheduler_t *scheduler,
+                       void (*handler)(void *request), size_t min_threads,
+                       size_t max_threads, long idle_timeout_ms);
+
+/**
+ * @brief Queues a request, growing the pool if no idle worker can take it
+ *
+ * @param pool the pool
+ * @param request the request
+ * @param lane the lane of the request
+ * @param affinity hash of the box the request touches, or WS_ANY_WORKER
+ * @return int 0 if was successful and -1 otherwise
+ */
+int worker_pool_submit(worker_pool_t *pool, void *request, ws_lane_e lane,
+                       uint64_t affinity);
+
+/**
+ * @brief Returns the current number of threads
+ *
+ * @param pool the pool
+ */
+size_t worker_pool_size(worker_pool_t *pool);
+
+/**
+ * @brief Shuts the scheduler down and waits for every thread to exit
+ *
+ * @param pool the pool
+ */
+void worker_pool_destroy(worker_pool_t *pool);
+
+#endif // __WORKER_POOL_H__
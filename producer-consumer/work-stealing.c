@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <limits.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "work-stealing.h"
+
+#define WS_EMPTY ((void *)0)
+#define WS_ABORT ((void *)1)
+
+static size_t next_power_of_two(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+static int ws_deque_create(ws_deque_t *deque, size_t capacity) {
+    capacity = next_power_of_two(capacity);
+    deque->buffer = calloc(capacity, sizeof(_Atomic(void *)));
+    if (deque->buffer == NULL) {
+        return -1;
+    }
+    deque->mask = capacity - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
+
+// Owner only. Returns -1 if the deque is full.
+static int ws_deque_push(ws_deque_t *deque, void *elem) {
+    size_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    size_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t > deque->mask) {
+        return -1;
+    }
+    atomic_store_explicit(&deque->buffer[b & deque->mask], elem,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+// Any thread. Returns WS_EMPTY if there was nothing to steal and WS_ABORT if
+// another thief won the race for the top element.
+static void *ws_deque_steal(ws_deque_t *deque) {
+    size_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b) {
+        return WS_EMPTY;
+    }
+    void *elem = atomic_load_explicit(&deque->buffer[t & deque->mask],
+                                      memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        return WS_ABORT;
+    }
+    return elem;
+}
+
+static int ws_lane_create(ws_lane_t *lane, size_t n_workers, size_t depth) {
+    lane->deques = aligned_alloc(WS_CACHE_LINE, n_workers * sizeof(ws_deque_t));
+    if (lane->deques == NULL) {
+        WARN("no memory to allocate lane deques");
+        return -1;
+    }
+    memset(lane->deques, 0, n_workers * sizeof(ws_deque_t));
+
+    // Every deque gets some headroom so that requests for the same box
+    // usually fit in their preferred deque, while the lane is still bounded
+    // by `depth` through the slots semaphore.
+    size_t deque_capacity = depth / n_workers + 1;
+    for (size_t i = 0; i < n_workers; i++) {
+        if (ws_deque_create(&lane->deques[i], deque_capacity) != 0) {
+            WARN("no memory to allocate deque %zu", i);
+            return -1;
+        }
+    }
+
+    if (depth > SEM_VALUE_MAX ||
+        sem_init(&lane->slots, 0, (unsigned int)depth) != 0) {
+        WARN("error while initializing lane semaphore\n");
+        return -1;
+    }
+    lane->next_worker = 0;
+    atomic_init(&lane->depth, 0);
+    lane->high_watermark = depth;
+    lane->low_watermark = depth;
+    lane->overloaded = false;
+    return 0;
+}
+
+int ws_create(ws_scheduler_t *scheduler, size_t n_workers,
+              const size_t lane_depth[WS_LANES], unsigned int control_weight) {
+    if (n_workers == 0) {
+        WARN("scheduler needs at least one worker");
+        return -1;
+    }
+
+    for (size_t l = 0; l < WS_LANES; l++) {
+        if (lane_depth[l] == 0 ||
+            ws_lane_create(&scheduler->lanes[l], n_workers, lane_depth[l]) !=
+                0) {
+            WARN("failed to create lane %zu", l);
+            return -1;
+        }
+    }
+    scheduler->n_workers = n_workers;
+    atomic_init(&scheduler->active_workers, n_workers);
+    scheduler->control_weight = control_weight;
+
+    if (sem_init(&scheduler->items, 0, 0) != 0) {
+        WARN("error while initializing semaphores\n");
+        return -1;
+    }
+
+    atomic_init(&scheduler->shutdown, false);
+    return 0;
+}
+
+int ws_destroy(ws_scheduler_t *scheduler, void (*release)(void *elem)) {
+    // There is no need to synchronize anything because at this point all
+    // threads were closed
+    int ret = 0;
+    for (size_t l = 0; l < WS_LANES; l++) {
+        ws_lane_t *lane = &scheduler->lanes[l];
+        for (size_t i = 0; i < scheduler->n_workers; i++) {
+            ws_deque_t *deque = &lane->deques[i];
+            void *elem;
+            while ((elem = ws_deque_steal(deque)) != WS_EMPTY) {
+                release(elem);
+            }
+            free(deque->buffer);
+        }
+        free(lane->deques);
+        if (sem_destroy(&lane->slots) != 0) {
+            ret = -1;
+        }
+    }
+
+    if (sem_destroy(&scheduler->items) != 0 || ret != 0) {
+        WARN("error while destroying semaphores\n");
+        return -1;
+    }
+    return 0;
+}
+
+int ws_submit(ws_scheduler_t *scheduler, void *elem, ws_lane_e lane_id,
+              uint64_t affinity) {
+    ws_lane_t *lane = &scheduler->lanes[lane_id];
+
+    // Waits until there is free space in some deque of the lane
+    while (sem_wait(&lane->slots) != 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+
+    size_t n = scheduler->n_workers;
+    size_t active = atomic_load(&scheduler->active_workers);
+    size_t first;
+    if (affinity == WS_ANY_WORKER) {
+        first = lane->next_worker % active;
+        lane->next_worker = (first + 1) % active;
+    } else {
+        first = (size_t)(affinity % active);
+    }
+
+    // Counted before the push so a fast thief can't take it below zero
+    atomic_fetch_add(&lane->depth, 1);
+
+    // Holding a slot guarantees that at least one deque has space
+    for (size_t i = 0;; i = (i + 1) % n) {
+        size_t idx = (first + i) % n;
+        if (ws_deque_push(&lane->deques[idx], elem) == 0) {
+            DEBUG("submitted request to lane %u of worker %zu", lane_id, idx);
+            break;
+        }
+    }
+
+    // Wakes up one idle worker
+    sem_post(&scheduler->items);
+    return 0;
+}
+
+// Sweeps every deque of a lane, starting with the worker's own. Returns NULL
+// if the lane is empty.
+static void *ws_take_from_lane(ws_worker_t *worker, ws_lane_t *lane) {
+    size_t n = worker->scheduler->n_workers;
+    for (size_t i = 0; i < n; i++) {
+        size_t idx = (worker->id + i) % n;
+        void *elem;
+        // Lost a race, try the same deque again
+        while ((elem = ws_deque_steal(&lane->deques[idx])) == WS_ABORT) {
+        }
+        if (elem != WS_EMPTY) {
+            if (idx != worker->id) {
+                DEBUG("worker %zu stole a request from worker %zu",
+                      worker->id, idx);
+            }
+            atomic_fetch_sub(&lane->depth, 1);
+            sem_post(&lane->slots);
+            return elem;
+        }
+    }
+    return NULL;
+}
+
+void *ws_take(ws_worker_t *worker) { return ws_take_timed(worker, NULL); }
+
+void *ws_take_timed(ws_worker_t *worker, const struct timespec *deadline) {
+    ws_scheduler_t *scheduler = worker->scheduler;
+
+    // Waits until at least one request is queued for us
+    while ((deadline == NULL ? sem_wait(&scheduler->items)
+                             : sem_timedwait(&scheduler->items, deadline)) !=
+           0) {
+        if (errno != EINTR) {
+            return NULL;
+        }
+    }
+    if (atomic_load(&scheduler->shutdown)) {
+        return NULL;
+    }
+
+    ws_lane_e first = WS_LANE_CONTROL;
+    if (scheduler->control_weight != WS_STRICT_PRIORITY &&
+        worker->control_streak >= scheduler->control_weight) {
+        // Served enough control requests in a row, give sessions a turn
+        first = WS_LANE_SESSION;
+    }
+
+    // Passing the semaphore reserves one queued request, so sweeping the
+    // lanes always ends up finding one
+    while (true) {
+        for (size_t l = 0; l < WS_LANES; l++) {
+            ws_lane_e lane = (ws_lane_e)((first + l) % WS_LANES);
+            void *elem = ws_take_from_lane(worker, &scheduler->lanes[lane]);
+            if (elem != NULL) {
+                if (lane == WS_LANE_CONTROL) {
+                    worker->control_streak++;
+                } else {
+                    worker->control_streak = 0;
+                }
+                return elem;
+            }
+        }
+    }
+}
+
+void ws_set_active_workers(ws_scheduler_t *scheduler, size_t n) {
+    if (n == 0) {
+        n = 1;
+    } else if (n > scheduler->n_workers) {
+        n = scheduler->n_workers;
+    }
+    atomic_store(&scheduler->active_workers, n);
+}
+
+void ws_set_watermarks(ws_scheduler_t *scheduler, ws_lane_e lane, size_t high,
+                       size_t low) {
+    ws_lane_t *l = &scheduler->lanes[lane];
+    l->high_watermark = high;
+    l->low_watermark = low < high ? low : high;
+}
+
+bool ws_overloaded(ws_scheduler_t *scheduler, ws_lane_e lane) {
+    ws_lane_t *l = &scheduler->lanes[lane];
+    size_t depth = atomic_load(&l->depth);
+    if (!l->overloaded && depth >= l->high_watermark) {
+        WARN("lane %u reached its high watermark (%zu queued)", lane, depth);
+        l->overloaded = true;
+    } else if (l->overloaded && depth <= l->low_watermark) {
+        LOG("lane %u is back under its low watermark (%zu queued)", lane,
+            depth);
+        l->overloaded = false;
+    }
+    return l->overloaded;
+}
+
+void ws_shutdown(ws_scheduler_t *scheduler) {
+    atomic_store(&scheduler->shutdown, true);
+    for (size_t i = 0; i < scheduler->n_workers; i++) {
+        sem_post(&scheduler->items);
+    }
+}
+
+uint64_t ws_hash_string(const char *str, size_t max_len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char *end = str + max_len; str < end && *str != '\0'; str++) {
+        hash ^= (uint8_t)*str;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
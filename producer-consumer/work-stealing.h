@@ -0,0 +1,205 @@
+#ifndef __WORK_STEALING_H__
+#define __WORK_STEALING_H__
+
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Affinity hint for requests that are not bound to any box: they are
+ * distributed round-robin between the workers.
+ */
+#define WS_ANY_WORKER UINT64_MAX
+
+#define WS_CACHE_LINE 64
+
+/**
+ * @brief Chase-Lev deque with a fixed (power of two) capacity.
+ *
+ * @details The register pipe reader is the owner of every deque: it is the
+ * only thread that pushes at the bottom. Workers only take from the top
+ * (`ws_deque_steal`), so requests are served in FIFO order and a worker that
+ * is stuck inside a session never strands the requests assigned to it.
+ */
+typedef struct ws_deque_t {
+    _Alignas(WS_CACHE_LINE) _Atomic size_t top;
+    _Alignas(WS_CACHE_LINE) _Atomic size_t bottom;
+    _Atomic(void *) *buffer;
+    size_t mask;
+} ws_deque_t;
+
+/**
+ * @brief Priority lanes. Short control-plane requests (create, remove, list)
+ * are kept apart from session registrations so that a burst of sessions
+ * can't delay them.
+ */
+typedef enum ws_lane_e {
+    WS_LANE_CONTROL = 0,
+    WS_LANE_SESSION,
+    WS_LANES
+} ws_lane_e;
+
+/**
+ * @brief Lane priority policy. With WS_STRICT_PRIORITY the control lane is
+ * always served first; any other value is the maximum number of control
+ * requests a worker serves in a row while session requests are waiting.
+ */
+#define WS_STRICT_PRIORITY 0
+
+/**
+ * @brief One lane: a deque per worker and the lane depth limit
+ */
+typedef struct ws_lane_t {
+    ws_deque_t *deques;
+    // Counts free slots; the reader sleeps here when the lane is full
+    sem_t slots;
+    // Round-robin cursor, only touched by the reader
+    size_t next_worker;
+
+    // Queued requests, compared against the watermarks
+    atomic_size_t depth;
+    size_t high_watermark;
+    size_t low_watermark;
+    // Set when depth reaches the high watermark and cleared when it drops to
+    // the low one. Only touched by the reader.
+    bool overloaded;
+} ws_lane_t;
+
+/**
+ * @brief Work-stealing scheduler: one deque per worker and lane, plus a
+ * semaphore to park idle workers.
+ */
+typedef struct ws_scheduler_t {
+    ws_lane_t lanes[WS_LANES];
+    size_t n_workers;
+    // Requests are only routed to the first `active_workers` deques
+    atomic_size_t active_workers;
+    unsigned int control_weight;
+
+    // Counts queued requests; workers sleep here when there is nothing to do
+    sem_t items;
+
+    atomic_bool shutdown;
+} ws_scheduler_t;
+
+/**
+ * @brief Identifies a worker thread inside a scheduler
+ */
+typedef struct ws_worker_t {
+    ws_scheduler_t *scheduler;
+    size_t id;
+    // Control requests served in a row, for the weighted policy
+    unsigned int control_streak;
+} ws_worker_t;
+
+/**
+ * @brief Creates a scheduler
+ *
+ * @param scheduler the already allocated scheduler
+ * @param n_workers number of worker threads (deques per lane)
+ * @param lane_depth maximum number of queued requests in each lane
+ * @param control_weight WS_STRICT_PRIORITY or the weighted policy ratio
+ * @return int 0 if was successful and -1 otherwise
+ */
+int ws_create(ws_scheduler_t *scheduler, size_t n_workers,
+              const size_t lane_depth[WS_LANES], unsigned int control_weight);
+
+/**
+ * @brief Releases the internal resources of the scheduler, handing the
+ * requests that were never taken to `release`
+ *
+ * @param scheduler the scheduler
+ * @param release called for every request left in the deques
+ * @return int 0 if was successful and -1 otherwise
+ */
+int ws_destroy(ws_scheduler_t *scheduler, void (*release)(void *elem));
+
+/**
+ * @brief Queues a request. Must only be called by the owner (reader) thread.
+ *
+ * @details Requests with the same affinity land in the same deque, so the
+ * same worker tends to serve requests that touch the same box. If that deque
+ * is full, the next one with space is used. Sleeps while the lane is full.
+ *
+ * @param scheduler the scheduler
+ * @param elem the request
+ * @param lane the lane of the request
+ * @param affinity hash of the box the request touches, or WS_ANY_WORKER
+ * @return int 0 if was successful and -1 otherwise
+ */
+int ws_submit(ws_scheduler_t *scheduler, void *elem, ws_lane_e lane,
+              uint64_t affinity);
+
+/**
+ * @brief Takes a request, picking the lane according to the priority policy.
+ * Within a lane it prefers the worker's own deque and steals from the others
+ * when it is empty. Sleeps while there are no requests.
+ *
+ * @param worker the calling worker
+ * @return void* the request, or NULL if the scheduler was shut down
+ */
+void *ws_take(ws_worker_t *worker);
+
+/**
+ * @brief Same as `ws_take`, but gives up at the given deadline
+ *
+ * @param worker the calling worker
+ * @param deadline absolute CLOCK_REALTIME deadline, or NULL to wait forever
+ * @return void* the request, or NULL if the scheduler was shut down or the
+ * deadline passed (errno is set to ETIMEDOUT)
+ */
+void *ws_take_timed(ws_worker_t *worker, const struct timespec *deadline);
+
+/**
+ * @brief Sets how many deques (starting at 0) have a live worker, so that
+ * new requests are only routed to those. Workers still steal from every
+ * deque, so nothing is stranded if a worker goes away.
+ *
+ * @param scheduler the scheduler
+ * @param n number of live workers, between 1 and n_workers
+ */
+void ws_set_active_workers(ws_scheduler_t *scheduler, size_t n);
+
+/**
+ * @brief Sets the overload watermarks of a lane. By default both are the lane
+ * depth, so a lane only reports overload when it is full.
+ *
+ * @param scheduler the scheduler
+ * @param lane the lane
+ * @param high depth at which the lane becomes overloaded
+ * @param low depth at which an overloaded lane recovers (<= high)
+ */
+void ws_set_watermarks(ws_scheduler_t *scheduler, ws_lane_e lane, size_t high,
+                       size_t low);
+
+/**
+ * @brief Checks whether a lane is overloaded, with hysteresis between the
+ * high and low watermarks. Must only be called by the owner (reader) thread.
+ *
+ * @param scheduler the scheduler
+ * @param lane the lane
+ * @return true if new requests for the lane should be rejected
+ */
+bool ws_overloaded(ws_scheduler_t *scheduler, ws_lane_e lane);
+
+/**
+ * @brief Wakes up every idle worker and makes `ws_take` return NULL
+ *
+ * @param scheduler the scheduler
+ */
+void ws_shutdown(ws_scheduler_t *scheduler);
+
+/**
+ * @brief FNV-1a hash of a string, used to build affinities from box names
+ *
+ * @param str the string
+ * @param max_len the size of the field holding the string, which may fill it
+ * without a terminator
+ * @return uint64_t the hash
+ */
+uint64_t ws_hash_string(const char *str, size_t max_len);
+
+#endif // __WORK_STEALING_H__
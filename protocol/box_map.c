@@ -0,0 +1,106 @@
+#define _GNU_SOURCE // syscall
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "box_map.h"
+#include "futex.h"
+
+int box_export_create(box_export_t *export, const char *name,
+                      size_t committed) {
+    snprintf(export->name, BOX_MAP_NAME_SIZE, "%s", name);
+    int fd = shm_open(export->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    void *mem = MAP_FAILED;
+    if (ftruncate(fd, sizeof(box_map_header_t)) == 0) {
+        mem = mmap(NULL, sizeof(box_map_header_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mem == MAP_FAILED) {
+        shm_unlink(export->name);
+        return -1;
+    }
+    export->header = (box_map_header_t *)mem;
+    atomic_store(&export->header->committed, committed);
+    return 0;
+}
+
+void box_export_commit(box_export_t *export, size_t committed) {
+    atomic_store(&export->header->committed, committed);
+    // Subscribers can't tell us they sleep (the header is read-only to them),
+    // so every commit rings. Commits are whole batches, not messages.
+    atomic_fetch_add(&export->header->seq, 1);
+    futex_wake(&export->header->seq);
+}
+
+void box_export_destroy(box_export_t *export) {
+    atomic_store(&export->header->closed, 1);
+    atomic_fetch_add(&export->header->seq, 1);
+    futex_wake(&export->header->seq);
+    munmap(export->header, sizeof(box_map_header_t));
+    shm_unlink(export->name);
+    export->header = NULL;
+}
+
+static void *map_read_only(const char *name, size_t offset, size_t size) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return MAP_FAILED;
+    }
+    void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, (off_t)offset);
+    close(fd);
+    return mem;
+}
+
+int box_map_attach(box_map_t *map, const char *header_name,
+                   const char *data_name, size_t offset, size_t capacity) {
+    void *header = map_read_only(header_name, 0, sizeof(box_map_header_t));
+    if (header == MAP_FAILED) {
+        return -1;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t map_offset = offset - offset % page;
+    map->data_map_size = offset - map_offset + capacity;
+    map->data_map = map_read_only(data_name, map_offset, map->data_map_size);
+    if (map->data_map == MAP_FAILED) {
+        munmap(header, sizeof(box_map_header_t));
+        return -1;
+    }
+
+    map->header = (const box_map_header_t *)header;
+    map->data = (const char *)map->data_map + (offset - map_offset);
+    map->capacity = capacity;
+    return 0;
+}
+
+size_t box_map_committed(box_map_t *map) {
+    size_t committed = (size_t)atomic_load(&map->header->committed);
+    return committed < map->capacity ? committed : map->capacity;
+}
+
+int box_map_wait(box_map_t *map, size_t seen, long timeout_ms) {
+    // Casting const away is fine: FUTEX_WAIT only reads the word
+    _Atomic uint32_t *seq = (_Atomic uint32_t *)&map->header->seq;
+    uint32_t expected = atomic_load(seq);
+    if (box_map_committed(map) == seen && !atomic_load(&map->header->closed)) {
+        futex_wait(seq, expected, timeout_ms);
+    }
+
+    // Once closed, the data may already belong to another box
+    if (atomic_load(&map->header->closed)) {
+        return -1;
+    }
+    return box_map_committed(map) > seen ? 1 : 0;
+}
+
+void box_map_detach(box_map_t *map) {
+    munmap((void *)map->header, sizeof(box_map_header_t));
+    munmap(map->data_map, map->data_map_size);
+    map->header = NULL;
+}
@@ -0,0 +1,117 @@
+#ifndef __BOX_MAP_H__
+#define __BOX_MAP_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BOX_MAP_NAME_SIZE 64
+
+/**
+ * @brief Shared header of a box exported to mapped subscribers. Only the
+ * mbroker writes it: subscribers map it read-only.
+ */
+typedef struct box_map_header_t {
+    // Bytes of the box that are written and may be read
+    _Atomic uint64_t committed;
+    // Futex word, changed on every commit and when the box goes away
+    _Atomic uint32_t seq;
+    // Set when the box is removed or the mbroker stops: its data may be
+    // reused
+    _Atomic uint32_t closed;
+} box_map_header_t;
+
+/**
+ * @brief A box exported to mapped subscribers (mbroker side)
+ */
+typedef struct box_export_t {
+    box_map_header_t *header;
+    char name[BOX_MAP_NAME_SIZE];
+} box_export_t;
+
+/**
+ * @brief A read-only view of a box (subscriber side)
+ *
+ * @details The messages of the box are `data[0..committed)`, separated by
+ * \0. They are never changed once committed, so a subscriber reads them in
+ * place, without any copies through the mbroker.
+ */
+typedef struct box_map_t {
+    const box_map_header_t *header;
+    const char *data;
+    size_t capacity;
+    // What was mapped, since mappings start at page boundaries
+    void *data_map;
+    size_t data_map_size;
+} box_map_t;
+
+/**
+ * @brief Creates the shared header of a box (mbroker side)
+ *
+ * @param export the export
+ * @param name the shared memory object name (starting with /)
+ * @param committed the bytes already in the box
+ * @return int 0 if was successful and -1 otherwise
+ */
+int box_export_create(box_export_t *export, const char *name,
+                      size_t committed);
+
+/**
+ * @brief Publishes that the box now holds `committed` bytes and wakes up its
+ * mapped subscribers (mbroker side). Must be called after the bytes are
+ * written.
+ *
+ * @param export the export
+ * @param committed the bytes in the box
+ */
+void box_export_commit(box_export_t *export, size_t committed);
+
+/**
+ * @brief Tells the mapped subscribers the box is gone and removes its shared
+ * header (mbroker side)
+ *
+ * @param export the export
+ */
+void box_export_destroy(box_export_t *export);
+
+/**
+ * @brief Maps a box read-only (subscriber side)
+ *
+ * @param map the map
+ * @param header_name the shared memory object of the box header
+ * @param data_name the shared memory object of the TFS data blocks
+ * @param offset where the box is in the data blocks
+ * @param capacity the maximum size of the box
+ * @return int 0 if was successful and -1 otherwise
+ */
+int box_map_attach(box_map_t *map, const char *header_name,
+                   const char *data_name, size_t offset, size_t capacity);
+
+/**
+ * @brief Waits until the box holds more than `seen` bytes (subscriber side)
+ *
+ * @param map the map
+ * @param seen the bytes already read
+ * @param timeout_ms how long to wait
+ * @return int 1 if there are new bytes, 0 on timeout and -1 if the box is
+ * closed (even if there were new bytes: they may not be the box's anymore)
+ */
+int box_map_wait(box_map_t *map, size_t seen, long timeout_ms);
+
+/**
+ * @brief Returns the bytes that can be read (subscriber side)
+ *
+ * @param map the map
+ * @return size_t the committed length of the box
+ */
+size_t box_map_committed(box_map_t *map);
+
+/**
+ * @brief Unmaps a box (subscriber side)
+ *
+ * @param map the map
+ */
+void box_map_detach(box_map_t *map);
+
+#endif // __BOX_MAP_H__
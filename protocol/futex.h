@@ -0,0 +1,40 @@
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Sleeps while a futex word in shared memory holds `expected`
+ *
+ * @details Not FUTEX_PRIVATE: the words live in memory shared between
+ * processes. Returns on a wake up, a timeout, a signal or right away if the
+ * word already changed, so callers must check their condition again.
+ *
+ * @param word the futex word
+ * @param expected the value it held when the caller decided to sleep
+ * @param timeout_ms how long to sleep at most, or -1 to sleep until woken up
+ */
+static inline void futex_wait(_Atomic uint32_t *word, uint32_t expected,
+                              long timeout_ms) {
+    struct timespec timeout = {.tv_sec = timeout_ms / 1000,
+                               .tv_nsec = (timeout_ms % 1000) * 1000000};
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, expected,
+            timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+}
+
+/**
+ * @brief Wakes up everyone sleeping on a futex word in shared memory
+ *
+ * @param word the futex word
+ */
+static inline void futex_wake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT32_MAX, NULL, NULL,
+            0);
+}
+
+#endif // __FUTEX_H__
@@ -1,13 +1,21 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include "betterassert.h"
 #include "logging.h"
+#include "object_pool.h"
 #include "protocols.h"
 
 // Reads an opcode from an open named pipe.
@@ -22,27 +30,177 @@ uint8_t recv_opcode(const int fd) {
     return opcode;
 }
 
+int writev_all(const int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        // Skips what was written and resumes in the middle of an iovec
+        size_t left = (size_t)written;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+int send_frame(const int fd, const uint8_t opcode, const void *proto) {
+    size_t size = proto_size(PROTO_OPCODE(opcode));
+    struct iovec iov[2] = {
+        {.iov_base = (void *)&opcode, .iov_len = sizeof(uint8_t)},
+        {.iov_base = (void *)proto, .iov_len = size},
+    };
+    return writev_all(fd, iov, 2);
+}
+
 void send_proto_string(const int fd, const uint8_t opcode, const void *proto) {
     ALWAYS_ASSERT(fd != -1, "Invalid file descriptor");
-    size_t size = proto_size(opcode) + sizeof(uint8_t);
-    unsigned char *final = malloc(size);
-    DEBUG("Alloc size %lu", size);
-    uint8_t saved_opcode;
+    ALWAYS_ASSERT(send_frame(fd, opcode, proto) == 0, "Failed to write proto");
+}
+
+int send_message_frame(const int fd, const uint8_t opcode, const char *msg,
+                       size_t len) {
+    if (len > MSG_SIZE - 1) {
+        len = MSG_SIZE - 1;
+    }
+    if (!PROTO_IS_V2(opcode)) {
+        basic_msg_proto_t proto;
+        memcpy(proto.msg, msg, len);
+        memset(proto.msg + len, 0, MSG_SIZE - len);
+        return send_frame(fd, opcode, &proto);
+    }
+
+    msg_v2_header_t header = {.len = (uint32_t)len};
+    struct iovec iov[3] = {
+        {.iov_base = (void *)&opcode, .iov_len = sizeof(uint8_t)},
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        {.iov_base = (void *)msg, .iov_len = len},
+    };
+    return writev_all(fd, iov, 3);
+}
+
+int send_response_frame(const int fd, const uint8_t opcode,
+                        int32_t return_code, const char *error_msg) {
+    if (!PROTO_IS_V2(opcode)) {
+        response_proto_t proto;
+        response_proto(&proto, return_code, error_msg);
+        return send_frame(fd, opcode, &proto);
+    }
+
+    size_t len = strnlen(error_msg, MSG_SIZE - 1);
+    response_v2_header_t header = {.return_code = return_code,
+                                   .len = (uint32_t)len};
+    struct iovec iov[3] = {
+        {.iov_base = (void *)&opcode, .iov_len = sizeof(uint8_t)},
+        {.iov_base = &header, .iov_len = sizeof(header)},
+        {.iov_base = (void *)error_msg, .iov_len = len},
+    };
+    return writev_all(fd, iov, 3);
+}
 
-    memcpy(final, &opcode, sizeof(uint8_t));
-    memcpy(&saved_opcode, final, sizeof(uint8_t));
-    ALWAYS_ASSERT(saved_opcode == opcode, "Failed to save opcode");
+// send_batch_frame writes the header and the data in one go
+_Static_assert(offsetof(batch_t, data) == sizeof(batch_header_t),
+               "batch data must follow its header");
 
-    memcpy(final + sizeof(uint8_t), proto, size - sizeof(uint8_t));
-    memcpy(&saved_opcode, final, sizeof(uint8_t));
-    ALWAYS_ASSERT(saved_opcode == opcode, "Failed to save opcode");
+void batch_reset(batch_t *batch) {
+    batch->header.count = 0;
+    batch->header.len = 0;
+}
+
+int batch_add(batch_t *batch, const char *msg, size_t len) {
+    if (len > MSG_SIZE - 1) {
+        len = MSG_SIZE - 1;
+    }
+    uint32_t msg_len = (uint32_t)len;
+    if (batch->header.len + sizeof(msg_len) + len > BATCH_MAX_SIZE) {
+        return -1;
+    }
+    unsigned char *dest = batch->data + batch->header.len;
+    memcpy(dest, &msg_len, sizeof(msg_len));
+    memcpy(dest + sizeof(msg_len), msg, len);
+    batch->header.len += (uint32_t)(sizeof(msg_len) + len);
+    batch->header.count++;
+    return 0;
+}
 
-    ALWAYS_ASSERT(write(fd, final, size) == size, "Failed to write proto");
-    free(final);
+int send_batch_frame(const int fd, batch_t *batch) {
+    uint8_t opcode = PUBLISHER_BATCH | PROTO_V2_FLAG;
+    struct iovec iov[2] = {
+        {.iov_base = &opcode, .iov_len = sizeof(uint8_t)},
+        // The data follows the header in the batch
+        {.iov_base = &batch->header,
+         .iov_len = sizeof(batch_header_t) + batch->header.len},
+    };
+    int ret = writev_all(fd, iov, 2);
+    batch_reset(batch);
+    return ret;
+}
+
+uint32_t batch_iter_init(batch_iter_t *iter, const void *payload) {
+    batch_header_t header;
+    memcpy(&header, payload, sizeof(header));
+    iter->next = (const unsigned char *)payload + sizeof(header);
+    iter->end = iter->next + header.len;
+    iter->left = header.count;
+    return header.count;
+}
+
+const char *batch_iter_next(batch_iter_t *iter, size_t *len) {
+    uint32_t msg_len;
+    if (iter->left == 0 || iter->end - iter->next < (ssize_t)sizeof(msg_len)) {
+        return NULL;
+    }
+    memcpy(&msg_len, iter->next, sizeof(msg_len));
+    const char *msg = (const char *)iter->next + sizeof(msg_len);
+    if (msg_len > (size_t)(iter->end - iter->next) - sizeof(msg_len)) {
+        return NULL;
+    }
+    iter->next += sizeof(msg_len) + msg_len;
+    iter->left--;
+    *len = msg_len;
+    return msg;
+}
+
+const char *frame_message(const uint8_t opcode, const void *payload,
+                          size_t *len) {
+    if (!PROTO_IS_V2(opcode)) {
+        const basic_msg_proto_t *proto = (const basic_msg_proto_t *)payload;
+        *len = strnlen(proto->msg, MSG_SIZE);
+        return proto->msg;
+    }
+    msg_v2_header_t header;
+    memcpy(&header, payload, sizeof(header));
+    *len = header.len;
+    return (const char *)payload + sizeof(header);
+}
+
+int32_t frame_response(const uint8_t opcode, const void *payload,
+                       const char **error_msg, size_t *len) {
+    if (!PROTO_IS_V2(opcode)) {
+        const response_proto_t *proto = (const response_proto_t *)payload;
+        *error_msg = proto->error_msg;
+        *len = strnlen(proto->error_msg, MSG_SIZE);
+        return proto->return_code;
+    }
+    response_v2_header_t header;
+    memcpy(&header, payload, sizeof(header));
+    *error_msg = (const char *)payload + sizeof(header);
+    *len = header.len;
+    return header.return_code;
 }
 
 void create_pipe(const char npipe_path[NPIPE_PATH_SIZE]) {
-    ALWAYS_ASSERT(unlink(npipe_path) == 0,
+    ALWAYS_ASSERT(unlink(npipe_path) == 0 || errno == ENOENT,
                   "Failed to cleanup/unlink client named pipe.");
     ALWAYS_ASSERT(mkfifo(npipe_path, MKFIFO_PERMS) == 0,
                   "Failed to create client named pipe.");
@@ -54,54 +212,215 @@ int open_pipe(const char npipe_path[NPIPE_PATH_SIZE], int _flag) {
     return fd;
 }
 
+int open_response_pipe(const char npipe_path[NPIPE_PATH_SIZE]) {
+    int fd = open(npipe_path, O_RDONLY | O_NONBLOCK);
+    ALWAYS_ASSERT(fd != -1, "Failed to open named pipe");
+    return fd;
+}
+
+void await_response(const int fd) {
+    // Until the mbroker opens the write end, read() would report EOF, but
+    // poll() only returns once there is something to read
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (poll(&pfd, 1, -1) == -1) {
+        ALWAYS_ASSERT(errno == EINTR, "Failed to wait for response");
+    }
+    int flags = fcntl(fd, F_GETFL);
+    ALWAYS_ASSERT(flags != -1 && fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) != -1,
+                  "Failed to set pipe to blocking mode");
+}
+
+int connect_mbroker_socket(const char *register_path) {
+    struct stat st;
+    if (stat(register_path, &st) == -1 || !S_ISSOCK(st.st_mode)) {
+        return -1;
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    ALWAYS_ASSERT(strlen(register_path) < sizeof(addr.sun_path),
+                  "Socket path is too long");
+    strcpy(addr.sun_path, register_path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    ALWAYS_ASSERT(fd != -1 && connect(fd, (struct sockaddr *)&addr,
+                                      sizeof(addr)) == 0,
+                  "Failed to connect to the mbroker socket");
+    return fd;
+}
+
 void *parse_protocol(const int rx, const uint8_t opcode) {
     DEBUG("parsing protocol %u", opcode);
     size_t proto_sz = proto_size(opcode);
-    void *protocol = malloc(proto_sz);
+    void *protocol = obj_pool_alloc(proto_sz);
+    ALWAYS_ASSERT(protocol != NULL, "Failed to alloc protocol");
     ssize_t sz = read(rx, protocol, proto_sz);
     ALWAYS_ASSERT(proto_sz == sz, "Failed to read protocol");
     return protocol;
 }
 
-void *request_proto(const char *client_named_pipe_path, const char *box_name) {
-    request_proto_t *p = malloc(sizeof(request_proto_t));
-    strcpy(p->box_name, box_name);
-    strcpy(p->client_named_pipe_path, client_named_pipe_path);
-    return p;
+int frame_reader_init(frame_reader_t *reader, const int fd) {
+    reader->buffer = malloc(FRAME_READER_BUF_SIZE);
+    if (reader->buffer == NULL) {
+        return -1;
+    }
+    reader->fd = fd;
+    reader->start = 0;
+    reader->end = 0;
+    reader->reads = 0;
+    reader->frames = 0;
+    return 0;
+}
+
+ssize_t frame_size(const void *buffer, size_t buffered) {
+    const unsigned char *frame = buffer;
+    uint8_t code = PROTO_OPCODE(frame[0]);
+    if (code < REGISTER_PUBLISHER || code > REGISTER_SUBSCRIBER_FROM) {
+        return -1;
+    }
+
+    size_t header_size;
+    size_t max_len = MSG_SIZE;
+    if (code == PUBLISHER_BATCH) {
+        header_size = sizeof(batch_header_t);
+        max_len = BATCH_MAX_SIZE;
+    } else if (!PROTO_IS_V2(frame[0])) {
+        return (ssize_t)(sizeof(uint8_t) + proto_size(code));
+    } else {
+        switch (code) {
+        case PUBLISHER_MESSAGE:
+        case SUBSCRIBER_MESSAGE:
+            header_size = sizeof(msg_v2_header_t);
+            break;
+        case CREATE_BOX_RESPONSE:
+        case REMOVE_BOX_RESPONSE:
+        case BROKER_BUSY_RESPONSE:
+            header_size = sizeof(response_v2_header_t);
+            break;
+        default:
+            return (ssize_t)(sizeof(uint8_t) + proto_size(code));
+        }
+    }
+    if (buffered < sizeof(uint8_t) + header_size) {
+        return 0;
+    }
+    // The length is always the last field of the header
+    uint32_t len;
+    memcpy(&len, frame + sizeof(uint8_t) + header_size - sizeof(uint32_t),
+           sizeof(uint32_t));
+    if (len > max_len) {
+        return -1;
+    }
+    return (ssize_t)(sizeof(uint8_t) + header_size + len);
+}
+
+ssize_t frame_reader_next(frame_reader_t *reader, uint8_t *opcode,
+                          const void **payload) {
+    while (true) {
+        size_t buffered = reader->end - reader->start;
+        if (buffered > 0) {
+            unsigned char *frame = reader->buffer + reader->start;
+            ssize_t size = frame_size(frame, buffered);
+            if (size == -1) {
+                // There is no way to find the next frame boundary
+                *opcode = frame[0];
+                reader->start = reader->end;
+                errno = EPROTO;
+                return -1;
+            }
+            if (size > 0 && buffered >= (size_t)size) {
+                *opcode = frame[0];
+                *payload = frame + sizeof(uint8_t);
+                reader->start += (size_t)size;
+                reader->frames++;
+                return 1;
+            }
+        }
+
+        // Moves the partial frame to the front to make room for the rest
+        if (reader->start > 0) {
+            memmove(reader->buffer, reader->buffer + reader->start, buffered);
+            reader->start = 0;
+            reader->end = buffered;
+        }
+
+        ssize_t ret = read(reader->fd, reader->buffer + reader->end,
+                           FRAME_READER_BUF_SIZE - reader->end);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        reader->reads++;
+        if (ret == 0) {
+            // Pipe writes of a frame are atomic, so only a writer that died
+            // mid-write leaves half a frame behind
+            if (buffered > 0) {
+                WARN("dropping %zu bytes of a truncated frame", buffered);
+                reader->end = 0;
+            }
+            return 0;
+        }
+        reader->end += (size_t)ret;
+    }
+}
+
+void frame_reader_destroy(frame_reader_t *reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
 }
 
-void *response_proto(int32_t return_code, const char *error_message) {
-    response_proto_t *p = malloc(sizeof(response_proto_t));
+// Copies a string into a fixed size field, zeroing the rest of it
+static void copy_string(char *dest, const char *src, size_t size) {
+    size_t len = strnlen(src, size - 1);
+    memcpy(dest, src, len);
+    memset(dest + len, 0, size - len);
+}
+
+void request_proto(request_proto_t *p, const char *client_named_pipe_path,
+                   const char *box_name) {
+    copy_string(p->client_named_pipe_path, client_named_pipe_path,
+                NPIPE_PATH_SIZE);
+    copy_string(p->box_name, box_name, BOX_NAME_SIZE);
+}
+
+void register_sub_from_proto(register_sub_from_proto_t *p,
+                             const char *client_named_pipe_path,
+                             const char *box_name, bool mapped, seek_e seek,
+                             uint64_t position, const char *subscription) {
+    copy_string(p->client_named_pipe_path, client_named_pipe_path,
+                NPIPE_PATH_SIZE);
+    copy_string(p->box_name, box_name, BOX_NAME_SIZE);
+    p->mapped = mapped;
+    p->seek = (uint8_t)seek;
+    p->position = position;
+    copy_string(p->subscription, subscription, SUBSCRIPTION_NAME_SIZE);
+}
+
+void response_proto(response_proto_t *p, int32_t return_code,
+                    const char *error_message) {
     p->return_code = return_code;
-    strcpy(p->error_msg, error_message);
-    return p;
+    copy_string(p->error_msg, error_message, MSG_SIZE);
 }
 
-void *list_boxes_request_proto(const char *client_named_pipe_path) {
-    list_boxes_request_proto_t *p =
-        calloc(1, sizeof(list_boxes_request_proto_t));
-    strcpy(p->client_named_pipe_path, client_named_pipe_path);
-    return p;
+void list_boxes_request_proto(list_boxes_request_proto_t *p,
+                              const char *client_named_pipe_path) {
+    copy_string(p->client_named_pipe_path, client_named_pipe_path,
+                NPIPE_PATH_SIZE);
 }
 
-void *list_boxes_response_proto(const uint8_t last, const char *box_name,
-                                const uint64_t box_size,
-                                const uint64_t n_publishers,
-                                const uint64_t n_subscribers) {
-    list_boxes_response_proto_t *p =
-        malloc(sizeof(list_boxes_response_proto_t));
+void list_boxes_response_proto(list_boxes_response_proto_t *p,
+                               const uint8_t last, const char *box_name,
+                               const uint64_t box_size,
+                               const uint64_t n_publishers,
+                               const uint64_t n_subscribers) {
     p->last = last;
     p->box_size = box_size;
     p->n_publishers = n_publishers;
     p->n_subscribers = n_subscribers;
-    strcpy(p->box_name, box_name);
-    return p;
+    copy_string(p->box_name, box_name, BOX_NAME_SIZE);
 }
 
-void *message_proto(const char *message) {
-    basic_msg_proto_t *p = malloc(sizeof(basic_msg_proto_t));
-    strcpy(p->msg, message);
-    return p;
+void message_proto(basic_msg_proto_t *p, const char *message) {
+    copy_string(p->msg, message, MSG_SIZE);
 }
 
 size_t proto_size(uint8_t code) {
@@ -109,6 +428,7 @@ size_t proto_size(uint8_t code) {
     switch (code) {
     case REGISTER_PUBLISHER:
     case REGISTER_SUBSCRIBER:
+    case REGISTER_SUBSCRIBER_MAPPED:
     case CREATE_BOX_REQUEST:
     case REMOVE_BOX_REQUEST:
         sz = sizeof(request_proto_t);
@@ -118,14 +438,43 @@ size_t proto_size(uint8_t code) {
         break;
     case REMOVE_BOX_RESPONSE:
     case CREATE_BOX_RESPONSE:
+    case BROKER_BUSY_RESPONSE:
         sz = sizeof(response_proto_t);
         break;
     case LIST_BOXES_RESPONSE:
         sz = sizeof(list_boxes_response_proto_t);
         break;
+    case PUBLISHER_MESSAGE:
+    case SUBSCRIBER_MESSAGE:
+        sz = sizeof(basic_msg_proto_t);
+        break;
+    case PUBLISHER_RING:
+        sz = sizeof(ring_proto_t);
+        break;
+    case SUBSCRIBER_MAP:
+        sz = sizeof(box_map_proto_t);
+        break;
+    case REGISTER_SUBSCRIBER_FROM:
+        sz = sizeof(register_sub_from_proto_t);
+        break;
     default:
         PANIC("invalid proto code\n");
         break;
     }
     return sz;
+}
+
+bool proto_is_request(uint8_t code) {
+    switch (code) {
+    case REGISTER_PUBLISHER:
+    case REGISTER_SUBSCRIBER:
+    case REGISTER_SUBSCRIBER_MAPPED:
+    case REGISTER_SUBSCRIBER_FROM:
+    case CREATE_BOX_REQUEST:
+    case REMOVE_BOX_REQUEST:
+    case LIST_BOXES_REQUEST:
+        return true;
+    default:
+        return false;
+    }
 }
\ No newline at end of file
@@ -1,5 +1,11 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "box_map.h"
+#include "shm_ring.h"
 
 #ifndef __PROTOCOLS__
 #define __PROTOCOLS__
@@ -10,6 +16,7 @@
 
 #define NPIPE_PATH_SIZE 256
 #define BOX_NAME_SIZE 32
+#define SUBSCRIPTION_NAME_SIZE 32
 
 // Exported from fs/config.h, since we don't (and shouldn't) have access to this
 // header. Should be kept in sync with its equivalent there.
@@ -29,15 +36,45 @@ typedef enum codes_e {
     LIST_BOXES_REQUEST,
     LIST_BOXES_RESPONSE,
     PUBLISHER_MESSAGE,
-    SUBSCRIBER_MESSAGE
+    SUBSCRIBER_MESSAGE,
+    BROKER_BUSY_RESPONSE,
+    PUBLISHER_BATCH,
+    PUBLISHER_RING,
+    REGISTER_SUBSCRIBER_MAPPED,
+    SUBSCRIBER_MAP,
+    REGISTER_SUBSCRIBER_FROM
 } CODES;
 
+/**
+ * Wire format versions
+ *
+ * In version 1 every frame carries the whole fixed-size struct of its
+ * protocol, so a 10 byte message still costs MSG_SIZE bytes. A client that
+ * sets PROTO_V2_FLAG in the opcode of its request (a registration or a
+ * manager request) negotiates version 2 for everything sent back and forth
+ * on its pipe. In version 2, messages and response errors only carry their
+ * used bytes, after a length prefix:
+ *
+ * [ uint8_t opcode | uint32_t len | msg ]
+ * [ uint8_t opcode | int32_t return_code | uint32_t len | error_msg ]
+ *
+ * Version 2 frames keep the flag in their opcode, and every other protocol
+ * is the same in both versions.
+ */
+#define PROTO_V2_FLAG 0x80
+#define PROTO_OPCODE(opcode) ((uint8_t)((opcode) & ~PROTO_V2_FLAG))
+#define PROTO_IS_V2(opcode) (((opcode)&PROTO_V2_FLAG) != 0)
+#define PROTO_WITH_VERSION(opcode, v2)                                         \
+    ((uint8_t)((v2) ? ((opcode) | PROTO_V2_FLAG) : (opcode)))
+
 /**
  * Error Messages
  */
 #define ERR_BOX_NOT_FOUND "Box not found."
 #define ERR_BOX_ALREADY_EXISTS "Box already exists."
 #define ERR_BOX_CREATION "An error ocurred while creating the box."
+#define ERR_BOX_NAME_RESERVED "Box names ending in .subs are reserved."
+#define ERR_BROKER_BUSY "The broker is overloaded, try again later."
 
 /**
  * Protocol
@@ -55,6 +92,7 @@ typedef struct __attribute__((__packed__)) request_proto_t {
 // All these protocol messages are the same
 #define register_pub_proto_t request_proto_t
 #define register_sub_proto_t request_proto_t
+#define register_mapped_sub_proto_t request_proto_t
 #define create_box_proto_t request_proto_t
 #define remove_box_proto_t request_proto_t
 
@@ -65,6 +103,7 @@ typedef struct __attribute__((__packed__)) response_proto_t {
 
 #define create_box_response_proto_t response_proto_t
 #define remove_box_response_proto_t response_proto_t
+#define busy_response_proto_t response_proto_t
 
 /**
  * Protocol packed struct (without paddings) to send a list boxes request
@@ -94,6 +133,114 @@ typedef struct __attribute__((__packed__)) basic_msg_proto_t {
 #define publisher_msg_proto_t basic_msg_proto_t
 #define subscriber_msg_proto_t basic_msg_proto_t
 
+/**
+ * Header of a version 2 message, followed by `len` bytes (no \0)
+ */
+typedef struct __attribute__((__packed__)) msg_v2_header_t {
+    uint32_t len;
+} msg_v2_header_t;
+
+/**
+ * Header of a version 2 response, followed by `len` bytes of error message
+ */
+typedef struct __attribute__((__packed__)) response_v2_header_t {
+    int32_t return_code;
+    uint32_t len;
+} response_v2_header_t;
+
+/**
+ * Sent by a co-located publisher as the first frame of its session, to move
+ * its messages to a shared memory ring (see shm_ring.h). The pipe stays open
+ * as the control channel: closing it ends the session. If the mbroker cannot
+ * map the ring, the publisher falls back to sending frames on the pipe.
+ */
+typedef struct __attribute__((__packed__)) ring_proto_t {
+    char shm_name[RING_NAME_SIZE];
+} ring_proto_t;
+
+/**
+ * Sent by the mbroker as the first frame of a session registered with
+ * REGISTER_SUBSCRIBER_MAPPED: where to map the box read-only (see
+ * box_map.h). No messages are sent on the pipe afterwards, the subscriber
+ * reads them straight from the mapping. Closing the pipe ends the session.
+ */
+typedef struct __attribute__((__packed__)) box_map_proto_t {
+    char header_name[BOX_MAP_NAME_SIZE];
+    char data_name[BOX_MAP_NAME_SIZE];
+    uint64_t offset;
+    uint64_t capacity;
+    // Where in the box the subscriber starts reading
+    uint64_t start;
+} box_map_proto_t;
+
+/**
+ * Where a subscriber registered with REGISTER_SUBSCRIBER_FROM starts reading
+ * its box, instead of at its first message:
+ * - SEEK_MESSAGE: at message number `position`, counting from 0;
+ * - SEEK_LAST: `position` messages before the end;
+ * - SEEK_TIME: at the messages appended since `position`, in milliseconds
+ *   since the epoch. The box only remembers when every few messages were
+ *   appended, so a few older messages may come first.
+ *
+ * A position past the end starts at the end.
+ */
+typedef enum seek_e { SEEK_MESSAGE, SEEK_LAST, SEEK_TIME } seek_e;
+
+/**
+ * Registers a subscriber that starts reading its box at some position. The
+ * session is the same as with REGISTER_SUBSCRIBER otherwise, or as with
+ * REGISTER_SUBSCRIBER_MAPPED if `mapped` is set.
+ *
+ * A subscriber that names its subscription (a non-empty `subscription`)
+ * resumes where the last session under the same name stopped, and only
+ * starts at the position the first time. The mbroker keeps how far every
+ * named subscription got in TFS, next to the box. Mapped subscribers read
+ * the box on their own, so they cannot name their subscription.
+ */
+typedef struct __attribute__((__packed__)) register_sub_from_proto_t {
+    char client_named_pipe_path[NPIPE_PATH_SIZE];
+    char box_name[BOX_NAME_SIZE];
+    uint8_t mapped;
+    uint8_t seek;
+    uint64_t position;
+    char subscription[SUBSCRIPTION_NAME_SIZE];
+} register_sub_from_proto_t;
+
+/**
+ * Maximum size of the messages of a publisher batch, length prefixes
+ * included. Must fit in a frame reader buffer.
+ */
+#define BATCH_MAX_SIZE (16 * 1024)
+
+/**
+ * Header of a publisher batch, followed by `count` messages, each one a
+ * uint32_t length and its bytes (no \0). `len` is the size of all of them.
+ *
+ * Batches are always length-prefixed, so only clients that negotiated
+ * version 2 send them.
+ */
+typedef struct __attribute__((__packed__)) batch_header_t {
+    uint32_t count;
+    uint32_t len;
+} batch_header_t;
+
+/**
+ * A publisher batch being filled
+ */
+typedef struct batch_t {
+    batch_header_t header;
+    unsigned char data[BATCH_MAX_SIZE];
+} batch_t;
+
+/**
+ * Walks the messages of a received publisher batch
+ */
+typedef struct batch_iter_t {
+    const unsigned char *next;
+    const unsigned char *end;
+    uint32_t left;
+} batch_iter_t;
+
 uint8_t recv_opcode(const int fd);
 
 /**
@@ -105,9 +252,126 @@ uint8_t recv_opcode(const int fd);
  *
  * The opcode is the code of the protocol and the protocol is an structure with
  * variable size. You can get the protocol size with the @link proto_size method
+ *
+ * The opcode and the protocol are written with a single writev, straight from
+ * the caller memory, and a partial write is resumed where it stopped.
+ *
+ * @return int 0 if the whole frame was written and -1 otherwise (errno is
+ * set)
+ */
+int send_frame(const int fd, const uint8_t opcode, const void *proto);
+
+/**
+ * @brief Writes all the iovecs, resuming after partial writes and EINTR
+ *
+ * @param fd the file descriptor
+ * @param iov the iovecs, which are modified
+ * @param count the number of iovecs
+ * @return int 0 if everything was written and -1 otherwise
+ */
+int writev_all(const int fd, struct iovec *iov, int count);
+
+/**
+ * @brief Same as @link send_frame, but fails with an assertion
  */
 void send_proto_string(const int fd, const uint8_t opcode, const void *proto);
 
+/**
+ * @brief Sends a publisher or subscriber message in the version of the
+ * opcode: padded to MSG_SIZE in version 1 and length-prefixed in version 2
+ *
+ * @param fd the file descriptor
+ * @param opcode the message opcode, with PROTO_V2_FLAG if negotiated
+ * @param msg the message (does not need to end in \0)
+ * @param len the message length, truncated to MSG_SIZE - 1
+ * @return int 0 if the whole frame was written and -1 otherwise
+ */
+int send_message_frame(const int fd, const uint8_t opcode, const char *msg,
+                       size_t len);
+
+/**
+ * @brief Sends a response in the version of the opcode
+ *
+ * @param fd the file descriptor
+ * @param opcode the response opcode, with PROTO_V2_FLAG if negotiated
+ * @param return_code 0 if it was successful and -1 otherwise
+ * @param error_msg a message if it had an error
+ * @return int 0 if the whole frame was written and -1 otherwise
+ */
+int send_response_frame(const int fd, const uint8_t opcode,
+                        int32_t return_code, const char *error_msg);
+
+/**
+ * @brief Empties a batch
+ *
+ * @param batch the batch
+ */
+void batch_reset(batch_t *batch);
+
+/**
+ * @brief Appends a message to a batch
+ *
+ * @param batch the batch
+ * @param msg the message (does not need to end in \0)
+ * @param len the message length, truncated to MSG_SIZE - 1
+ * @return int 0 if it was added and -1 if the batch has no room left for it
+ */
+int batch_add(batch_t *batch, const char *msg, size_t len);
+
+/**
+ * @brief Sends a batch as a single PUBLISHER_BATCH frame and empties it
+ *
+ * @param fd the file descriptor
+ * @param batch the batch
+ * @return int 0 if the whole frame was written and -1 otherwise
+ */
+int send_batch_frame(const int fd, batch_t *batch);
+
+/**
+ * @brief Starts walking a PUBLISHER_BATCH frame returned by
+ * @link frame_reader_next
+ *
+ * @param iter the iterator
+ * @param payload the payload of the frame
+ * @return uint32_t the number of messages in the batch
+ */
+uint32_t batch_iter_init(batch_iter_t *iter, const void *payload);
+
+/**
+ * @brief Returns the next message of a batch
+ *
+ * @param iter the iterator
+ * @param len where the length of the message is stored
+ * @return const char* the message (not ending in \0), or NULL after the last
+ * one or if the batch is malformed
+ */
+const char *batch_iter_next(batch_iter_t *iter, size_t *len);
+
+/**
+ * @brief Gets the text of a message frame returned by @link frame_reader_next
+ *
+ * @param opcode the opcode of the frame
+ * @param payload the payload of the frame
+ * @param len where the length of the text is stored
+ * @return const char* the text, which does not necessarily end in \0
+ */
+const char *frame_message(const uint8_t opcode, const void *payload,
+                          size_t *len);
+
+/**
+ * @brief Gets the fields of a response frame returned by
+ * @link frame_reader_next
+ *
+ * @param opcode the opcode of the frame
+ * @param payload the payload of the frame
+ * @param error_msg where the error message (not necessarily ending in \0)
+ * is stored
+ * @param len where the length of the error message is stored
+ * @return int32_t the return code
+ */
+int32_t frame_response(const uint8_t opcode, const void *payload,
+                       const char **error_msg, size_t *len);
+
 /**
  * @brief Creates a named pipe
  *
@@ -116,16 +380,121 @@ void send_proto_string(const int fd, const uint8_t opcode, const void *proto);
  */
 void create_pipe(const char npipe_path[NPIPE_PATH_SIZE]);
 
+/**
+ * @brief Opens the read end of a client named pipe without waiting for the
+ * mbroker, so that the mbroker can open the write end right away (without
+ * blocking) even when it answers from the register pipe reader.
+ *
+ * @param npipe_path Path of the named pipe
+ * @return int the file descriptor, in non-blocking mode
+ */
+int open_response_pipe(const char npipe_path[NPIPE_PATH_SIZE]);
+
+/**
+ * @brief Waits until a pipe opened with @link open_response_pipe has data
+ * and puts it back in blocking mode
+ *
+ * @param fd the file descriptor
+ */
+void await_response(const int fd);
+
 /**
  * @brief Receives an opcode an reads the rest of the buffer with the right
  * protocol size
  *
  * @param rx the read file descriptor of the pipe
  * @param opcode the protocol opcode
- * @return void* the parsed protocol
+ * @return void* the parsed protocol, to be released with obj_pool_free
  */
 void *parse_protocol(const int rx, const uint8_t opcode);
 
+/**
+ * Size of the buffer of a frame reader. A pipe holds 64 KiB by default, so a
+ * whole burst of requests is usually pulled with a single read.
+ */
+#define FRAME_READER_BUF_SIZE (64 * 1024)
+
+/**
+ * @brief Reads frames ([ uint8_t opcode | ...protocol ]) from a file
+ * descriptor in large chunks.
+ *
+ * @details Frames that are already buffered are handed out without touching
+ * the file descriptor, and a frame cut in half by a read is kept until the
+ * rest arrives.
+ */
+typedef struct frame_reader_t {
+    int fd;
+    unsigned char *buffer;
+    // Bytes [start, end) of the buffer are yet to be parsed
+    size_t start;
+    size_t end;
+    // Number of read calls and frames parsed, for statistics
+    uint64_t reads;
+    uint64_t frames;
+} frame_reader_t;
+
+/**
+ * @brief Initializes a frame reader
+ *
+ * @param reader the already allocated reader
+ * @param fd the file descriptor to read from
+ * @return int 0 if was successful and -1 otherwise
+ */
+int frame_reader_init(frame_reader_t *reader, const int fd);
+
+/**
+ * @brief Returns the next frame, reading from the file descriptor only when
+ * no complete frame is buffered
+ *
+ * @param reader the reader
+ * @param opcode where the opcode of the frame is stored
+ * @param payload where a pointer to the protocol is stored. It points into
+ * the reader buffer and is only valid until the next call. Version 2 messages
+ * and responses are read with @link frame_message and @link frame_response.
+ * @return ssize_t 1 if a frame was read, 0 if the writers closed the pipe and
+ * -1 on error (errno is set, EPROTO for an invalid opcode, EAGAIN once a
+ * non-blocking fd is drained)
+ */
+ssize_t frame_reader_next(frame_reader_t *reader, uint8_t *opcode,
+                          const void **payload);
+
+/**
+ * @brief Releases the buffer of a frame reader (the fd is not closed)
+ *
+ * @param reader the reader
+ */
+void frame_reader_destroy(frame_reader_t *reader);
+
+/**
+ * @brief Returns the size of the frame at the start of a buffer
+ *
+ * @param frame the buffer
+ * @param buffered the bytes in the buffer
+ * @return ssize_t the frame size, 0 if not enough of it is buffered to tell
+ * and -1 if it is invalid
+ */
+ssize_t frame_size(const void *frame, size_t buffered);
+
+/**
+ * Sessions over a socket
+ *
+ * Besides its register pipe, the mbroker can listen on an AF_UNIX
+ * SOCK_SEQPACKET socket. A client connects to it instead of creating its own
+ * pipe, and the connection carries every frame, both ways, just like the
+ * pipes would. The first packet is the registration or manager request (its
+ * client_named_pipe_path is ignored), and every packet holds whole frames,
+ * so a frame reader never truncates one.
+ */
+#define SOCKET_PACKET_SIZE (32 * 1024)
+
+/**
+ * @brief Connects to the mbroker, if the register path is its socket
+ *
+ * @param register_path the register pipe or socket of the mbroker
+ * @return int the connection, or -1 if the path is not a socket
+ */
+int connect_mbroker_socket(const char *register_path);
+
 /**
  * @brief Opens a named pipe with the passed flags
  *
@@ -136,34 +505,57 @@ void *parse_protocol(const int rx, const uint8_t opcode);
 int open_pipe(const char npipe_path[NPIPE_PATH_SIZE], int _flags);
 
 /**
- * @brief Creates a protocol for a request
+ * @brief Fills a request protocol. Strings are truncated to fit and the
+ * unused bytes are zeroed.
  *
+ * @param p the protocol to fill (usually on the stack)
  * @param client_named_pipe_path the path to the client named pipe
  * @param box_name the name of the associated box
- * @return void* the request protocol reference
  */
-void *request_proto(const char *client_named_pipe_path, const char *box_name);
+void request_proto(request_proto_t *p, const char *client_named_pipe_path,
+                   const char *box_name);
 
 /**
- * @brief Creates a protocol for a response
+ * @brief Fills a REGISTER_SUBSCRIBER_FROM protocol. Strings are truncated to
+ * fit and the unused bytes are zeroed.
  *
+ * @param p the protocol to fill
+ * @param client_named_pipe_path the path to the client named pipe
+ * @param box_name the name of the box
+ * @param mapped whether the subscriber maps the box
+ * @param seek how to read position (see seek_e)
+ * @param position where to start
+ * @param subscription the name of the subscription, or "" for none
+ */
+void register_sub_from_proto(register_sub_from_proto_t *p,
+                             const char *client_named_pipe_path,
+                             const char *box_name, bool mapped, seek_e seek,
+                             uint64_t position, const char *subscription);
+
+/**
+ * @brief Fills a response protocol
+ *
+ * @param p the protocol to fill
  * @param return_code 0 if it was successful and -1 otherwise
  * @param error_message a message if it had an error
- * @return void* the response protocol reference
  */
-void *response_proto(int32_t return_code, const char *error_message);
+void response_proto(response_proto_t *p, int32_t return_code,
+                    const char *error_message);
 
 /**
- * Creates a protocol string to request a list of boxes
+ * Fills a protocol to request a list of boxes
  *
+ * @param p the protocol to fill
  * @param client_named_pipe_path string (char[NPIPE_PATH_SIZE]) containing
  * the path to the fifo
  */
-void *list_boxes_request_proto(const char *client_named_pipe_path);
+void list_boxes_request_proto(list_boxes_request_proto_t *p,
+                              const char *client_named_pipe_path);
 
 /**
- * Creates a protocol string to respond to a list_boxes_request
+ * Fills a protocol to respond to a list_boxes_request
  *
+ * @param p the protocol to fill
  * @param last 1 if is the last box from the list or if there are no boxes and 0
  * otherwise
  * @param box_name name of the box (\0 if there are no boxes)
@@ -171,25 +563,34 @@ void *list_boxes_request_proto(const char *client_named_pipe_path);
  * @param n_publishers publishers connected to the box
  * @param n_subscribers subscribers connected to the box
  */
-void *list_boxes_response_proto(const uint8_t last, const char *box_name,
-                                const uint64_t box_size,
-                                const uint64_t n_publishers,
-                                const uint64_t n_subscribers);
+void list_boxes_response_proto(list_boxes_response_proto_t *p,
+                               const uint8_t last, const char *box_name,
+                               const uint64_t box_size,
+                               const uint64_t n_publishers,
+                               const uint64_t n_subscribers);
 
 /**
- * Creates a protocol string that the publisher and the subscriber uses
+ * Fills a protocol that the publisher and the subscriber uses
  *
+ * @param p the protocol to fill
  * @param message the message to be sent to the server
  */
-void *message_proto(const char *message);
+void message_proto(basic_msg_proto_t *p, const char *message);
 
 /**
- * Returns the right size of a protocol
+ * Returns the right size of a protocol (in version 1)
  *
- * @param code protocol code
+ * @param code protocol code, without PROTO_V2_FLAG
  */
 size_t proto_size(uint8_t code);
 
-void send_proto_string(const int fd, const uint8_t opcode, const void *proto);
+/**
+ * Returns whether a protocol is a request a client sends to register a
+ * session or to manage boxes, which always takes exactly @link proto_size
+ * bytes
+ *
+ * @param code protocol code, without PROTO_V2_FLAG
+ */
+bool proto_is_request(uint8_t code);
 
 #endif
\ No newline at end of file
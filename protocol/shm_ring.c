@@ -0,0 +1,300 @@
+#define _GNU_SOURCE // syscall
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "futex.h"
+#include "shm_ring.h"
+
+// Marks the unused end of the data when a message does not fit before it
+#define RING_WRAP UINT32_MAX
+// Checks of the other side's position before sleeping on a doorbell, so a
+// busy peer is not woken up with a syscall for every message
+#define RING_SPIN 2048
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+static size_t record_size(size_t len) {
+    return (sizeof(uint32_t) + len + 3) & ~(size_t)3;
+}
+
+// Rings a doorbell, but only if the other side is sleeping on it and nobody
+// rang it since: one wake up per sleep, not one per message
+static void ring_doorbell(_Atomic uint32_t *waiting, _Atomic uint32_t *seq) {
+    if (atomic_load(waiting) && atomic_exchange(waiting, 0)) {
+        atomic_fetch_add(seq, 1);
+        futex_wake(seq);
+    }
+}
+
+// Returns whether a position moved away from `seen` within RING_SPIN checks.
+// With a single CPU the other side can't move while we spin.
+static bool spin_until_moved(_Atomic uint64_t *position, uint64_t seen) {
+    static _Atomic long cpus = 0;
+    if (cpus == 0) {
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    for (int i = 0; cpus > 1 && i < RING_SPIN; i++) {
+        if (atomic_load_explicit(position, memory_order_acquire) != seen) {
+            return true;
+        }
+        cpu_relax();
+    }
+    return false;
+}
+
+static int map_ring(shm_ring_t *ring, int fd, size_t capacity) {
+    ring->map_size = sizeof(ring_header_t) + capacity;
+    void *mem = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    ring->header = (ring_header_t *)mem;
+    ring->data = (unsigned char *)mem + sizeof(ring_header_t);
+    ring->mask = capacity - 1;
+    return 0;
+}
+
+int shm_ring_create(shm_ring_t *ring, const char *name, size_t capacity) {
+    size_t size = RING_MIN_CAPACITY;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    snprintf(ring->name, RING_NAME_SIZE, "%s", name);
+    int fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)(sizeof(ring_header_t) + size)) == -1 ||
+        map_ring(ring, fd, size) == -1) {
+        shm_unlink(ring->name);
+        return -1;
+    }
+
+    // ftruncate zeroed everything else
+    ring->header->capacity = (uint32_t)size;
+    atomic_store(&ring->header->state, RING_CREATED);
+    ring->producer = true;
+    ring->pos = 0;
+    return 0;
+}
+
+int shm_ring_wait_attached(shm_ring_t *ring, long timeout_ms) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (atomic_load(&ring->header->state) == RING_CREATED) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+                       (now.tv_nsec - start.tv_nsec) / 1000000;
+        uint32_t created = RING_CREATED;
+        // Gives up, unless the consumer attaches right now
+        if (elapsed >= timeout_ms &&
+            atomic_compare_exchange_strong(&ring->header->state, &created,
+                                           RING_DETACHED)) {
+            return -1;
+        }
+        if (elapsed < timeout_ms) {
+            futex_wait(&ring->header->state, RING_CREATED,
+                       timeout_ms - elapsed);
+        }
+    }
+    shm_unlink(ring->name);
+    ring->name[0] = '\0';
+    return atomic_load(&ring->header->state) == RING_ATTACHED ? 0 : -1;
+}
+
+int shm_ring_push(shm_ring_t *ring, const void *msg, size_t len) {
+    ring_header_t *header = ring->header;
+    uint64_t capacity = ring->mask + 1;
+    size_t need = record_size(len);
+    if (need > capacity / 4) {
+        return -1;
+    }
+
+    while (true) {
+        uint64_t idx = ring->pos & ring->mask;
+        // A message never wraps around: the end is skipped instead
+        uint64_t skip = capacity - idx < need ? capacity - idx : 0;
+        uint64_t used = ring->pos - atomic_load(&header->tail);
+        if (capacity - used >= skip + need) {
+            if (skip > 0) {
+                uint32_t wrap = RING_WRAP;
+                memcpy(ring->data + idx, &wrap, sizeof(wrap));
+                ring->pos += skip;
+            }
+            break;
+        }
+
+        // Full: sleeps until the consumer makes room
+        if (spin_until_moved(&header->tail, ring->pos - used)) {
+            continue;
+        }
+        uint32_t seq = atomic_load(&header->space_seq);
+        atomic_store(&header->producer_waiting, 1);
+        if (atomic_load(&header->state) == RING_DETACHED) {
+            atomic_store(&header->producer_waiting, 0);
+            return -1;
+        }
+        if (ring->pos - atomic_load(&header->tail) == used) {
+            futex_wait(&header->space_seq, seq, -1);
+        }
+        atomic_store(&header->producer_waiting, 0);
+    }
+
+    uint32_t msg_len = (uint32_t)len;
+    unsigned char *record = ring->data + (ring->pos & ring->mask);
+    memcpy(record, &msg_len, sizeof(msg_len));
+    memcpy(record + sizeof(msg_len), msg, len);
+    ring->pos += need;
+    atomic_store(&header->head, ring->pos);
+    ring_doorbell(&header->consumer_waiting, &header->data_seq);
+    return 0;
+}
+
+void shm_ring_close(shm_ring_t *ring) {
+    uint32_t attached = RING_ATTACHED;
+    atomic_compare_exchange_strong(&ring->header->state, &attached,
+                                   RING_CLOSED);
+    atomic_fetch_add(&ring->header->data_seq, 1);
+    futex_wake(&ring->header->data_seq);
+}
+
+// Maps a ring created by a producer, without changing its state
+static int open_ring(shm_ring_t *ring, const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ring_header_t)) {
+        close(fd);
+        return -1;
+    }
+    size_t capacity = (size_t)st.st_size - sizeof(ring_header_t);
+    if (capacity < RING_MIN_CAPACITY || (capacity & (capacity - 1)) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (map_ring(ring, fd, capacity) == -1) {
+        return -1;
+    }
+    ring->name[0] = '\0';
+    ring->producer = false;
+    return 0;
+}
+
+int shm_ring_attach(shm_ring_t *ring, const char *name) {
+    if (open_ring(ring, name) == -1) {
+        return -1;
+    }
+    ring->pos = atomic_load(&ring->header->tail);
+    uint32_t created = RING_CREATED;
+    if (!atomic_compare_exchange_strong(&ring->header->state, &created,
+                                        RING_ATTACHED)) {
+        shm_ring_destroy(ring);
+        return -1;
+    }
+    futex_wake(&ring->header->state);
+    return 0;
+}
+
+int shm_ring_refuse(const char *name) {
+    shm_ring_t ring;
+    if (open_ring(&ring, name) == -1) {
+        return -1;
+    }
+    // Wakes up the producer waiting in shm_ring_wait_attached
+    uint32_t created = RING_CREATED;
+    atomic_compare_exchange_strong(&ring.header->state, &created,
+                                   RING_DETACHED);
+    futex_wake(&ring.header->state);
+    munmap(ring.header, ring.map_size);
+    return 0;
+}
+
+int shm_ring_front(shm_ring_t *ring, const void **msg, size_t *len) {
+    uint64_t capacity = ring->mask + 1;
+    while (true) {
+        // The producer may write anything to the ring, so nothing it says is
+        // trusted before it is known to stay within the data
+        uint64_t ahead = atomic_load(&ring->header->head) - ring->pos;
+        if (ahead == 0) {
+            return 0;
+        }
+        uint64_t idx = ring->pos & ring->mask;
+        if (ahead > capacity || capacity - idx < sizeof(uint32_t)) {
+            errno = EPROTO;
+            return -1;
+        }
+        uint32_t msg_len;
+        memcpy(&msg_len, ring->data + idx, sizeof(msg_len));
+        if (msg_len == RING_WRAP) {
+            ring->pos += capacity - idx;
+            continue;
+        }
+        size_t size = record_size(msg_len);
+        if (size > capacity / 4 || size > capacity - idx || size > ahead) {
+            errno = EPROTO;
+            return -1;
+        }
+        *msg = ring->data + idx + sizeof(msg_len);
+        *len = msg_len;
+        return 1;
+    }
+}
+
+void shm_ring_pop(shm_ring_t *ring, size_t len) {
+    ring->pos += record_size(len);
+    atomic_store(&ring->header->tail, ring->pos);
+    ring_doorbell(&ring->header->producer_waiting, &ring->header->space_seq);
+}
+
+int shm_ring_wait(shm_ring_t *ring, long timeout_ms) {
+    ring_header_t *header = ring->header;
+    if (spin_until_moved(&header->head, ring->pos)) {
+        return 1;
+    }
+    uint32_t seq = atomic_load(&header->data_seq);
+    atomic_store(&header->consumer_waiting, 1);
+    if (atomic_load(&header->head) == ring->pos) {
+        if (atomic_load(&header->state) == RING_CLOSED) {
+            atomic_store(&header->consumer_waiting, 0);
+            return -1;
+        }
+        futex_wait(&header->data_seq, seq, timeout_ms);
+    }
+    atomic_store(&header->consumer_waiting, 0);
+
+    if (atomic_load(&header->head) != ring->pos) {
+        return 1;
+    }
+    return atomic_load(&header->state) == RING_CLOSED ? -1 : 0;
+}
+
+void shm_ring_destroy(shm_ring_t *ring) {
+    if (!ring->producer) {
+        uint32_t state = atomic_load(&ring->header->state);
+        while (state != RING_DETACHED &&
+               !atomic_compare_exchange_weak(&ring->header->state, &state,
+                                             RING_DETACHED)) {
+        }
+        atomic_fetch_add(&ring->header->space_seq, 1);
+        futex_wake(&ring->header->space_seq);
+    } else if (ring->name[0] != '\0') {
+        shm_unlink(ring->name);
+    }
+    munmap(ring->header, ring->map_size);
+    ring->header = NULL;
+}
@@ -0,0 +1,162 @@
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RING_NAME_SIZE 64
+
+// Smallest and default ring sizes, in bytes (rounded up to a power of two)
+#define RING_MIN_CAPACITY 4096
+#define RING_DEFAULT_CAPACITY (1024 * 1024)
+
+typedef enum ring_state_e {
+    // Created by the producer, no consumer yet
+    RING_CREATED,
+    // Mapped by the consumer
+    RING_ATTACHED,
+    // The producer is done, the consumer drains what is left
+    RING_CLOSED,
+    // The consumer is gone, pushing fails
+    RING_DETACHED,
+} ring_state_e;
+
+/**
+ * @brief Header at the start of the shared memory of a ring, followed by the
+ * data. Each side only writes its own cache line.
+ */
+typedef struct ring_header_t {
+    // Written by the producer
+    _Alignas(64) _Atomic uint64_t head;
+    _Atomic uint32_t data_seq;
+    _Atomic uint32_t producer_waiting;
+
+    // Written by the consumer
+    _Alignas(64) _Atomic uint64_t tail;
+    _Atomic uint32_t space_seq;
+    _Atomic uint32_t consumer_waiting;
+
+    _Alignas(64) _Atomic uint32_t state;
+    uint32_t capacity;
+} ring_header_t;
+
+/**
+ * @brief Single-producer/single-consumer ring of messages in POSIX shared
+ * memory, shared by a publisher and the mbroker.
+ *
+ * @details Messages are stored as a uint32_t length followed by their bytes,
+ * padded to 4 bytes. Both sides spin on their own copy of the positions and
+ * only make a syscall (a futex "doorbell") to sleep when the ring is empty or
+ * full, and to wake the other side when it sleeps. A busy ring moves
+ * messages without any syscalls.
+ */
+typedef struct shm_ring_t {
+    ring_header_t *header;
+    unsigned char *data;
+    size_t map_size;
+    uint64_t mask;
+    // The position this side owns (head for the producer, tail for the
+    // consumer)
+    uint64_t pos;
+    bool producer;
+    // Until the consumer attaches, the name of the ring (producer side)
+    char name[RING_NAME_SIZE];
+} shm_ring_t;
+
+/**
+ * @brief Creates a ring (producer side)
+ *
+ * @param ring the ring
+ * @param name the shared memory object name (starting with /)
+ * @param capacity the data size in bytes
+ * @return int 0 if was successful and -1 otherwise
+ */
+int shm_ring_create(shm_ring_t *ring, const char *name, size_t capacity);
+
+/**
+ * @brief Waits until the consumer attaches and removes the name of the ring,
+ * since no one else needs to open it (producer side)
+ *
+ * @param ring the ring
+ * @param timeout_ms how long to wait
+ * @return int 0 if the consumer attached and -1 otherwise
+ */
+int shm_ring_wait_attached(shm_ring_t *ring, long timeout_ms);
+
+/**
+ * @brief Appends a message, waiting while the ring is full (producer side)
+ *
+ * @param ring the ring
+ * @param msg the message
+ * @param len the message length, at most a quarter of the capacity
+ * @return int 0 if was successful and -1 if the consumer is gone
+ */
+int shm_ring_push(shm_ring_t *ring, const void *msg, size_t len);
+
+/**
+ * @brief Tells the consumer no more messages are coming (producer side)
+ *
+ * @param ring the ring
+ */
+void shm_ring_close(shm_ring_t *ring);
+
+/**
+ * @brief Maps a ring created by a producer (consumer side)
+ *
+ * @param ring the ring
+ * @param name the shared memory object name
+ * @return int 0 if was successful and -1 otherwise
+ */
+int shm_ring_attach(shm_ring_t *ring, const char *name);
+
+/**
+ * @brief Turns down a ring a producer offers, so that it stops waiting for a
+ * consumer right away (consumer side)
+ *
+ * @param name the shared memory object name
+ * @return int 0 if was successful and -1 otherwise
+ */
+int shm_ring_refuse(const char *name);
+
+/**
+ * @brief Finds the oldest message without removing it (consumer side). The
+ * record is checked to lie within the ring first, since the producer can
+ * write anything to it.
+ *
+ * @param ring the ring
+ * @param msg where the message is stored
+ * @param len where the message length is stored
+ * @return int 1 if there is a message, 0 if the ring is empty and -1 if the
+ * ring is corrupt (errno is EPROTO), in which case it must be dropped
+ */
+int shm_ring_front(shm_ring_t *ring, const void **msg, size_t *len);
+
+/**
+ * @brief Removes the message returned by @link shm_ring_front (consumer side)
+ *
+ * @param ring the ring
+ * @param len its length
+ */
+void shm_ring_pop(shm_ring_t *ring, size_t len);
+
+/**
+ * @brief Waits until the ring has messages or is closed (consumer side)
+ *
+ * @param ring the ring
+ * @param timeout_ms how long to wait
+ * @return int 1 if there are messages, 0 on timeout and -1 if the ring is
+ * closed and empty
+ */
+int shm_ring_wait(shm_ring_t *ring, long timeout_ms);
+
+/**
+ * @brief Unmaps a ring. The consumer marks it detached first, so the
+ * producer stops pushing. The producer also removes its name.
+ *
+ * @param ring the ring
+ */
+void shm_ring_destroy(shm_ring_t *ring);
+
+#endif // __SHM_RING_H__
@@ -1,15 +1,152 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "betterassert.h"
+#include "histogram.h"
 #include "logging.h"
 #include "protocols.h"
 
+// How long a message may wait for others to fill its batch. Can be tuned
+// with the PUB_LINGER_MS environment variable.
+#define PUB_LINGER_MS 5
+
+// How long to wait for the mbroker to map a shared memory ring, asked for
+// by setting PUB_RING_SIZE (in bytes) in the environment
+#define PUB_RING_ATTACH_TIMEOUT_MS 1000
+
+static long ms_until(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+              (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    return ms > 0 ? ms : 0;
+}
+
+typedef struct publisher_t {
+    int tx;
+    long linger_ms;
+    batch_t batch;
+    // Set when the first message enters an empty batch
+    struct timespec deadline;
+    histogram_t batch_sizes;
+    // Messages go through the ring instead of the pipe
+    bool use_ring;
+    shm_ring_t ring;
+} publisher_t;
+
+static void flush_batch(publisher_t *pub) {
+    if (pub->batch.header.count == 0) {
+        return;
+    }
+    histogram_add(&pub->batch_sizes, pub->batch.header.count);
+    if (send_batch_frame(pub->tx, &pub->batch) == -1) {
+        PANIC("Session closed by the mbroker");
+    }
+}
+
+static void publish(publisher_t *pub, const char *msg, size_t len) {
+    if (pub->use_ring) {
+        if (shm_ring_push(&pub->ring, msg, len) == -1) {
+            PANIC("Session closed by the mbroker");
+        }
+        return;
+    }
+    if (batch_add(&pub->batch, msg, len) == -1) {
+        flush_batch(pub);
+        ALWAYS_ASSERT(batch_add(&pub->batch, msg, len) == 0,
+                      "Message does not fit in a batch");
+    }
+    if (pub->batch.header.count == 1) {
+        clock_gettime(CLOCK_MONOTONIC, &pub->deadline);
+        pub->deadline.tv_sec += pub->linger_ms / 1000;
+        pub->deadline.tv_nsec += (pub->linger_ms % 1000) * 1000000;
+        if (pub->deadline.tv_nsec >= 1000000000) {
+            pub->deadline.tv_sec++;
+            pub->deadline.tv_nsec -= 1000000000;
+        }
+    }
+    if (pub->linger_ms == 0) {
+        flush_batch(pub);
+    }
+}
+
+// Offers the mbroker a shared memory ring, keeping the pipe if it can't map it
+static void start_ring(publisher_t *pub, size_t capacity) {
+    ring_proto_t offer;
+    memset(&offer, 0, sizeof(offer));
+    snprintf(offer.shm_name, RING_NAME_SIZE, "/mbroker-ring-%d", getpid());
+    if (shm_ring_create(&pub->ring, offer.shm_name, capacity) == -1) {
+        WARN("Failed to create ring %s, publishing through the pipe",
+             offer.shm_name);
+        return;
+    }
+    if (send_frame(pub->tx, PUBLISHER_RING | PROTO_V2_FLAG, &offer) == -1 ||
+        shm_ring_wait_attached(&pub->ring, PUB_RING_ATTACH_TIMEOUT_MS) == -1) {
+        WARN("The mbroker did not map the ring, publishing through the pipe");
+        shm_ring_destroy(&pub->ring);
+        return;
+    }
+    pub->use_ring = true;
+}
+
+// Publishes every line of stdin, batching the lines that arrive within the
+// linger time of each other
+static void publish_stdin(publisher_t *pub) {
+    char line[MSG_SIZE];
+    size_t line_len = 0;
+    char chunk[4096];
+
+    while (true) {
+        int timeout = -1;
+        if (pub->batch.header.count > 0) {
+            timeout = (int)ms_until(&pub->deadline);
+        }
+        struct pollfd pfd = {.fd = STDIN_FILENO, .events = POLLIN};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready == -1) {
+            ALWAYS_ASSERT(errno == EINTR, "Failed to wait for stdin");
+            continue;
+        }
+        if (ready == 0) {
+            flush_batch(pub);
+            continue;
+        }
+
+        ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (size_t i = 0; i < (size_t)n; i++) {
+            if (chunk[i] == '\n') {
+                publish(pub, line, line_len);
+                line_len = 0;
+            } else if (line_len < MSG_SIZE - 1) {
+                // Longer lines are truncated
+                line[line_len++] = chunk[i];
+            }
+        }
+    }
+
+    // The last line may not end in \n
+    if (line_len > 0) {
+        publish(pub, line, line_len);
+    }
+    flush_batch(pub);
+}
+
 int main(int argc, char **argv) {
     set_log_level(LOG_VERBOSE);
     if (argc != 4) {
@@ -23,22 +160,62 @@ int main(int argc, char **argv) {
 
     ALWAYS_ASSERT(argc == 4, "Invalid usage");
 
-    request_proto_t *request =
-        (request_proto_t *)request_proto(pipe_name, box_name);
+    request_proto_t request;
+    request_proto(&request, pipe_name, box_name);
 
-    ALWAYS_ASSERT(strcmp(pipe_name, request->client_named_pipe_path) == 0,
+    ALWAYS_ASSERT(strcmp(pipe_name, request.client_named_pipe_path) == 0,
                   "error while reading name");
 
-    ALWAYS_ASSERT(strcmp(box_name, request->box_name) == 0,
+    ALWAYS_ASSERT(strcmp(box_name, request.box_name) == 0,
                   "error while reading box_name");
 
-    DEBUG("client_named_pipe: %s\n", request->client_named_pipe_path);
+    DEBUG("client_named_pipe: %s\n", request.client_named_pipe_path);
+
+    // The mbroker closing the session must not kill us before we report it
+    signal(SIGPIPE, SIG_IGN);
+    static publisher_t pub;
 
-    int wx = open(register_pipe_name, O_WRONLY);
-    ALWAYS_ASSERT(wx != -1, "Failed to open fifo");
+    // With a socket, the connection carries the session instead of our pipe
+    int sock = connect_mbroker_socket(register_pipe_name);
+    if (sock != -1) {
+        send_proto_string(sock, REGISTER_PUBLISHER | PROTO_V2_FLAG, &request);
+        pub.tx = sock;
+    } else {
+        create_pipe(pipe_name);
 
-    DEBUG("Sended register publisher code %u", REGISTER_PUBLISHER);
-    send_proto_string(wx, REGISTER_PUBLISHER, request);
+        int wx = open(register_pipe_name, O_WRONLY);
+        ALWAYS_ASSERT(wx != -1, "Failed to open fifo");
 
+        DEBUG("Sended register publisher code %u", REGISTER_PUBLISHER);
+        send_proto_string(wx, REGISTER_PUBLISHER | PROTO_V2_FLAG, &request);
+        close(wx);
+
+        // Waits for the mbroker to accept the session
+        pub.tx = open_pipe(pipe_name, O_WRONLY);
+    }
+    pub.linger_ms = PUB_LINGER_MS;
+    const char *linger = getenv("PUB_LINGER_MS");
+    if (linger != NULL) {
+        pub.linger_ms = atol(linger);
+    }
+    batch_reset(&pub.batch);
+    histogram_reset(&pub.batch_sizes);
+    const char *ring_size = getenv("PUB_RING_SIZE");
+    if (ring_size != NULL) {
+        start_ring(&pub, (size_t)atol(ring_size));
+    }
+
+    publish_stdin(&pub);
+
+    if (pub.use_ring) {
+        shm_ring_close(&pub.ring);
+        shm_ring_destroy(&pub.ring);
+    } else {
+        histogram_log(&pub.batch_sizes, "messages per batch");
+    }
+    close(pub.tx);
+    if (sock == -1) {
+        unlink(pipe_name);
+    }
     return 0;
 }
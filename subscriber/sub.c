@@ -1,4 +1,6 @@
 #include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,9 +9,61 @@
 #include <unistd.h>
 
 #include "betterassert.h"
+#include "delim.h"
 #include "logging.h"
 #include "protocols.h"
 
+// How often a mapped subscriber with nothing to read checks if the mbroker
+// closed the session
+#define SUB_MAP_POLL_MS 1000
+// Message ends found per scan of a mapped box
+#define SUB_MAP_SCAN_ENDS 256
+
+static bool session_closed(int rx) {
+    struct pollfd pfd = {.fd = rx, .events = POLLIN};
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP) != 0;
+}
+
+// Prints every message of a box read straight from shared memory, until the
+// box is removed or the mbroker closes the session. Returns the number of
+// messages printed.
+static size_t print_mapped(const box_map_proto_t *offer, int rx) {
+    box_map_t map;
+    if (box_map_attach(&map, offer->header_name, offer->data_name,
+                       offer->offset, offer->capacity) == -1) {
+        WARN("Failed to map box from %s", offer->header_name);
+        return 0;
+    }
+
+    size_t seen = (size_t)offer->start;
+    size_t received = 0;
+    size_t ends[SUB_MAP_SCAN_ENDS];
+    while (true) {
+        // Appends are whole messages, so everything committed ends in \0
+        size_t committed = box_map_committed(&map);
+        size_t n_ends = SUB_MAP_SCAN_ENDS;
+        while (seen < committed && n_ends == SUB_MAP_SCAN_ENDS) {
+            size_t base = seen;
+            n_ends = delim_scan(map.data + base, committed - base, ends,
+                                SUB_MAP_SCAN_ENDS);
+            for (size_t i = 0; i < n_ends; i++) {
+                size_t end = base + ends[i];
+                fprintf(stdout, "%.*s\n", (int)(end - seen), map.data + seen);
+                received++;
+                seen = end + 1;
+            }
+        }
+        fflush(stdout);
+
+        int ready = box_map_wait(&map, seen, SUB_MAP_POLL_MS);
+        if (ready == -1 || (ready == 0 && session_closed(rx))) {
+            break;
+        }
+    }
+    box_map_detach(&map);
+    return received;
+}
+
 int main(int argc, char **argv) {
     if (argc != 4) {
         fprintf(stderr,
@@ -22,21 +76,97 @@ int main(int argc, char **argv) {
 
     ALWAYS_ASSERT(argc == 4, "Invalid usage");
 
-    request_proto_t *request =
-        (request_proto_t *)request_proto(pipe_name, box_name);
+    request_proto_t request;
+    request_proto(&request, pipe_name, box_name);
 
-    ALWAYS_ASSERT(strcmp(pipe_name, request->client_named_pipe_path) == 0,
+    ALWAYS_ASSERT(strcmp(pipe_name, request.client_named_pipe_path) == 0,
                   "error while reading name");
 
-    ALWAYS_ASSERT(strcmp(box_name, request->box_name) == 0,
+    ALWAYS_ASSERT(strcmp(box_name, request.box_name) == 0,
                   "error while reading box_name");
 
-    DEBUG("client_named_pipe: %s\n", request->client_named_pipe_path);
+    DEBUG("client_named_pipe: %s\n", request.client_named_pipe_path);
 
-    int wx = open(register_pipe_name, O_WRONLY);
-    ALWAYS_ASSERT(wx != -1, "Failed to open fifo");
+    // Set SUB_MAP in the environment to read the box from shared memory
+    bool mapped = getenv("SUB_MAP") != NULL;
+    uint8_t register_code =
+        mapped ? REGISTER_SUBSCRIBER_MAPPED : REGISTER_SUBSCRIBER;
 
-    send_proto_string(wx, REGISTER_SUBSCRIBER, request);
+    // Set SUB_FROM to start somewhere else than at the first message: at
+    // message N ("N"), at the last N messages ("-N"), or at the messages
+    // appended since a time in milliseconds since the epoch ("@T"). Set
+    // SUB_NAME to resume a named subscription where it stopped instead.
+    register_sub_from_proto_t from;
+    const void *registration = &request;
+    const char *from_str = getenv("SUB_FROM");
+    const char *subscription = getenv("SUB_NAME");
+    if (from_str != NULL || subscription != NULL) {
+        seek_e seek = SEEK_MESSAGE;
+        if (from_str == NULL) {
+            from_str = "0";
+        } else if (from_str[0] == '-') {
+            seek = SEEK_LAST;
+            from_str++;
+        } else if (from_str[0] == '@') {
+            seek = SEEK_TIME;
+            from_str++;
+        }
+        register_sub_from_proto(&from, pipe_name, box_name, mapped, seek,
+                                strtoull(from_str, NULL, 10),
+                                subscription == NULL ? "" : subscription);
+        register_code = REGISTER_SUBSCRIBER_FROM;
+        registration = &from;
+    }
+
+    // With a socket, the connection carries the session instead of our pipe
+    int rx = connect_mbroker_socket(register_pipe_name);
+    bool uses_pipe = rx == -1;
+    if (uses_pipe) {
+        create_pipe(pipe_name);
+
+        int wx = open(register_pipe_name, O_WRONLY);
+        ALWAYS_ASSERT(wx != -1, "Failed to open fifo");
+        send_proto_string(wx, register_code | PROTO_V2_FLAG, registration);
+        close(wx);
+
+        // Waits for the mbroker to accept the session
+        rx = open_pipe(pipe_name, O_RDONLY);
+    } else {
+        send_proto_string(rx, register_code | PROTO_V2_FLAG, registration);
+    }
+    frame_reader_t reader;
+    ALWAYS_ASSERT(frame_reader_init(&reader, rx) == 0,
+                  "Failed to create pipe reader");
+
+    // Prints every message until the mbroker closes the session
+    uint8_t opcode;
+    const void *payload;
+    size_t received = 0;
+    while (frame_reader_next(&reader, &opcode, &payload) == 1) {
+        if (PROTO_OPCODE(opcode) == SUBSCRIBER_MAP) {
+            received += print_mapped((const box_map_proto_t *)payload, rx);
+            break;
+        }
+        if (PROTO_OPCODE(opcode) != SUBSCRIBER_MESSAGE) {
+            WARN("Received invalid opcode %u", opcode);
+            break;
+        }
+        size_t len;
+        const char *msg = frame_message(opcode, payload, &len);
+        fprintf(stdout, "%.*s\n", (int)len, msg);
+        received++;
+        // Prints a whole delivery at once
+        if (reader.start == reader.end) {
+            fflush(stdout);
+        }
+    }
+    fflush(stdout);
+    DEBUG("Received %zu messages", received);
 
+    frame_reader_destroy(&reader);
+    close(rx);
+    if (uses_pipe) {
+        unlink(pipe_name);
+    }
     return 0;
 }
@@ -0,0 +1,255 @@
+/**
+ * Append test.
+ *
+ * - Full box: a box filled to about half its capacity turns down a batch
+ *   that does not fit, and still takes a small message after it. Nothing of
+ *   the batch that was turned down is reserved or committed.
+ * - Split batch: of a batch that does not fit as a whole, the messages that
+ *   do are appended and the rest are dropped, never part of a message.
+ * - Frames: messages are cut to MSG_SIZE - 1 bytes and at their first \0,
+ *   be they sent alone or in a batch by a publisher that does not cut them
+ *   itself.
+ * - Racing publishers: threads append messages of different sizes to the
+ *   same box until each of them was turned down several times in a row.
+ *   The box ends up with exactly the bytes of the appends that succeeded,
+ *   all committed, in whole messages.
+ *
+ * usage: append_test
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "betterassert.h"
+#include "mbroker/mbroker.h"
+#include "mbroker/requests.h"
+#include "operations.h"
+
+#define BOX_NAME "/append"
+#define FILL_SIZE 500
+#define BIG_BATCH_SIZE 900
+#define SMALL_MSG "still fits"
+// Two messages of a batch, of which only the first fits after FILL_SIZE
+#define SPLIT_MSG_SIZE 300
+#define LONG_MSG_SIZE (2 * MSG_SIZE)
+#define PUBLISHERS 4
+// Failed appends in a row after which a publisher stops
+#define GIVE_UP_AFTER 8
+
+// Defined by mbroker.c, which is not linked in
+box_holder_t box_holder;
+session_engine_t session_engine;
+socket_server_t socket_server;
+group_commit_t group_commit;
+size_t max_sessions;
+char tfs_data_name[BOX_MAP_NAME_SIZE];
+
+static atomic_size_t appended = 0;
+static atomic_uint next_seed = 1;
+
+static box_metadata_t *new_box(void) {
+    const char *error_msg;
+    ALWAYS_ASSERT(create_box_named(BOX_NAME, &error_msg) == 0,
+                  "Failed to create %s: %s", BOX_NAME, error_msg);
+    box_metadata_t *box = box_holder_find_box(&box_holder, BOX_NAME);
+    ALWAYS_ASSERT(box != NULL, "Failed to find %s", BOX_NAME);
+    return box;
+}
+
+static void drop_box(box_metadata_t *box) {
+    box_metadata_put(box);
+    ALWAYS_ASSERT(remove_box_named(BOX_NAME) == 0, "Failed to remove %s",
+                  BOX_NAME);
+}
+
+// A message of `len` bytes, NUL included
+static void fill_message(char *msg, size_t len, char c) {
+    memset(msg, c, len - 1);
+    msg[len - 1] = '\0';
+}
+
+static void test_full_box(void) {
+    box_metadata_t *box = new_box();
+    char msgs[BIG_BATCH_SIZE];
+
+    fill_message(msgs, FILL_SIZE, 'a');
+    ALWAYS_ASSERT(append_messages(box, msgs, FILL_SIZE) == 0,
+                  "Failed to fill the box to %d bytes", FILL_SIZE);
+    fill_message(msgs, BIG_BATCH_SIZE, 'b');
+    ALWAYS_ASSERT(append_messages(box, msgs, BIG_BATCH_SIZE) == -1,
+                  "A %d-byte batch went into a box with %zu bytes left",
+                  BIG_BATCH_SIZE, box->capacity - FILL_SIZE);
+    ALWAYS_ASSERT(atomic_load(&box->tail) == FILL_SIZE,
+                  "The batch turned down left %zu bytes reserved",
+                  atomic_load(&box->tail) - FILL_SIZE);
+
+    ALWAYS_ASSERT(append_messages(box, SMALL_MSG, sizeof(SMALL_MSG)) == 0,
+                  "A small message did not fit after a batch that didn't");
+    ALWAYS_ASSERT(fanout_committed(&box->fanout) ==
+                      FILL_SIZE + sizeof(SMALL_MSG),
+                  "%zu bytes committed instead of %zu",
+                  fanout_committed(&box->fanout),
+                  FILL_SIZE + sizeof(SMALL_MSG));
+    ALWAYS_ASSERT(strcmp(box->data + FILL_SIZE, SMALL_MSG) == 0,
+                  "The small message is not where the box was filled up to");
+    printf("a %d-byte batch was turned down past %d bytes, and a small "
+           "message still went in\n",
+           BIG_BATCH_SIZE, FILL_SIZE);
+    drop_box(box);
+}
+
+static void test_split_batch(void) {
+    box_metadata_t *box = new_box();
+    char msgs[2 * SPLIT_MSG_SIZE];
+
+    fill_message(msgs, FILL_SIZE, 'a');
+    ALWAYS_ASSERT(append_messages(box, msgs, FILL_SIZE) == 0,
+                  "Failed to fill the box to %d bytes", FILL_SIZE);
+    fill_message(msgs, SPLIT_MSG_SIZE, 'b');
+    fill_message(msgs + SPLIT_MSG_SIZE, SPLIT_MSG_SIZE, 'c');
+    ALWAYS_ASSERT(append_messages(box, msgs, sizeof(msgs)) == -1,
+                  "A %zu-byte batch went into a box with %zu bytes left",
+                  sizeof(msgs), box->capacity - FILL_SIZE);
+    ALWAYS_ASSERT(atomic_load(&box->tail) == FILL_SIZE + SPLIT_MSG_SIZE &&
+                      fanout_committed(&box->fanout) ==
+                          FILL_SIZE + SPLIT_MSG_SIZE,
+                  "%zu bytes reserved and %zu committed instead of the "
+                  "first message of the batch",
+                  atomic_load(&box->tail) - FILL_SIZE,
+                  fanout_committed(&box->fanout) - FILL_SIZE);
+    ALWAYS_ASSERT(box->data[FILL_SIZE] == 'b' &&
+                      box->data[FILL_SIZE + SPLIT_MSG_SIZE - 1] == '\0',
+                  "The first message of the batch was not appended whole");
+
+    ALWAYS_ASSERT(append_messages(box, SMALL_MSG, sizeof(SMALL_MSG)) == 0,
+                  "A small message did not fit after a split batch");
+    printf("a batch past %d bytes was split after its first %d-byte "
+           "message\n",
+           FILL_SIZE, SPLIT_MSG_SIZE);
+    drop_box(box);
+}
+
+// Adds a message to a batch the way a hostile publisher would, uncut
+static void batch_add_raw(batch_t *batch, const char *msg, uint32_t len) {
+    memcpy(batch->data + batch->header.len, &len, sizeof(len));
+    memcpy(batch->data + batch->header.len + sizeof(len), msg, len);
+    batch->header.len += (uint32_t)sizeof(len) + len;
+    batch->header.count++;
+}
+
+static void check_messages(const char *msgs, ssize_t msgs_len,
+                           const char *expected, size_t expected_len) {
+    ALWAYS_ASSERT(msgs_len == (ssize_t)expected_len &&
+                      memcmp(msgs, expected, expected_len) == 0,
+                  "Got %zd bytes of messages instead of %zu", msgs_len,
+                  expected_len);
+}
+
+static void test_frames(void) {
+    static char long_msg[LONG_MSG_SIZE];
+    static char msgs[BATCH_MAX_SIZE];
+    static char expected[BATCH_MAX_SIZE];
+    static batch_t batch;
+    memset(long_msg, 'x', sizeof(long_msg));
+    // What the long message is cut to
+    memset(expected, 'x', MSG_SIZE - 1);
+    expected[MSG_SIZE - 1] = '\0';
+    size_t count;
+
+    batch_reset(&batch);
+    batch_add_raw(&batch, long_msg, LONG_MSG_SIZE);
+    batch_add_raw(&batch, "one\0two", 7);
+    batch_add_raw(&batch, "ok", 2);
+    memcpy(expected + MSG_SIZE, "one\0ok", 7);
+    check_messages(msgs,
+                   frame_to_messages(PUBLISHER_BATCH | PROTO_V2_FLAG,
+                                     &batch.header, msgs, &count),
+                   expected, MSG_SIZE + 7);
+    ALWAYS_ASSERT(count == 3, "Counted %zu messages in a batch of 3", count);
+
+    // A version 2 message is its header followed by the text
+    msg_v2_header_t header = {.len = LONG_MSG_SIZE};
+    memcpy(batch.data, &header, sizeof(header));
+    memcpy(batch.data + sizeof(header), long_msg, LONG_MSG_SIZE);
+    check_messages(msgs,
+                   frame_to_messages(PUBLISHER_MESSAGE | PROTO_V2_FLAG,
+                                     batch.data, msgs, &count),
+                   expected, MSG_SIZE);
+    header.len = 7;
+    memcpy(batch.data, &header, sizeof(header));
+    memcpy(batch.data + sizeof(header), "one\0two", 7);
+    check_messages(msgs,
+                   frame_to_messages(PUBLISHER_MESSAGE | PROTO_V2_FLAG,
+                                     batch.data, msgs, &count),
+                   "one", 4);
+    printf("messages cut to %d bytes and at their first \\0\n",
+           MSG_SIZE - 1);
+}
+
+static void *publisher(void *arg) {
+    box_metadata_t *box = (box_metadata_t *)arg;
+    unsigned int seed = atomic_fetch_add(&next_seed, 1);
+    char msg[BIG_BATCH_SIZE];
+    int failed = 0;
+    while (failed < GIVE_UP_AFTER) {
+        size_t len = 2 + (size_t)rand_r(&seed) % 64;
+        fill_message(msg, len, 'c');
+        if (append_messages(box, msg, len) == 0) {
+            atomic_fetch_add(&appended, len);
+            failed = 0;
+        } else {
+            failed++;
+        }
+    }
+    return NULL;
+}
+
+static void test_racing_publishers(void) {
+    box_metadata_t *box = new_box();
+    pthread_t publishers[PUBLISHERS];
+    for (size_t i = 0; i < PUBLISHERS; i++) {
+        ALWAYS_ASSERT(pthread_create(&publishers[i], NULL, publisher, box) ==
+                          0,
+                      "Failed to create publisher");
+    }
+    for (size_t i = 0; i < PUBLISHERS; i++) {
+        pthread_join(publishers[i], NULL);
+    }
+
+    size_t bytes = atomic_load(&appended);
+    ALWAYS_ASSERT(atomic_load(&box->tail) == bytes &&
+                      fanout_committed(&box->fanout) == bytes,
+                  "%zu bytes appended but %zu reserved and %zu committed",
+                  bytes, atomic_load(&box->tail),
+                  fanout_committed(&box->fanout));
+    ALWAYS_ASSERT(bytes <= box->capacity, "%zu bytes in a box of %zu", bytes,
+                  box->capacity);
+    // Every message is made of 'c's up to its NUL
+    for (size_t i = 0; i < bytes; i++) {
+        char c = box->data[i];
+        ALWAYS_ASSERT(c == 'c' || (c == '\0' && i > 0 && box->data[i - 1] ==
+                                                             'c'),
+                      "Byte %zu of the box is not part of a whole message", i);
+    }
+    ALWAYS_ASSERT(box->data[bytes - 1] == '\0',
+                  "The box does not end in a whole message");
+    printf("%d publishers filled %zu of %zu bytes\n", PUBLISHERS, bytes,
+           box->capacity);
+    drop_box(box);
+}
+
+int main(void) {
+    set_log_level(LOG_QUIET);
+    ALWAYS_ASSERT(tfs_init(NULL) != -1, "Failed to initialize TFS");
+    ALWAYS_ASSERT(box_holder_create(&box_holder, 1) == 0,
+                  "Failed to create box holder");
+    test_full_box();
+    test_split_batch();
+    test_frames();
+    test_racing_publishers();
+    ALWAYS_ASSERT(tfs_destroy() != -1, "Failed to destroy TFS");
+    return 0;
+}
@@ -0,0 +1,178 @@
+/**
+ * Box holder test.
+ *
+ * Creates and removes boxes through the same calls as the mbroker requests,
+ * while other threads look them up and list them without locks, holding on
+ * to the boxes they find for a while. Every box a reader reaches must still
+ * be the box it asked for: a box freed too early shows up as a wrong name,
+ * since free overwrites the first bytes of an object, where its name is.
+ * Thousands of boxes come and go over the 1024 TFS blocks, so creating one
+ * fails if removed boxes are never reclaimed. Once everything stopped, every
+ * box is removed and the same names can be taken again.
+ *
+ * usage: box_holder_test
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "betterassert.h"
+#include "epoch.h"
+#include "mbroker/mbroker.h"
+#include "mbroker/requests.h"
+#include "operations.h"
+
+#define BOXES 8
+#define BOX_NAME_FORMAT "/box-%d"
+#define READERS 4
+#define WRITERS 2
+#define CHANGES_PER_WRITER 20000
+// Lookups a reader keeps its box for
+#define HOLD_LOOKUPS 4
+// Reads of the name of every listed box, to stay on it for a while
+#define READS_PER_BOX 64
+
+// Defined by mbroker.c, which is not linked in
+box_holder_t box_holder;
+session_engine_t session_engine;
+socket_server_t socket_server;
+group_commit_t group_commit;
+size_t max_sessions;
+char tfs_data_name[BOX_MAP_NAME_SIZE];
+
+static atomic_bool stop;
+static atomic_size_t created = 0;
+static atomic_size_t removed = 0;
+
+static void box_name(char name[BOX_NAME_SIZE], unsigned int i) {
+    snprintf(name, BOX_NAME_SIZE, BOX_NAME_FORMAT, i % BOXES);
+}
+
+static bool is_box_name(const volatile char *name) {
+    return name[0] == '/' && name[1] == 'b' && name[2] == 'o' &&
+           name[3] == 'x' && name[4] == '-';
+}
+
+static void check_box(box_metadata_t *box, void *arg) {
+    (void)arg;
+    for (int i = 0; i < READS_PER_BOX; i++) {
+        ALWAYS_ASSERT(is_box_name(box->name), "Listed a box that was freed");
+    }
+}
+
+static void *reader(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    box_metadata_t *held[HOLD_LOOKUPS] = {NULL};
+    size_t found = 0;
+    for (size_t i = 0; !atomic_load(&stop); i++) {
+        char name[BOX_NAME_SIZE];
+        box_name(name, (unsigned int)rand_r(&seed));
+        box_metadata_t *box = box_holder_find_box(&box_holder, name);
+        if (box != NULL) {
+            ALWAYS_ASSERT(strcmp(box->name, name) == 0 &&
+                              atomic_load(&box->refs) > 0,
+                          "Found %s instead of %s", box->name, name);
+            found++;
+        }
+        // Boxes stay usable while a reference is held, removed or not
+        box_metadata_t **slot = &held[i % HOLD_LOOKUPS];
+        if (*slot != NULL) {
+            ALWAYS_ASSERT(is_box_name((*slot)->name),
+                          "A box was freed while referenced");
+            box_metadata_put(*slot);
+        }
+        *slot = box;
+        if (i % 4 == 0) {
+            box_holder_for_each(&box_holder, check_box, NULL);
+        }
+    }
+    for (size_t i = 0; i < HOLD_LOOKUPS; i++) {
+        if (held[i] != NULL) {
+            box_metadata_put(held[i]);
+        }
+    }
+    return (void *)found;
+}
+
+static void *writer(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    for (int i = 0; i < CHANGES_PER_WRITER; i++) {
+        char name[BOX_NAME_SIZE];
+        box_name(name, (unsigned int)rand_r(&seed));
+        const char *error_msg;
+        if (rand_r(&seed) % 2 == 0) {
+            if (create_box_named(name, &error_msg) == 0) {
+                atomic_fetch_add(&created, 1);
+            } else {
+                ALWAYS_ASSERT(strcmp(error_msg, ERR_BOX_ALREADY_EXISTS) == 0,
+                              "Failed to create %s: %s", name, error_msg);
+            }
+        } else if (remove_box_named(name) == 0) {
+            atomic_fetch_add(&removed, 1);
+        }
+    }
+    return NULL;
+}
+
+int main(void) {
+    set_log_level(LOG_QUIET);
+    ALWAYS_ASSERT(tfs_init(NULL) != -1, "Failed to initialize TFS");
+    ALWAYS_ASSERT(box_holder_create(&box_holder, BOXES) == 0,
+                  "Failed to create box holder");
+
+    pthread_t readers[READERS];
+    pthread_t writers[WRITERS];
+    atomic_store(&stop, false);
+    for (size_t i = 0; i < READERS; i++) {
+        ALWAYS_ASSERT(
+            pthread_create(&readers[i], NULL, reader, (void *)(i + 1)) == 0,
+            "Failed to create reader");
+    }
+    for (size_t i = 0; i < WRITERS; i++) {
+        ALWAYS_ASSERT(pthread_create(&writers[i], NULL, writer,
+                                     (void *)(READERS + i + 1)) == 0,
+                      "Failed to create writer");
+    }
+    for (size_t i = 0; i < WRITERS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    atomic_store(&stop, true);
+    size_t found = 0;
+    for (size_t i = 0; i < READERS; i++) {
+        void *ret;
+        pthread_join(readers[i], &ret);
+        found += (size_t)ret;
+    }
+    printf("%zu boxes created and %zu removed while readers found %zu\n",
+           atomic_load(&created), atomic_load(&removed), found);
+
+    // Whatever is left goes, and the boxes no one references are reclaimed
+    for (unsigned int i = 0; i < BOXES; i++) {
+        char name[BOX_NAME_SIZE];
+        box_name(name, i);
+        if (remove_box_named(name) == 0) {
+            atomic_fetch_add(&removed, 1);
+        }
+        ALWAYS_ASSERT(box_holder_find_box(&box_holder, name) == NULL,
+                      "Found %s after it was removed", name);
+    }
+    ALWAYS_ASSERT(atomic_load(&created) == atomic_load(&removed),
+                  "%zu boxes created but %zu removed", atomic_load(&created),
+                  atomic_load(&removed));
+    epoch_enter();
+    epoch_exit();
+
+    const char *error_msg;
+    for (unsigned int i = 0; i < BOXES; i++) {
+        char name[BOX_NAME_SIZE];
+        box_name(name, i);
+        ALWAYS_ASSERT(create_box_named(name, &error_msg) == 0,
+                      "Failed to create %s again: %s", name, error_msg);
+    }
+    printf("removed every box and created them again\n");
+    ALWAYS_ASSERT(tfs_destroy() != -1, "Failed to destroy TFS");
+    return 0;
+}
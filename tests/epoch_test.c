@@ -0,0 +1,180 @@
+/**
+ * Epoch-based reclamation test.
+ *
+ * Objects are "destroyed" by marking them and keeping them around until the
+ * end, so a reader can look at an object it reached and check it was not
+ * destroyed while its read section still runs:
+ * - one reader stays inside a section while the object it reached is
+ *   retired, which must only be destroyed once the reader leaves;
+ * - readers keep reaching the current object while writers keep replacing
+ *   and retiring it, and none of them may ever see a destroyed one;
+ * - once every thread is done, everything retired is destroyed.
+ *
+ * usage: epoch_test
+ */
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "betterassert.h"
+#include "epoch.h"
+
+#define READERS 4
+#define WRITERS 2
+#define REPLACES_PER_WRITER 20000
+// Loads of the same object per read section
+#define READS_PER_SECTION 64
+
+typedef struct object_t {
+    atomic_bool destroyed;
+    struct object_t *next_destroyed;
+} object_t;
+
+static _Atomic(object_t *) current;
+static atomic_bool stop;
+
+// Destroyed objects, only freed at the end
+static pthread_mutex_t graveyard_lock = PTHREAD_MUTEX_INITIALIZER;
+static object_t *graveyard = NULL;
+static atomic_size_t created = 0;
+static atomic_size_t destroyed = 0;
+
+static object_t *object_create(void) {
+    object_t *obj = malloc(sizeof(object_t));
+    ALWAYS_ASSERT(obj != NULL, "Failed to alloc object");
+    atomic_init(&obj->destroyed, false);
+    atomic_fetch_add(&created, 1);
+    return obj;
+}
+
+static void object_destroy(void *ptr) {
+    object_t *obj = (object_t *)ptr;
+    ALWAYS_ASSERT(!atomic_exchange(&obj->destroyed, true),
+                  "Object destroyed twice");
+    atomic_fetch_add(&destroyed, 1);
+    pthread_mutex_lock(&graveyard_lock);
+    obj->next_destroyed = graveyard;
+    graveyard = obj;
+    pthread_mutex_unlock(&graveyard_lock);
+}
+
+// Runs reclamation from a thread outside any read section
+static void reclaim_now(void) {
+    epoch_enter();
+    epoch_exit();
+}
+
+static sem_t entered;
+static sem_t retired;
+
+static void *blocking_reader(void *arg) {
+    (void)arg;
+    epoch_enter();
+    object_t *obj = atomic_load(&current);
+    sem_post(&entered);
+    sem_wait(&retired);
+    // Nested sections don't end the outer one
+    epoch_enter();
+    epoch_exit();
+    ALWAYS_ASSERT(!atomic_load(&obj->destroyed),
+                  "Object destroyed inside a read section");
+    epoch_exit();
+    return NULL;
+}
+
+static void test_section(void) {
+    sem_init(&entered, 0, 0);
+    sem_init(&retired, 0, 0);
+    object_t *obj = object_create();
+    atomic_store(&current, obj);
+
+    pthread_t reader;
+    ALWAYS_ASSERT(pthread_create(&reader, NULL, blocking_reader, NULL) == 0,
+                  "Failed to create reader");
+    sem_wait(&entered);
+    atomic_store(&current, object_create());
+    epoch_retire(obj, object_destroy);
+    reclaim_now();
+    ALWAYS_ASSERT(!atomic_load(&obj->destroyed),
+                  "Object destroyed while a reader could see it");
+    sem_post(&retired);
+    pthread_join(reader, NULL);
+
+    reclaim_now();
+    ALWAYS_ASSERT(atomic_load(&obj->destroyed),
+                  "Object not destroyed once its readers left");
+    sem_destroy(&entered);
+    sem_destroy(&retired);
+    printf("kept an object for the reader inside a section\n");
+}
+
+static void *reader(void *arg) {
+    (void)arg;
+    size_t sections = 0;
+    while (!atomic_load(&stop)) {
+        epoch_enter();
+        object_t *obj = atomic_load(&current);
+        for (int i = 0; i < READS_PER_SECTION; i++) {
+            ALWAYS_ASSERT(!atomic_load(&obj->destroyed),
+                          "Reader saw a destroyed object");
+        }
+        epoch_exit();
+        sections++;
+    }
+    return (void *)sections;
+}
+
+static void *writer(void *arg) {
+    (void)arg;
+    for (int i = 0; i < REPLACES_PER_WRITER; i++) {
+        object_t *old = atomic_exchange(&current, object_create());
+        epoch_retire(old, object_destroy);
+    }
+    return NULL;
+}
+
+static void test_concurrent(void) {
+    pthread_t readers[READERS];
+    pthread_t writers[WRITERS];
+    atomic_store(&stop, false);
+    for (int i = 0; i < READERS; i++) {
+        ALWAYS_ASSERT(pthread_create(&readers[i], NULL, reader, NULL) == 0,
+                      "Failed to create reader");
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        ALWAYS_ASSERT(pthread_create(&writers[i], NULL, writer, NULL) == 0,
+                      "Failed to create writer");
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        pthread_join(writers[i], NULL);
+    }
+    atomic_store(&stop, true);
+    size_t sections = 0;
+    for (int i = 0; i < READERS; i++) {
+        void *ret;
+        pthread_join(readers[i], &ret);
+        sections += (size_t)ret;
+    }
+
+    epoch_retire(atomic_exchange(&current, NULL), object_destroy);
+    reclaim_now();
+    ALWAYS_ASSERT(atomic_load(&destroyed) == atomic_load(&created),
+                  "%zu objects retired but only %zu destroyed",
+                  atomic_load(&created), atomic_load(&destroyed));
+    printf("%d replaces against %zu read sections, all destroyed after\n",
+           WRITERS * REPLACES_PER_WRITER, sections);
+}
+
+int main(void) {
+    test_section();
+    test_concurrent();
+    while (graveyard != NULL) {
+        object_t *obj = graveyard;
+        graveyard = obj->next_destroyed;
+        free(obj);
+    }
+    return 0;
+}
@@ -0,0 +1,213 @@
+/**
+ * Object pool test.
+ *
+ * - Sizes: objects of every class and above are aligned like malloc, zeroed
+ *   when asked to, and the largest go straight to malloc.
+ * - Cross-thread: producers allocate and tag objects that consumers check
+ *   and free on other threads, the way requests go from the register pipe
+ *   reader to the workers. An object handed out twice shows up as a tag
+ *   overwritten by another producer, an id received twice or a free of an
+ *   object that was already free.
+ * - Steady state: a second round over the magazines left by the first must
+ *   barely call malloc, and every object allocated is freed by the end.
+ *
+ * usage: object_pool_test
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "betterassert.h"
+#include "object_pool.h"
+#include "producer-consumer.h"
+
+#define PRODUCERS 2
+#define CONSUMERS 2
+#define OBJECTS_PER_PRODUCER 100000
+#define OBJECTS (PRODUCERS * OBJECTS_PER_PRODUCER)
+#define QUEUE_CAPACITY 256
+#define MAX_OBJECT_SIZE 1024
+#define LARGE_OBJECT_SIZE 4096
+// Size classes and the header in front of every object
+#define POOL_CLASSES 8
+#define POOL_LARGEST_CLASS 2048
+#define POOL_HEADER_SIZE 16
+
+typedef enum { OBJECT_LIVE = 0x1111, OBJECT_FREE = 0xf4ee } object_state_e;
+
+typedef struct object_t {
+    atomic_uint state;
+    uint32_t id;
+    uint32_t size;
+    uint8_t pattern[];
+} object_t;
+
+static pc_queue_t queue;
+static atomic_uchar received[OBJECTS];
+
+static uint8_t pattern_byte(uint32_t id, size_t i) {
+    return (uint8_t)(id * 31 + i);
+}
+
+static void test_sizes(void) {
+    obj_pool_stats_t before = obj_pool_stats();
+    for (size_t size = 1; size <= LARGE_OBJECT_SIZE; size += 7) {
+        uint8_t *dirty = obj_pool_alloc(size);
+        ALWAYS_ASSERT(dirty != NULL, "Failed to alloc %zu bytes", size);
+        ALWAYS_ASSERT((uintptr_t)dirty % 16 == 0,
+                      "Object of %zu bytes is not 16-byte aligned", size);
+        memset(dirty, 0xff, size);
+        obj_pool_free(dirty);
+
+        // Likely gets the object just freed back
+        uint8_t *zeroed = obj_pool_calloc(size);
+        ALWAYS_ASSERT(zeroed != NULL, "Failed to calloc %zu bytes", size);
+        for (size_t i = 0; i < size; i++) {
+            ALWAYS_ASSERT(zeroed[i] == 0, "Object of %zu bytes not zeroed",
+                          size);
+        }
+        obj_pool_free(zeroed);
+    }
+    obj_pool_free(NULL);
+
+    obj_pool_stats_t after = obj_pool_stats();
+    ALWAYS_ASSERT(after.allocs - before.allocs ==
+                      after.frees - before.frees,
+                  "Objects allocated and freed don't match");
+    // Everything that fits a class comes back from the magazines, so only
+    // the first object of each class and the large ones need malloc
+    size_t large = 0;
+    for (size_t size = 1; size <= LARGE_OBJECT_SIZE; size += 7) {
+        large += size + POOL_HEADER_SIZE > POOL_LARGEST_CLASS ? 2 : 0;
+    }
+    ALWAYS_ASSERT(after.mallocs - before.mallocs <= large + POOL_CLASSES,
+                  "%lu mallocs for %zu large objects",
+                  (unsigned long)(after.mallocs - before.mallocs), large);
+    printf("aligned and zeroed objects of up to %d bytes\n",
+           LARGE_OBJECT_SIZE);
+}
+
+static void *producer(void *arg) {
+    uint32_t first_id = (uint32_t)(size_t)arg;
+    unsigned int seed = first_id + 1;
+    for (uint32_t id = first_id; id < first_id + OBJECTS_PER_PRODUCER;
+         id++) {
+        size_t size = sizeof(object_t) +
+                      (size_t)rand_r(&seed) % (MAX_OBJECT_SIZE -
+                                               sizeof(object_t));
+        object_t *obj = obj_pool_alloc(size);
+        ALWAYS_ASSERT(obj != NULL, "Failed to alloc object %u", id);
+        atomic_store(&obj->state, OBJECT_LIVE);
+        obj->id = id;
+        obj->size = (uint32_t)size;
+        for (size_t i = 0; i < size - sizeof(object_t); i++) {
+            obj->pattern[i] = pattern_byte(id, i);
+        }
+        ALWAYS_ASSERT(pcq_enqueue(&queue, obj) == 0, "Failed to enqueue");
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    (void)arg;
+    object_t *obj;
+    while ((obj = pcq_dequeue(&queue)) != NULL) {
+        uint32_t id = obj->id;
+        ALWAYS_ASSERT(id < OBJECTS, "Object with a broken id %u", id);
+        for (size_t i = 0; i < obj->size - sizeof(object_t); i++) {
+            ALWAYS_ASSERT(obj->pattern[i] == pattern_byte(id, i),
+                          "Object %u changed while live", id);
+        }
+        ALWAYS_ASSERT(atomic_exchange(&received[id], 1) == 0,
+                      "Object %u received twice", id);
+        ALWAYS_ASSERT(atomic_exchange(&obj->state, OBJECT_FREE) ==
+                          OBJECT_LIVE,
+                      "Object %u freed twice", id);
+        obj_pool_free(obj);
+    }
+    return NULL;
+}
+
+// Runs a round of producers and consumers, returning the stats it added
+static obj_pool_stats_t run_round(void) {
+    obj_pool_stats_t before = obj_pool_stats();
+    for (size_t i = 0; i < OBJECTS; i++) {
+        atomic_store(&received[i], 0);
+    }
+    ALWAYS_ASSERT(pcq_create(&queue, QUEUE_CAPACITY) == 0,
+                  "Failed to create queue");
+
+    pthread_t producers[PRODUCERS];
+    pthread_t consumers[CONSUMERS];
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        ALWAYS_ASSERT(pthread_create(&consumers[i], NULL, consumer, NULL) ==
+                          0,
+                      "Failed to create consumer");
+    }
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        ALWAYS_ASSERT(
+            pthread_create(&producers[i], NULL, producer,
+                           (void *)(i * OBJECTS_PER_PRODUCER)) == 0,
+            "Failed to create producer");
+    }
+    for (size_t i = 0; i < PRODUCERS; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    // One NULL per consumer tells it there is nothing else coming
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        ALWAYS_ASSERT(pcq_enqueue(&queue, NULL) == 0, "Failed to enqueue");
+    }
+    for (size_t i = 0; i < CONSUMERS; i++) {
+        pthread_join(consumers[i], NULL);
+    }
+    pcq_destroy(&queue);
+
+    for (size_t i = 0; i < OBJECTS; i++) {
+        ALWAYS_ASSERT(atomic_load(&received[i]) == 1,
+                      "Object %zu never received", i);
+    }
+    obj_pool_stats_t after = obj_pool_stats();
+    obj_pool_stats_t round = {
+        .allocs = after.allocs - before.allocs,
+        .frees = after.frees - before.frees,
+        .mallocs = after.mallocs - before.mallocs,
+        .depot_exchanges = after.depot_exchanges - before.depot_exchanges,
+    };
+    ALWAYS_ASSERT(round.allocs == OBJECTS && round.frees == OBJECTS,
+                  "%lu objects allocated and %lu freed out of %d",
+                  (unsigned long)round.allocs, (unsigned long)round.frees,
+                  OBJECTS);
+    return round;
+}
+
+static void test_cross_thread(void) {
+    obj_pool_stats_t first = run_round();
+    printf("first round: %d objects across threads, %lu mallocs, %lu depot "
+           "exchanges\n",
+           OBJECTS, (unsigned long)first.mallocs,
+           (unsigned long)first.depot_exchanges);
+
+    obj_pool_stats_t second = run_round();
+    ALWAYS_ASSERT(second.mallocs * 100 < second.allocs,
+                  "Steady state made %lu mallocs for %lu allocs",
+                  (unsigned long)second.mallocs,
+                  (unsigned long)second.allocs);
+    printf("second round: %d objects across threads, %lu mallocs, %lu depot "
+           "exchanges\n",
+           OBJECTS, (unsigned long)second.mallocs,
+           (unsigned long)second.depot_exchanges);
+}
+
+int main(void) {
+    test_sizes();
+    test_cross_thread();
+    obj_pool_stats_t stats = obj_pool_stats();
+    ALWAYS_ASSERT(stats.allocs == stats.frees,
+                  "%lu objects allocated but %lu freed",
+                  (unsigned long)stats.allocs, (unsigned long)stats.frees);
+    return 0;
+}
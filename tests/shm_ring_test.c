@@ -0,0 +1,151 @@
+/**
+ * Shared memory ring consumer test.
+ *
+ * Attaches to a ring this process created, like the mbroker does with the
+ * rings of publishers, and checks that the consumer gets well-formed
+ * messages back and refuses records a hostile producer could write: a head
+ * more than a lap ahead, lengths above what push accepts, records running
+ * past the end of the data and a tail that is not on a record. Also checks
+ * that a producer whose ring is turned down stops waiting for a consumer.
+ *
+ * usage: shm_ring_test
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "betterassert.h"
+#include "shm_ring.h"
+
+typedef struct rings_t {
+    shm_ring_t producer;
+    shm_ring_t consumer;
+} rings_t;
+
+static void open_rings(rings_t *rings) {
+    char name[RING_NAME_SIZE];
+    snprintf(name, sizeof(name), "/mbroker-ring-test-%d", getpid());
+    ALWAYS_ASSERT(shm_ring_create(&rings->producer, name, RING_MIN_CAPACITY) ==
+                      0,
+                  "Failed to create ring %s", name);
+    ALWAYS_ASSERT(shm_ring_attach(&rings->consumer, name) == 0,
+                  "Failed to attach to ring %s", name);
+    ALWAYS_ASSERT(shm_ring_wait_attached(&rings->producer, 0) == 0,
+                  "Consumer did not attach");
+}
+
+static void close_rings(rings_t *rings) {
+    shm_ring_destroy(&rings->consumer);
+    shm_ring_destroy(&rings->producer);
+}
+
+// Writes a record as a producer that does not go through push would
+static void write_record(rings_t *rings, uint64_t pos, uint32_t len,
+                         uint64_t head) {
+    shm_ring_t *ring = &rings->producer;
+    memcpy(ring->data + (pos & ring->mask), &len, sizeof(len));
+    atomic_store(&ring->header->head, head);
+}
+
+static void expect_corrupt(rings_t *rings, const char *what) {
+    const void *msg;
+    size_t len;
+    errno = 0;
+    ALWAYS_ASSERT(shm_ring_front(&rings->consumer, &msg, &len) == -1 &&
+                      errno == EPROTO,
+                  "Accepted a ring with %s", what);
+    printf("refused %s\n", what);
+}
+
+static void test_messages(void) {
+    rings_t rings;
+    open_rings(&rings);
+    size_t capacity = rings.consumer.mask + 1;
+    char msg[256];
+    memset(msg, 'm', sizeof(msg));
+
+    // Enough laps for messages to skip the end of the data
+    for (size_t i = 0; i < 4 * capacity / sizeof(msg); i++) {
+        size_t len = i % sizeof(msg);
+        ALWAYS_ASSERT(shm_ring_push(&rings.producer, msg, len) == 0,
+                      "Failed to push message %zu", i);
+        const void *front;
+        size_t front_len;
+        ALWAYS_ASSERT(shm_ring_front(&rings.consumer, &front, &front_len) ==
+                          1,
+                      "Lost message %zu", i);
+        ALWAYS_ASSERT(front_len == len && memcmp(front, msg, len) == 0,
+                      "Message %zu changed", i);
+        shm_ring_pop(&rings.consumer, front_len);
+    }
+    const void *front;
+    size_t front_len;
+    ALWAYS_ASSERT(shm_ring_front(&rings.consumer, &front, &front_len) == 0,
+                  "Ring not empty after every message was popped");
+    close_rings(&rings);
+    printf("read back every message\n");
+}
+
+static void test_corrupt(void) {
+    rings_t rings;
+    uint32_t capacity = RING_MIN_CAPACITY;
+
+    open_rings(&rings);
+    write_record(&rings, 0, 8, capacity + 16);
+    expect_corrupt(&rings, "a head more than a lap ahead");
+    close_rings(&rings);
+
+    open_rings(&rings);
+    write_record(&rings, 0, capacity / 4, capacity);
+    expect_corrupt(&rings, "a message above a quarter of the ring");
+    close_rings(&rings);
+
+    open_rings(&rings);
+    write_record(&rings, 0, UINT32_MAX - 1, capacity);
+    expect_corrupt(&rings, "a message longer than the ring");
+    close_rings(&rings);
+
+    // A record near the end must fit before it, or a copy of it would read
+    // past the mapping
+    open_rings(&rings);
+    rings.consumer.pos = capacity - 8;
+    write_record(&rings, capacity - 8, 64, capacity + 64);
+    expect_corrupt(&rings, "a message running past the end");
+    close_rings(&rings);
+
+    open_rings(&rings);
+    rings.consumer.pos = capacity - 2;
+    atomic_store(&rings.producer.header->head, capacity);
+    expect_corrupt(&rings, "a length running past the end");
+    close_rings(&rings);
+
+    open_rings(&rings);
+    write_record(&rings, 0, 64, 8);
+    expect_corrupt(&rings, "a message past the head");
+    close_rings(&rings);
+}
+
+static void test_refuse(void) {
+    shm_ring_t producer;
+    char name[RING_NAME_SIZE];
+    snprintf(name, sizeof(name), "/mbroker-ring-test-%d", getpid());
+    ALWAYS_ASSERT(shm_ring_create(&producer, name, RING_MIN_CAPACITY) == 0,
+                  "Failed to create ring %s", name);
+    ALWAYS_ASSERT(shm_ring_refuse(name) == 0, "Failed to refuse ring %s",
+                  name);
+    // Would wait for a whole minute if the refusal went unnoticed
+    ALWAYS_ASSERT(shm_ring_wait_attached(&producer, 60 * 1000) == -1,
+                  "Producer attached to a refused ring");
+    ALWAYS_ASSERT(atomic_load(&producer.header->state) == RING_DETACHED,
+                  "Refused ring is not detached");
+    shm_ring_destroy(&producer);
+    printf("refused ring offer\n");
+}
+
+int main(void) {
+    test_messages();
+    test_corrupt();
+    test_refuse();
+    return 0;
+}
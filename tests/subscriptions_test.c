@@ -0,0 +1,116 @@
+/**
+ * Subscriptions test.
+ *
+ * - Cancel: a subscription created for a session that never ran goes away,
+ *   so the next session under its name starts where it asks to instead of
+ *   where the cancelled one would have.
+ * - Shared: a subscription another session opened since it was created is
+ *   kept, and so is one that existed before.
+ * - Room: every subscription that fits in the file can be created, and the
+ *   room of a cancelled one is taken again.
+ *
+ * usage: subscriptions_test
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "betterassert.h"
+#include "mbroker/subscriptions.h"
+#include "operations.h"
+
+#define BOX_NAME "/subs"
+#define BOX_CAPACITY 1024
+
+static ssize_t open_at(subscriptions_t *subs, const char *name, size_t at,
+                       size_t *offset, bool *created) {
+    *offset = at;
+    return subscriptions_open(subs, name, offset, created);
+}
+
+static void test_cancel(subscriptions_t *subs) {
+    size_t offset;
+    bool created;
+    ssize_t sub = open_at(subs, "cancelled", 100, &offset, &created);
+    ALWAYS_ASSERT(sub != -1 && created && offset == 100,
+                  "Failed to create a subscription");
+    subscriptions_cancel(subs, (size_t)sub, created);
+
+    sub = open_at(subs, "cancelled", 200, &offset, &created);
+    ALWAYS_ASSERT(sub != -1 && created,
+                  "A cancelled subscription was still there");
+    ALWAYS_ASSERT(offset == 200,
+                  "Started at %zu, where the cancelled session would have",
+                  offset);
+    // Runs, so it stays
+    subscriptions_update(subs, (size_t)sub, 300, true);
+    printf("a cancelled subscription went away\n");
+}
+
+static void test_shared(subscriptions_t *subs) {
+    size_t offset;
+    bool created;
+    bool other_created;
+    ssize_t sub = open_at(subs, "shared", 0, &offset, &created);
+    ssize_t other = open_at(subs, "shared", 0, &offset, &other_created);
+    ALWAYS_ASSERT(sub == other && created && !other_created,
+                  "Two sessions did not share a subscription");
+    subscriptions_cancel(subs, (size_t)sub, created);
+    subscriptions_update(subs, (size_t)other, 50, true);
+
+    sub = open_at(subs, "shared", 0, &offset, &created);
+    ALWAYS_ASSERT(sub == other && !created && offset == 50,
+                  "A subscription opened by another session went away");
+    subscriptions_cancel(subs, (size_t)sub, created);
+
+    // Created by test_cancel
+    sub = open_at(subs, "cancelled", 0, &offset, &created);
+    ALWAYS_ASSERT(!created && offset == 300,
+                  "A subscription that existed was created again");
+    subscriptions_cancel(subs, (size_t)sub, created);
+    sub = open_at(subs, "cancelled", 0, &offset, &created);
+    ALWAYS_ASSERT(!created && offset == 300,
+                  "Cancelling a session removed a subscription that existed");
+    printf("subscriptions opened by other sessions were kept\n");
+}
+
+static void test_room(subscriptions_t *subs) {
+    size_t offset;
+    bool created;
+    size_t fit = BOX_CAPACITY / sizeof(subscription_t);
+    // Two are taken by the other tests
+    ssize_t middle = -1;
+    for (size_t i = 2; i < fit; i++) {
+        char name[SUBSCRIPTION_NAME_SIZE];
+        snprintf(name, sizeof(name), "room-%zu", i);
+        ssize_t sub = open_at(subs, name, i, &offset, &created);
+        ALWAYS_ASSERT(sub != -1 && created, "No room for subscription %zu",
+                      i);
+        if (i == fit / 2) {
+            middle = sub;
+        }
+    }
+    ALWAYS_ASSERT(open_at(subs, "too-many", 0, &offset, &created) == -1,
+                  "More than %zu subscriptions fit", fit);
+
+    subscriptions_cancel(subs, (size_t)middle, true);
+    ALWAYS_ASSERT(open_at(subs, "room-again", 0, &offset, &created) ==
+                          middle &&
+                      created,
+                  "The room of a cancelled subscription was not taken again");
+    printf("%zu subscriptions fit, and cancelled ones are taken again\n",
+           fit);
+}
+
+int main(void) {
+    set_log_level(LOG_QUIET);
+    ALWAYS_ASSERT(tfs_init(NULL) != -1, "Failed to initialize TFS");
+    subscriptions_t subs;
+    subscriptions_init(&subs, BOX_NAME, BOX_CAPACITY);
+    test_cancel(&subs);
+    test_shared(&subs);
+    test_room(&subs);
+    subscriptions_destroy(&subs);
+    ALWAYS_ASSERT(tfs_destroy() != -1, "Failed to destroy TFS");
+    return 0;
+}
@@ -0,0 +1,164 @@
+/**
+ * Work-stealing scheduler test.
+ *
+ * - Lanes: a single worker takes what was queued in the order the priority
+ *   policy asks for, strict or weighted.
+ * - Stealing: the owner thread queues requests into shallow lanes, so it
+ *   keeps sleeping on full lanes, with affinities that leave some deques
+ *   empty. Workers must steal the rest, racing each other for the top of
+ *   the same deques, and every request must be taken exactly once.
+ * - Leftovers: requests never taken are handed back by ws_destroy.
+ *
+ * usage: work_stealing_test
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "betterassert.h"
+#include "work-stealing.h"
+
+#define WORKERS 4
+#define REQUESTS 200000
+#define LANE_DEPTH 16
+// Affinities used, fewer than workers so some deques only get stolen from
+#define AFFINITIES 3
+
+typedef struct request_t {
+    ws_lane_e lane;
+    atomic_uint taken;
+} request_t;
+
+static request_t requests[REQUESTS];
+static atomic_size_t released = 0;
+
+static void release(void *elem) {
+    (void)elem;
+    atomic_fetch_add(&released, 1);
+}
+
+static ws_scheduler_t *create(size_t n_workers, size_t depth,
+                              unsigned int control_weight) {
+    static ws_scheduler_t scheduler;
+    size_t lane_depth[WS_LANES] = {depth, depth};
+    ALWAYS_ASSERT(ws_create(&scheduler, n_workers, lane_depth,
+                            control_weight) == 0,
+                  "Failed to create scheduler");
+    return &scheduler;
+}
+
+// Queues 4 control and 4 session requests, then checks the lane of each
+// request a single worker takes
+static void check_order(unsigned int control_weight, const char *expected) {
+    ws_scheduler_t *scheduler = create(1, 8, control_weight);
+    for (size_t i = 0; i < 8; i++) {
+        request_t *r = &requests[i];
+        r->lane = i < 4 ? WS_LANE_CONTROL : WS_LANE_SESSION;
+        ALWAYS_ASSERT(ws_submit(scheduler, r, r->lane, WS_ANY_WORKER) == 0,
+                      "Failed to submit request");
+    }
+    ws_worker_t worker = {.scheduler = scheduler, .id = 0};
+    char order[9] = {0};
+    for (size_t i = 0; i < 8; i++) {
+        request_t *r = ws_take(&worker);
+        order[i] = r->lane == WS_LANE_CONTROL ? 'c' : 's';
+    }
+    ALWAYS_ASSERT(strcmp(order, expected) == 0,
+                  "Took %s with control weight %u instead of %s", order,
+                  control_weight, expected);
+    ws_destroy(scheduler, release);
+    printf("took %s with control weight %u\n", order, control_weight);
+}
+
+static void *worker_thread(void *arg) {
+    ws_worker_t *worker = (ws_worker_t *)arg;
+    size_t taken = 0;
+    request_t *r;
+    while ((r = ws_take(worker)) != NULL) {
+        ALWAYS_ASSERT(atomic_fetch_add(&r->taken, 1) == 0,
+                      "Request %td taken twice", r - requests);
+        taken++;
+    }
+    return (void *)taken;
+}
+
+static void test_stealing(void) {
+    ws_scheduler_t *scheduler =
+        create(WORKERS, LANE_DEPTH, WS_STRICT_PRIORITY);
+    pthread_t threads[WORKERS];
+    ws_worker_t workers[WORKERS];
+    for (size_t i = 0; i < WORKERS; i++) {
+        workers[i] = (ws_worker_t){.scheduler = scheduler, .id = i};
+        ALWAYS_ASSERT(pthread_create(&threads[i], NULL, worker_thread,
+                                     &workers[i]) == 0,
+                      "Failed to create worker");
+    }
+
+    for (size_t i = 0; i < REQUESTS; i++) {
+        request_t *r = &requests[i];
+        atomic_init(&r->taken, 0);
+        r->lane = i % 2 == 0 ? WS_LANE_CONTROL : WS_LANE_SESSION;
+        uint64_t affinity = i % 8 == 0 ? WS_ANY_WORKER : i % AFFINITIES;
+        ALWAYS_ASSERT(ws_submit(scheduler, r, r->lane, affinity) == 0,
+                      "Failed to submit request %zu", i);
+    }
+    // Every request queued was counted by the semaphore workers sleep on, so
+    // they take them all before seeing the shutdown
+    size_t left = REQUESTS;
+    while (left > 0) {
+        left = 0;
+        for (size_t l = 0; l < WS_LANES; l++) {
+            left += atomic_load(&scheduler->lanes[l].depth);
+        }
+    }
+    ws_shutdown(scheduler);
+
+    size_t taken[WORKERS];
+    size_t total = 0;
+    for (size_t i = 0; i < WORKERS; i++) {
+        void *ret;
+        pthread_join(threads[i], &ret);
+        taken[i] = (size_t)ret;
+        total += taken[i];
+    }
+    for (size_t i = 0; i < REQUESTS; i++) {
+        ALWAYS_ASSERT(atomic_load(&requests[i].taken) == 1,
+                      "Request %zu never taken", i);
+    }
+    ALWAYS_ASSERT(total == REQUESTS, "Took %zu of %d requests", total,
+                  REQUESTS);
+    // Worker 3 has no affinity of its own: it only gets round-robin requests
+    // and whatever it steals
+    printf("%d requests taken once, by worker: %zu %zu %zu %zu\n", REQUESTS,
+           taken[0], taken[1], taken[2], taken[3]);
+    ws_destroy(scheduler, release);
+}
+
+static void test_leftovers(void) {
+    atomic_store(&released, 0);
+    ws_scheduler_t *scheduler = create(WORKERS, LANE_DEPTH, 2);
+    for (size_t i = 0; i < LANE_DEPTH; i++) {
+        ALWAYS_ASSERT(ws_submit(scheduler, &requests[i], WS_LANE_SESSION,
+                                i % AFFINITIES) == 0,
+                      "Failed to submit request %zu", i);
+    }
+    ws_worker_t worker = {.scheduler = scheduler, .id = 0};
+    ALWAYS_ASSERT(ws_take(&worker) != NULL, "Took no request");
+    ws_destroy(scheduler, release);
+    ALWAYS_ASSERT(atomic_load(&released) == LANE_DEPTH - 1,
+                  "Released %zu of %d requests left",
+                  atomic_load(&released), LANE_DEPTH - 1);
+    printf("released the %d requests never taken\n", LANE_DEPTH - 1);
+}
+
+int main(void) {
+    set_log_level(LOG_QUIET);
+    check_order(WS_STRICT_PRIORITY, "ccccssss");
+    check_order(2, "ccsccsss");
+    test_stealing();
+    test_leftovers();
+    return 0;
+}
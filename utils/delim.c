@@ -0,0 +1,141 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "delim.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define DELIM_X86 1
+#else
+#define DELIM_X86 0
+#endif
+
+// Emits the offsets of the bytes set in a mask of zero bytes, starting at
+// `base`. Returns the new count of ends.
+static inline size_t emit_mask(uint64_t mask, size_t base, size_t *ends,
+                               size_t count, size_t max) {
+    while (mask != 0 && count < max) {
+        ends[count++] = base + (size_t)__builtin_ctzll(mask);
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+static size_t scan_tail(const char *data, size_t i, size_t len, size_t *ends,
+                        size_t count, size_t max) {
+    for (; i < len && count < max; i++) {
+        if (data[i] == '\0') {
+            ends[count++] = i;
+        }
+    }
+    return count;
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// One word at a time: a word without a zero byte is skipped with a few
+// arithmetic operations, and only words with one are looked at byte by byte
+static size_t scan_scalar(const char *data, size_t len, size_t *ends,
+                          size_t max) {
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len && count < max;
+         i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (((word - ONES) & ~word & HIGHS) != 0) {
+            count = scan_tail(data, i, i + sizeof(uint64_t), ends, count, max);
+        }
+    }
+    return scan_tail(data, i, len, ends, count, max);
+}
+
+#if DELIM_X86
+static size_t scan_sse2(const char *data, size_t len, size_t *ends,
+                        size_t max) {
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= len && count < max; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        uint64_t mask =
+            (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, zero));
+        count = emit_mask(mask, i, ends, count, max);
+    }
+    return scan_tail(data, i, len, ends, count, max);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_avx2(const char *data, size_t len, size_t *ends, size_t max) {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    size_t i = 0;
+    // Two vectors per iteration, since delimiters are sparse
+    for (; i + 64 <= len && count < max; i += 64) {
+        __m256i low = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i high = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        uint64_t mask =
+            (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(low, zero)) |
+            (uint64_t)(uint32_t)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(high, zero))
+                << 32;
+        count = emit_mask(mask, i, ends, count, max);
+    }
+    for (; i + 32 <= len && count < max; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(bytes, zero));
+        count = emit_mask(mask, i, ends, count, max);
+    }
+    return scan_tail(data, i, len, ends, count, max);
+}
+#endif
+
+typedef struct kernel_t {
+    const char *name;
+    delim_scan_fn scan;
+} kernel_t;
+
+static kernel_t best = {"scalar", scan_scalar};
+static pthread_once_t best_once = PTHREAD_ONCE_INIT;
+
+static void pick_best(void) {
+#if DELIM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        best = (kernel_t){"avx2", scan_avx2};
+    } else {
+        // Every x86-64 CPU has SSE2
+        best = (kernel_t){"sse2", scan_sse2};
+    }
+#endif
+}
+
+size_t delim_scan(const char *data, size_t len, size_t *ends, size_t max) {
+    pthread_once(&best_once, pick_best);
+    return best.scan(data, len, ends, max);
+}
+
+delim_scan_fn delim_kernel(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        return scan_scalar;
+    }
+#if DELIM_X86
+    if (strcmp(name, "sse2") == 0) {
+        return scan_sse2;
+    }
+    if (strcmp(name, "avx2") == 0) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? scan_avx2 : NULL;
+    }
+#endif
+    return NULL;
+}
+
+const char *delim_kernel_name(void) {
+    pthread_once(&best_once, pick_best);
+    return best.name;
+}
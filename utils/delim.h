@@ -0,0 +1,46 @@
+#ifndef __UTILS_DELIM_H__
+#define __UTILS_DELIM_H__
+
+#include <stddef.h>
+
+/**
+ * Finds the \0 that end the messages of a box, many bytes at a time.
+ *
+ * Boxes keep their messages back to back, each one followed by a \0, so
+ * replaying a box or indexing it means finding every delimiter. The kernels
+ * compare 32 (AVX2), 16 (SSE2) or 8 (scalar, one word at a time) bytes at
+ * once and only look at single bytes around the delimiters they find. The
+ * best kernel the CPU supports is picked the first time @link delim_scan
+ * runs.
+ */
+
+/**
+ * @brief Finds where the first delimiters of some bytes are
+ *
+ * @param data the bytes
+ * @param len how many there are
+ * @param ends where the offsets of the delimiters, from data, are stored
+ * @param max how many offsets fit in ends
+ * @return size_t how many delimiters were found, at most max
+ */
+size_t delim_scan(const char *data, size_t len, size_t *ends, size_t max);
+
+typedef size_t (*delim_scan_fn)(const char *data, size_t len, size_t *ends,
+                                size_t max);
+
+/**
+ * @brief Finds a kernel by name ("scalar", "sse2" or "avx2"), to compare them
+ *
+ * @param name the kernel
+ * @return delim_scan_fn the kernel, or NULL if the CPU does not support it
+ */
+delim_scan_fn delim_kernel(const char *name);
+
+/**
+ * @brief Tells which kernel @link delim_scan uses
+ *
+ * @return const char* the name of the kernel
+ */
+const char *delim_kernel_name(void);
+
+#endif // __UTILS_DELIM_H__
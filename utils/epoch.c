@@ -0,0 +1,155 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "betterassert.h"
+#include "epoch.h"
+
+// Epoch published by a thread outside of any read section
+#define EPOCH_QUIESCENT 0
+
+// One per thread that ever read. Records are never freed: an exiting thread
+// gives its record up for the next thread to reuse.
+typedef struct epoch_record_t {
+    _Atomic uint64_t epoch;
+    atomic_bool in_use;
+    struct epoch_record_t *next;
+} epoch_record_t;
+
+// An object waiting for the readers that may still see it
+typedef struct retired_t {
+    void *ptr;
+    void (*destroy)(void *);
+    // Epoch at which the object was unlinked
+    uint64_t epoch;
+    struct retired_t *next;
+} retired_t;
+
+static _Atomic uint64_t global_epoch = EPOCH_QUIESCENT + 1;
+static _Atomic(epoch_record_t *) records = NULL;
+
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired_t *retired = NULL;
+static atomic_size_t retired_count = 0;
+
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+
+static _Thread_local epoch_record_t *record = NULL;
+static _Thread_local unsigned int nesting = 0;
+
+static void release_record(void *ptr) {
+    epoch_record_t *r = (epoch_record_t *)ptr;
+    atomic_store(&r->epoch, EPOCH_QUIESCENT);
+    atomic_store(&r->in_use, false);
+}
+
+static void create_record_key(void) {
+    pthread_key_create(&record_key, release_record);
+}
+
+static epoch_record_t *acquire_record(void) {
+    pthread_once(&record_key_once, create_record_key);
+
+    epoch_record_t *r = atomic_load(&records);
+    for (; r != NULL; r = r->next) {
+        bool free_record = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &free_record, true)) {
+            break;
+        }
+    }
+    if (r == NULL) {
+        r = malloc(sizeof(epoch_record_t));
+        ALWAYS_ASSERT(r != NULL, "Failed to alloc epoch record");
+        atomic_init(&r->epoch, EPOCH_QUIESCENT);
+        atomic_init(&r->in_use, true);
+        r->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &r->next, r)) {
+        }
+    }
+    // Gives the record back when the thread exits
+    pthread_setspecific(record_key, r);
+    return r;
+}
+
+// Destroys the retired objects no reader can see anymore: the ones unlinked
+// before the oldest read section still running started
+static void reclaim(void) {
+    if (pthread_mutex_trylock(&retired_lock) != 0) {
+        return; // Someone else is at it
+    }
+    uint64_t oldest = UINT64_MAX;
+    for (epoch_record_t *r = atomic_load(&records); r != NULL; r = r->next) {
+        uint64_t epoch = atomic_load(&r->epoch);
+        if (epoch != EPOCH_QUIESCENT && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    retired_t *keep = NULL;
+    retired_t *done = NULL;
+    while (retired != NULL) {
+        retired_t *item = retired;
+        retired = item->next;
+        retired_t **list = item->epoch < oldest ? &done : &keep;
+        item->next = *list;
+        *list = item;
+    }
+    retired = keep;
+    pthread_mutex_unlock(&retired_lock);
+
+    while (done != NULL) {
+        retired_t *item = done;
+        done = item->next;
+        item->destroy(item->ptr);
+        free(item);
+        atomic_fetch_sub(&retired_count, 1);
+    }
+}
+
+void epoch_enter(void) {
+    if (nesting++ > 0) {
+        return;
+    }
+    if (record == NULL) {
+        record = acquire_record();
+    }
+    // The store is ordered before every load of the structure, so a writer
+    // that does not see it yet unlinked its object before we could look
+    atomic_store(&record->epoch, atomic_load(&global_epoch));
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void) {
+    ALWAYS_ASSERT(nesting > 0, "epoch_exit without epoch_enter");
+    if (--nesting > 0) {
+        return;
+    }
+    atomic_store_explicit(&record->epoch, EPOCH_QUIESCENT,
+                          memory_order_release);
+    if (atomic_load_explicit(&retired_count, memory_order_relaxed) > 0) {
+        reclaim();
+    }
+}
+
+void epoch_retire(void *ptr, void (*destroy)(void *)) {
+    retired_t *item = malloc(sizeof(retired_t));
+    ALWAYS_ASSERT(item != NULL, "Failed to alloc retired object");
+    item->ptr = ptr;
+    item->destroy = destroy;
+    // Readers that enter from now on see the next epoch, and can't reach the
+    // object anymore
+    item->epoch = atomic_fetch_add(&global_epoch, 1);
+
+    pthread_mutex_lock(&retired_lock);
+    item->next = retired;
+    retired = item;
+    atomic_fetch_add(&retired_count, 1);
+    pthread_mutex_unlock(&retired_lock);
+
+    if (nesting == 0) {
+        reclaim();
+    }
+}
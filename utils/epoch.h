@@ -0,0 +1,35 @@
+#ifndef __UTILS_EPOCH_H__
+#define __UTILS_EPOCH_H__
+
+/**
+ * Epoch-based reclamation, for structures that are read without locks.
+ *
+ * Readers wrap every access to the shared structure in @link epoch_enter and
+ * @link epoch_exit, which only publish the current epoch in a per-thread
+ * record. Writers unlink an object first and then @link epoch_retire it: it
+ * is destroyed once every thread that could still be looking at it has left
+ * its read section.
+ *
+ * Read sections may nest and may block, which only delays reclamation.
+ */
+
+/**
+ * @brief Starts a read section in the calling thread
+ */
+void epoch_enter(void);
+
+/**
+ * @brief Ends the read section started by the matching @link epoch_enter
+ */
+void epoch_exit(void);
+
+/**
+ * @brief Destroys an object once no read section can still reach it. The
+ * object must already be unreachable for new readers.
+ *
+ * @param ptr the object
+ * @param destroy called with the object to destroy it
+ */
+void epoch_retire(void *ptr, void (*destroy)(void *));
+
+#endif // __UTILS_EPOCH_H__
@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "logging.h"
+
+void histogram_reset(histogram_t *histogram) {
+    memset(histogram, 0, sizeof(histogram_t));
+}
+
+void histogram_add(histogram_t *histogram, uint64_t value) {
+    size_t bucket = 0;
+    while (bucket < HISTOGRAM_BUCKETS - 1 && (value >> bucket) != 0) {
+        bucket++;
+    }
+    histogram->buckets[bucket]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+void histogram_log(const histogram_t *histogram, const char *name) {
+    char line[1024];
+    size_t len = 0;
+    double avg = histogram->count > 0 ? (double)histogram->sum /
+                                            (double)histogram->count
+                                      : 0.0;
+    int ret = snprintf(line, sizeof(line), "%s: %lu samples, avg %.1f, max %lu",
+                       name, histogram->count, avg, histogram->max);
+    len = ret > 0 ? (size_t)ret : 0;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS && len < sizeof(line); i++) {
+        if (histogram->buckets[i] == 0) {
+            continue;
+        }
+        uint64_t low = i == 0 ? 0 : (uint64_t)1 << (i - 1);
+        uint64_t high = i == 0 ? 0 : ((uint64_t)1 << i) - 1;
+        if (low == high) {
+            ret = snprintf(line + len, sizeof(line) - len, " | %lu: %lu", low,
+                           histogram->buckets[i]);
+        } else {
+            ret = snprintf(line + len, sizeof(line) - len, " | %lu-%lu: %lu",
+                           low, high, histogram->buckets[i]);
+        }
+        len += ret > 0 ? (size_t)ret : 0;
+    }
+    LOG("%s", line);
+}
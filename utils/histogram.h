@@ -0,0 +1,44 @@
+#ifndef __UTILS_HISTOGRAM_H__
+#define __UTILS_HISTOGRAM_H__
+
+#include <stdint.h>
+
+#define HISTOGRAM_BUCKETS 24
+
+/**
+ * Histogram with power-of-two buckets: bucket 0 counts zeros and bucket `i`
+ * counts the values in [2^(i-1), 2^i). Not thread-safe, meant to be kept by a
+ * single thread (e.g. one per session) and logged at the end.
+ */
+typedef struct histogram_t {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+/**
+ * @brief Empties a histogram
+ *
+ * @param histogram the histogram
+ */
+void histogram_reset(histogram_t *histogram);
+
+/**
+ * @brief Adds a value to a histogram
+ *
+ * @param histogram the histogram
+ * @param value the value
+ */
+void histogram_add(histogram_t *histogram, uint64_t value);
+
+/**
+ * @brief Logs the count, average, maximum and every non-empty bucket of a
+ * histogram in a single line
+ *
+ * @param histogram the histogram
+ * @param name what the values are, printed first
+ */
+void histogram_log(const histogram_t *histogram, const char *name);
+
+#endif // __UTILS_HISTOGRAM_H__
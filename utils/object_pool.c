@@ -0,0 +1,233 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "object_pool.h"
+
+#define OBJ_POOL_MIN_SIZE 16
+#define OBJ_POOL_CLASSES 8 // 16 bytes up to 2 KiB
+#define OBJ_POOL_LARGE OBJ_POOL_CLASSES
+#define OBJ_POOL_MAGAZINE_SIZE 32
+
+// Sits right before every object and remembers its size class. Two words
+// keep the objects 16-byte aligned, like malloc.
+typedef struct obj_header_t {
+    size_t size_class;
+    size_t unused;
+} obj_header_t;
+
+typedef struct magazine_t {
+    struct magazine_t *next;
+    size_t count;
+    void *items[OBJ_POOL_MAGAZINE_SIZE];
+} magazine_t;
+
+typedef struct depot_t {
+    pthread_mutex_t lock;
+    magazine_t *full;
+    magazine_t *empty;
+} depot_t;
+
+typedef struct thread_cache_t {
+    magazine_t *loaded;
+    magazine_t *previous;
+} thread_cache_t;
+
+static depot_t depots[OBJ_POOL_CLASSES];
+static pthread_once_t depots_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+static _Thread_local thread_cache_t caches[OBJ_POOL_CLASSES];
+static _Thread_local bool cache_registered = false;
+
+static atomic_uint_fast64_t stat_allocs;
+static atomic_uint_fast64_t stat_frees;
+static atomic_uint_fast64_t stat_mallocs;
+static atomic_uint_fast64_t stat_depot_exchanges;
+
+static size_t class_size(size_t size_class) {
+    return (size_t)OBJ_POOL_MIN_SIZE << size_class;
+}
+
+static size_t size_class_of(size_t total) {
+    size_t size_class = 0;
+    while (size_class < OBJ_POOL_CLASSES && class_size(size_class) < total) {
+        size_class++;
+    }
+    return size_class;
+}
+
+static void push_magazine(magazine_t **list, magazine_t *mag) {
+    mag->next = *list;
+    *list = mag;
+}
+
+static magazine_t *pop_magazine(magazine_t **list) {
+    magazine_t *mag = *list;
+    if (mag != NULL) {
+        *list = mag->next;
+    }
+    return mag;
+}
+
+// Hands the magazines of an exiting thread back to the depots
+static void flush_thread_caches(void *unused) {
+    (void)unused;
+    for (size_t c = 0; c < OBJ_POOL_CLASSES; c++) {
+        depot_t *depot = &depots[c];
+        magazine_t *mags[] = {caches[c].loaded, caches[c].previous};
+        pthread_mutex_lock(&depot->lock);
+        for (size_t i = 0; i < 2; i++) {
+            if (mags[i] == NULL) {
+                continue;
+            }
+            push_magazine(mags[i]->count > 0 ? &depot->full : &depot->empty,
+                          mags[i]);
+        }
+        pthread_mutex_unlock(&depot->lock);
+        caches[c].loaded = NULL;
+        caches[c].previous = NULL;
+    }
+}
+
+static void init_depots(void) {
+    for (size_t c = 0; c < OBJ_POOL_CLASSES; c++) {
+        pthread_mutex_init(&depots[c].lock, NULL);
+        depots[c].full = NULL;
+        depots[c].empty = NULL;
+    }
+    pthread_key_create(&cache_key, flush_thread_caches);
+}
+
+static thread_cache_t *get_cache(size_t size_class) {
+    if (!cache_registered) {
+        pthread_once(&depots_once, init_depots);
+        // Any non-NULL value makes the destructor run at thread exit
+        pthread_setspecific(cache_key, &cache_registered);
+        cache_registered = true;
+    }
+    return &caches[size_class];
+}
+
+static void swap_magazines(thread_cache_t *cache) {
+    magazine_t *tmp = cache->loaded;
+    cache->loaded = cache->previous;
+    cache->previous = tmp;
+}
+
+static obj_header_t *cache_alloc(size_t size_class) {
+    thread_cache_t *cache = get_cache(size_class);
+
+    if (cache->loaded == NULL || cache->loaded->count == 0) {
+        if (cache->previous != NULL && cache->previous->count > 0) {
+            swap_magazines(cache);
+        } else {
+            // Both magazines are empty: trade one for a full one
+            depot_t *depot = &depots[size_class];
+            pthread_mutex_lock(&depot->lock);
+            magazine_t *full = pop_magazine(&depot->full);
+            if (full != NULL) {
+                if (cache->previous != NULL) {
+                    push_magazine(&depot->empty, cache->previous);
+                }
+                cache->previous = cache->loaded;
+                cache->loaded = full;
+            }
+            pthread_mutex_unlock(&depot->lock);
+            if (full == NULL) {
+                atomic_fetch_add(&stat_mallocs, 1);
+                return malloc(class_size(size_class));
+            }
+            atomic_fetch_add(&stat_depot_exchanges, 1);
+        }
+    }
+
+    return cache->loaded->items[--cache->loaded->count];
+}
+
+static void cache_free(obj_header_t *header) {
+    thread_cache_t *cache = get_cache(header->size_class);
+
+    if (cache->loaded == NULL ||
+        cache->loaded->count == OBJ_POOL_MAGAZINE_SIZE) {
+        if (cache->previous != NULL &&
+            cache->previous->count < OBJ_POOL_MAGAZINE_SIZE) {
+            swap_magazines(cache);
+        } else {
+            // Both magazines are full: trade one for an empty one
+            depot_t *depot = &depots[header->size_class];
+            pthread_mutex_lock(&depot->lock);
+            if (cache->previous != NULL) {
+                push_magazine(&depot->full, cache->previous);
+            }
+            magazine_t *empty = pop_magazine(&depot->empty);
+            pthread_mutex_unlock(&depot->lock);
+
+            if (empty == NULL) {
+                empty = malloc(sizeof(magazine_t));
+                if (empty == NULL) {
+                    free(header);
+                    return;
+                }
+            }
+            empty->count = 0;
+            cache->previous = cache->loaded;
+            cache->loaded = empty;
+            atomic_fetch_add(&stat_depot_exchanges, 1);
+        }
+    }
+
+    cache->loaded->items[cache->loaded->count++] = header;
+}
+
+void *obj_pool_alloc(size_t size) {
+    size_t total = size + sizeof(obj_header_t);
+    size_t size_class = size_class_of(total);
+    atomic_fetch_add(&stat_allocs, 1);
+
+    obj_header_t *header;
+    if (size_class == OBJ_POOL_LARGE) {
+        atomic_fetch_add(&stat_mallocs, 1);
+        header = malloc(total);
+    } else {
+        header = cache_alloc(size_class);
+    }
+    if (header == NULL) {
+        return NULL;
+    }
+    header->size_class = size_class;
+    return header + 1;
+}
+
+void *obj_pool_calloc(size_t size) {
+    void *ptr = obj_pool_alloc(size);
+    if (ptr != NULL) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void obj_pool_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    obj_header_t *header = (obj_header_t *)ptr - 1;
+    atomic_fetch_add(&stat_frees, 1);
+    if (header->size_class == OBJ_POOL_LARGE) {
+        free(header);
+    } else {
+        cache_free(header);
+    }
+}
+
+obj_pool_stats_t obj_pool_stats(void) {
+    obj_pool_stats_t stats = {
+        .allocs = atomic_load(&stat_allocs),
+        .frees = atomic_load(&stat_frees),
+        .mallocs = atomic_load(&stat_mallocs),
+        .depot_exchanges = atomic_load(&stat_depot_exchanges),
+    };
+    return stats;
+}
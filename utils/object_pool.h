@@ -0,0 +1,61 @@
+#ifndef __UTILS_OBJECT_POOL_H__
+#define __UTILS_OBJECT_POOL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Object pool for the small fixed-size objects that cross threads on every
+ * request (queue objects and protocol payloads).
+ *
+ * Objects are grouped in power-of-two size classes. Every thread keeps two
+ * magazines (arrays of free objects) per class, so allocating and freeing
+ * usually touches no lock at all. Full and empty magazines are exchanged with
+ * a per-class depot, which is what lets objects allocated by the register
+ * pipe reader and freed by the workers flow back without calling malloc.
+ */
+
+/**
+ * Allocation counters, for checking that the steady state makes no malloc
+ * calls
+ */
+typedef struct obj_pool_stats_t {
+    uint64_t allocs;
+    uint64_t frees;
+    // Objects that had to be obtained from malloc
+    uint64_t mallocs;
+    // Magazines exchanged with the depots
+    uint64_t depot_exchanges;
+} obj_pool_stats_t;
+
+/**
+ * @brief Allocates an object. Sizes above the largest class fall back to
+ * malloc.
+ *
+ * @param size the object size
+ * @return void* the object, or NULL if out of memory
+ */
+void *obj_pool_alloc(size_t size);
+
+/**
+ * @brief Allocates a zeroed object
+ *
+ * @param size the object size
+ * @return void* the object, or NULL if out of memory
+ */
+void *obj_pool_calloc(size_t size);
+
+/**
+ * @brief Returns an object obtained from @link obj_pool_alloc to the pool.
+ * Can be called from any thread.
+ *
+ * @param ptr the object (NULL is ignored)
+ */
+void obj_pool_free(void *ptr);
+
+/**
+ * @brief Returns a snapshot of the allocation counters
+ */
+obj_pool_stats_t obj_pool_stats(void);
+
+#endif // __UTILS_OBJECT_POOL_H__